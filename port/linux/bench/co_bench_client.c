@@ -0,0 +1,1147 @@
+/**
+ * @file co_bench_client.c
+ * @brief Throughput benchmark client for the corsacOTA websocket protocol.
+ *
+ * It speaks the protocol of the web frontend: the websocket handshake, "op=start&data=<size>", binary frames
+ * and the "state=ready&offset=" acknowledgements (or window grants), until "state=done". Each combination of
+ * frame size, fragmentation pattern, length encoding and ack mode is uploaded --runs times. The server restarts
+ * after each upload, the client waits for it to come back.
+ *
+ *   co_bench_client --port 3241 --size 1048576 --frame-sizes 1024,4096,16384 --patterns whole,split:536 --json out.json
+ *
+ * With any of the link options (--latency-us, --loss, ...), the connections go through the in-process link
+ * emulator of co_link.c, so Wi-Fi-like conditions can be compared with the same seed:
+ *
+ *   co_bench_client --latency-us 5000 --jitter-us 2000 --bandwidth-kbps 20000 --loss 0.01 --modes chunk,window
+ *
+ * The report is a JSON document on stdout (or --json), a summary is printed on stderr.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "co_link.h"
+
+#include "mbedtls/base64.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/sha256.h"
+
+#define CO_BENCH_FORMAT_VERSION 1
+#define CO_BENCH_MAX_ITEMS      16
+#define CO_BENCH_RX_SIZE        4096
+#define CO_BENCH_WS_GUID        "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define CO_BENCH_HANDSHAKE_MS   2000 // a server that is going down accepts, but never answers
+
+// long options without a short one
+#define CO_BENCH_OPT_SEED            256
+#define CO_BENCH_OPT_SHA256          257
+#define CO_BENCH_OPT_CONNECT_TIMEOUT 258
+#define CO_BENCH_OPT_TIMEOUT         259
+#define CO_BENCH_OPT_LATENCY         260
+#define CO_BENCH_OPT_JITTER          261
+#define CO_BENCH_OPT_BANDWIDTH       262
+#define CO_BENCH_OPT_MSS             263
+#define CO_BENCH_OPT_LOSS            264
+#define CO_BENCH_OPT_REORDER         265
+#define CO_BENCH_OPT_REORDER_DELAY   266
+#define CO_BENCH_OPT_RTO             267
+#define CO_BENCH_OPT_LINK_WINDOW     268
+
+#define WS_FIN                  0x80
+#define WS_OPCODE_CONTINUTAION  0x00
+#define WS_OPCODE_TEXT          0x01
+#define WS_OPCODE_BINARY        0x02
+#define WS_OPCODE_CLOSE         0x08
+#define WS_OPCODE_PING          0x09
+#define WS_OPCODE_PONG          0x0A
+#define WS_MASK                 0x80
+
+typedef enum {
+    CO_BENCH_PATTERN_WHOLE,  // one write per frame
+    CO_BENCH_PATTERN_HEADER, // the header and the payload in two writes
+    CO_BENCH_PATTERN_SPLIT,  // writes of arg bytes, a frame spans several TCP segments
+    CO_BENCH_PATTERN_WS,     // websocket fragmentation: continuation frames of arg bytes
+} co_bench_pattern_type_t;
+
+typedef struct {
+    co_bench_pattern_type_t type;
+    int arg;
+    char name[24];
+} co_bench_pattern_t;
+
+// Length encoding of the frame header. A longer encoding moves the payload, so the server
+// unmasks it at another alignment.
+typedef enum {
+    CO_BENCH_ALIGN_MIN, // the shortest encoding, as browsers do
+    CO_BENCH_ALIGN_16,  // 16-bit extended length, 8-byte header
+    CO_BENCH_ALIGN_64,  // 64-bit extended length, 14-byte header
+} co_bench_align_t;
+
+static const char *co_bench_align_names[] = {"min", "16", "64"};
+
+typedef enum {
+    CO_BENCH_MODE_CHUNK,  // wait for the ack of each chunk, like the frontend
+    CO_BENCH_MODE_WINDOW, // credit-based flow control ("window=1")
+} co_bench_mode_t;
+
+static const char *co_bench_mode_names[] = {"chunk", "window"};
+
+typedef struct {
+    double *val;
+    size_t num;
+    size_t cap;
+} co_bench_samples_t;
+
+typedef struct {
+    const char *host;
+    const char *port;
+    int image_size;
+    int runs;
+    uint64_t seed;
+    bool sha256;
+    int connect_timeout_ms;
+    int msg_timeout_ms;
+
+    bool link_enabled; // connect through the link emulator
+    co_link_config_t link;
+
+    int frame_sizes[CO_BENCH_MAX_ITEMS];
+    int frame_size_num;
+    co_bench_pattern_t patterns[CO_BENCH_MAX_ITEMS];
+    int pattern_num;
+    co_bench_align_t aligns[CO_BENCH_MAX_ITEMS];
+    int align_num;
+    co_bench_mode_t modes[CO_BENCH_MAX_ITEMS];
+    int mode_num;
+} co_bench_config_t;
+
+typedef struct {
+    int fd;
+    uint8_t rx[CO_BENCH_RX_SIZE];
+    size_t rx_len;
+    uint8_t *tx; // frame being built
+    size_t tx_size;
+    uint64_t rng;
+} co_bench_conn_t;
+
+typedef struct {
+    int frame_size;
+    const co_bench_pattern_t *pattern;
+    co_bench_align_t align;
+    co_bench_mode_t mode;
+} co_bench_case_t;
+
+// A reply of the server: code=<code>&data="<data>"
+typedef struct {
+    int code;
+    char data[256];
+    int offset; // -1: none
+    int window; // -1: none
+    bool done;
+} co_bench_reply_t;
+
+typedef struct {
+    co_bench_samples_t mb_per_s;
+    co_bench_samples_t time_to_done_ms;
+    co_bench_samples_t handshake_ms;
+    co_bench_samples_t ack_rtt_us;
+    int failed;
+    char error[256];
+} co_bench_result_t;
+
+static uint8_t *co_bench_image;
+static char co_bench_image_sha256[65];
+static char co_bench_device_type[32];
+static uint64_t co_bench_stream_id; // selects the random sequence of the link, set per run (not per connection
+                                    // attempt) so that retries while the server restarts do not shift it
+
+static int64_t co_bench_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t co_bench_rand(uint64_t *state) {
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void co_bench_samples_add(co_bench_samples_t *s, double val) {
+    if (s->num == s->cap) {
+        s->cap = s->cap == 0 ? 64 : s->cap * 2;
+        s->val = realloc(s->val, s->cap * sizeof(double));
+        if (s->val == NULL) {
+            abort();
+        }
+    }
+    s->val[s->num++] = val;
+}
+
+static int co_bench_cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest-rank percentile, the samples are sorted
+static double co_bench_percentile(const co_bench_samples_t *s, double p) {
+    size_t rank;
+
+    if (s->num == 0) {
+        return 0;
+    }
+    rank = (size_t)(p / 100.0 * s->num + 0.999999);
+    rank = rank == 0 ? 1 : rank;
+    return s->val[(rank > s->num ? s->num : rank) - 1];
+}
+
+static double co_bench_mean(const co_bench_samples_t *s) {
+    double sum = 0;
+    size_t i;
+
+    for (i = 0; i < s->num; i++) {
+        sum += s->val[i];
+    }
+    return s->num ? sum / s->num : 0;
+}
+
+/**
+ * @brief Send the whole buffer, in writes of at most max_write bytes (0: no limit).
+ *
+ */
+static int co_bench_send_all(int fd, const uint8_t *buf, size_t len, size_t max_write) {
+    size_t n;
+    ssize_t ret;
+
+    while (len > 0) {
+        n = max_write > 0 && len > max_write ? max_write : len;
+        ret = send(fd, buf, n, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static size_t co_bench_build_header(uint8_t *header, int opcode, bool fin, size_t len, co_bench_align_t align) {
+    size_t n = 2;
+
+    header[0] = (fin ? WS_FIN : 0) | opcode;
+    if (len < 126 && align == CO_BENCH_ALIGN_MIN) {
+        header[1] = WS_MASK | len;
+    } else if (len <= 0xFFFF && align != CO_BENCH_ALIGN_64) {
+        header[1] = WS_MASK | 126;
+        header[2] = len >> 8;
+        header[3] = len & 0xFF;
+        n += 2;
+    } else {
+        int i;
+        header[1] = WS_MASK | 127;
+        for (i = 0; i < 8; i++) {
+            header[2 + i] = (uint64_t)len >> (56 - 8 * i);
+        }
+        n += 8;
+    }
+
+    return n;
+}
+
+/**
+ * @brief Send one masked frame, written as the pattern says.
+ *
+ */
+static int co_bench_send_frame(co_bench_conn_t *conn, int opcode, bool fin, const uint8_t *payload, size_t len,
+                               const co_bench_pattern_t *pattern, co_bench_align_t align) {
+    uint8_t *p;
+    uint8_t mask[4];
+    size_t header_len, i;
+    uint32_t key;
+
+    if (len + 14 > conn->tx_size) {
+        conn->tx_size = len + 14;
+        conn->tx = realloc(conn->tx, conn->tx_size);
+        if (conn->tx == NULL) {
+            abort();
+        }
+    }
+
+    header_len = co_bench_build_header(conn->tx, opcode, fin, len, align);
+    key = (uint32_t)co_bench_rand(&conn->rng);
+    memcpy(mask, &key, 4);
+    memcpy(conn->tx + header_len, mask, 4);
+    header_len += 4;
+
+    p = conn->tx + header_len;
+    for (i = 0; i < len; i++) {
+        p[i] = payload[i] ^ mask[i & 3];
+    }
+
+    switch (pattern->type) {
+    case CO_BENCH_PATTERN_HEADER:
+        if (co_bench_send_all(conn->fd, conn->tx, header_len, 0) != 0) {
+            return -1;
+        }
+        return co_bench_send_all(conn->fd, p, len, 0);
+    case CO_BENCH_PATTERN_SPLIT:
+        return co_bench_send_all(conn->fd, conn->tx, header_len + len, pattern->arg);
+    default:
+        return co_bench_send_all(conn->fd, conn->tx, header_len + len, 0);
+    }
+}
+
+// Send the data of one message, fragmented into continuation frames with the "ws" pattern.
+static int co_bench_send_binary(co_bench_conn_t *conn, const uint8_t *data, size_t len, const co_bench_case_t *c) {
+    size_t n, sent = 0;
+
+    if (c->pattern->type != CO_BENCH_PATTERN_WS) {
+        return co_bench_send_frame(conn, WS_OPCODE_BINARY, true, data, len, c->pattern, c->align);
+    }
+
+    do {
+        n = len - sent > (size_t)c->pattern->arg ? (size_t)c->pattern->arg : len - sent;
+        if (co_bench_send_frame(conn, sent == 0 ? WS_OPCODE_BINARY : WS_OPCODE_CONTINUTAION, sent + n == len,
+                                data + sent, n, c->pattern, c->align) != 0) {
+            return -1;
+        }
+        sent += n;
+    } while (sent < len);
+
+    return 0;
+}
+
+static int co_bench_wait_readable(int fd, int timeout_ms) {
+    fd_set set;
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    return select(fd + 1, &set, NULL, NULL, &tv);
+}
+
+/**
+ * @brief Read the next text message. Pings are answered, other frames are ignored.
+ *
+ * @param timeout_ms 0: do not block
+ * @return 1: a message, 0: no message yet, -1: error or timeout
+ */
+static int co_bench_read_text(co_bench_conn_t *conn, char *text, size_t text_size, int timeout_ms) {
+    static const co_bench_pattern_t whole = {.type = CO_BENCH_PATTERN_WHOLE};
+    int64_t deadline = co_bench_now_us() + (int64_t)timeout_ms * 1000;
+    size_t header_len, len;
+    ssize_t ret;
+    int opcode;
+
+    while (1) {
+        // try to parse a complete frame, the server does not mask and sends less than 64KB
+        if (conn->rx_len >= 2) {
+            opcode = conn->rx[0] & 0x0F;
+            len = conn->rx[1] & 0x7F;
+            header_len = 2;
+            if (len == 126) {
+                header_len = 4;
+                len = conn->rx_len >= 4 ? (size_t)(conn->rx[2] << 8 | conn->rx[3]) : 0;
+            }
+
+            if (conn->rx_len >= header_len && conn->rx_len >= header_len + len) {
+                uint8_t *payload = conn->rx + header_len;
+                int result = 0;
+
+                if (opcode == WS_OPCODE_TEXT) {
+                    len = len < text_size - 1 ? len : text_size - 1;
+                    memcpy(text, payload, len);
+                    text[len] = '\0';
+                    result = 1;
+                } else if (opcode == WS_OPCODE_PING) {
+                    if (co_bench_send_frame(conn, WS_OPCODE_PONG, true, payload, len, &whole, CO_BENCH_ALIGN_MIN) != 0) {
+                        return -1;
+                    }
+                } else if (opcode == WS_OPCODE_CLOSE) {
+                    return -1;
+                }
+
+                memmove(conn->rx, conn->rx + header_len + len, conn->rx_len - header_len - len);
+                conn->rx_len -= header_len + len;
+                if (result) {
+                    return 1;
+                }
+                continue;
+            }
+        }
+
+        if (timeout_ms > 0) {
+            int64_t left = deadline - co_bench_now_us();
+            if (left <= 0 || co_bench_wait_readable(conn->fd, (int)(left / 1000) + 1) <= 0) {
+                return -1;
+            }
+        }
+
+        ret = recv(conn->fd, conn->rx + conn->rx_len, sizeof(conn->rx) - conn->rx_len, timeout_ms > 0 ? 0 : MSG_DONTWAIT);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && timeout_ms == 0) {
+            return 0;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        conn->rx_len += ret;
+    }
+}
+
+static int co_bench_get_int(const char *text, const char *key) {
+    const char *p = strstr(text, key);
+    return p != NULL ? atoi(p + strlen(key)) : -1;
+}
+
+static int co_bench_parse_reply(const char *text, co_bench_reply_t *reply) {
+    const char *data;
+    size_t len;
+
+    if (sscanf(text, "code=%d", &reply->code) != 1) {
+        return -1;
+    }
+
+    data = strstr(text, "data=\"");
+    reply->data[0] = '\0';
+    if (data != NULL) {
+        data += strlen("data=\"");
+        len = strcspn(data, "\"");
+        len = len < sizeof(reply->data) - 1 ? len : sizeof(reply->data) - 1;
+        memcpy(reply->data, data, len);
+        reply->data[len] = '\0';
+    }
+
+    reply->offset = co_bench_get_int(reply->data, "offset=");
+    reply->window = co_bench_get_int(reply->data, "window=");
+    reply->done = strstr(reply->data, "state=done") != NULL;
+    return 0;
+}
+
+static int co_bench_read_reply(co_bench_conn_t *conn, co_bench_reply_t *reply, int timeout_ms, char *error, size_t error_size) {
+    char text[512];
+    int ret = co_bench_read_text(conn, text, sizeof(text), timeout_ms);
+
+    if (ret < 0) {
+        snprintf(error, error_size, "connection lost or timeout waiting for the server");
+        return -1;
+    }
+    if (ret == 0) {
+        return 0;
+    }
+    if (co_bench_parse_reply(text, reply) != 0) {
+        snprintf(error, error_size, "malformed reply: %.200s", text);
+        return -1;
+    }
+    if (reply->code != 0) {
+        snprintf(error, error_size, "server error %d: %.200s", reply->code, reply->data);
+        return -1;
+    }
+    return 1;
+}
+
+static int co_bench_connect(const co_bench_config_t *config) {
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res, *ai;
+    int fd = -1, one = 1;
+
+    if (getaddrinfo(config->host, config->port, &hints, &res) != 0) {
+        return -1;
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    // the writes of a pattern become TCP segments
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (config->link_enabled) {
+        // the client talks to one end of a socket pair, the link relays the other end to the server
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+            close(fd);
+            return -1;
+        }
+        if (co_link_start(&config->link, sv[1], fd, co_bench_stream_id) != 0) {
+            close(sv[0]);
+            close(sv[1]);
+            close(fd);
+            return -1;
+        }
+        fd = sv[0];
+    }
+
+    return fd;
+}
+
+static int co_bench_handshake(co_bench_conn_t *conn, const co_bench_config_t *config) {
+    char request[512], response[1024], expected[64];
+    uint8_t nonce[16], digest[20];
+    char key[32], key_src[128];
+    size_t len = 0, olen;
+    char *end;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        nonce[i] = (uint8_t)co_bench_rand(&conn->rng);
+    }
+    mbedtls_base64_encode((unsigned char *)key, sizeof(key), &olen, nonce, sizeof(nonce));
+    key[olen] = '\0';
+
+    // the header of a browser, so that the server parses a realistic handshake
+    snprintf(request, sizeof(request),
+             "GET / HTTP/1.1\r\n"
+             "Host: %s:%s\r\n"
+             "Connection: Upgrade\r\n"
+             "Pragma: no-cache\r\n"
+             "Cache-Control: no-cache\r\n"
+             "User-Agent: co_bench_client\r\n"
+             "Upgrade: websocket\r\n"
+             "Sec-WebSocket-Version: 13\r\n"
+             "Accept-Encoding: gzip, deflate\r\n"
+             "Sec-WebSocket-Key: %s\r\n"
+             "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+             "\r\n",
+             config->host, config->port, key);
+    if (co_bench_send_all(conn->fd, (uint8_t *)request, strlen(request), 0) != 0) {
+        return -1;
+    }
+
+    while ((end = memmem(response, len, "\r\n\r\n", 4)) == NULL) {
+        if (len == sizeof(response) || co_bench_wait_readable(conn->fd, CO_BENCH_HANDSHAKE_MS) <= 0) {
+            return -1;
+        }
+        ret = recv(conn->fd, response + len, sizeof(response) - len, 0);
+        if (ret <= 0) {
+            return -1;
+        }
+        len += ret;
+    }
+
+    // keep what follows the HTTP response, it is websocket data
+    end += 4;
+    conn->rx_len = len - (end - response);
+    memcpy(conn->rx, end, conn->rx_len);
+    *end = '\0';
+
+    if (strncmp(response, "HTTP/1.1 101", 12) != 0) {
+        return -1;
+    }
+
+    snprintf(key_src, sizeof(key_src), "%s%s", key, CO_BENCH_WS_GUID);
+    mbedtls_sha1_ret((unsigned char *)key_src, strlen(key_src), digest);
+    mbedtls_base64_encode((unsigned char *)expected, sizeof(expected), &olen, digest, sizeof(digest));
+    expected[olen] = '\0';
+
+    return strstr(response, expected) != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Connect and upgrade to websocket. Retried until the timeout, as the server may be restarting.
+ *
+ * @param[out] t_attempt start time of the successful attempt
+ */
+static int co_bench_open(co_bench_conn_t *conn, const co_bench_config_t *config, int64_t *t_attempt) {
+    int64_t deadline = co_bench_now_us() + (int64_t)config->connect_timeout_ms * 1000;
+
+    do {
+        *t_attempt = co_bench_now_us();
+        conn->fd = co_bench_connect(config);
+        conn->rx_len = 0;
+        if (conn->fd >= 0) {
+            if (co_bench_handshake(conn, config) == 0) {
+                return 0;
+            }
+            close(conn->fd);
+            conn->fd = -1;
+        }
+        usleep(100 * 1000);
+    } while (co_bench_now_us() < deadline);
+
+    return -1;
+}
+
+/**
+ * @brief Upload the image once.
+ *
+ */
+static int co_bench_run(const co_bench_config_t *config, const co_bench_case_t *c, co_bench_conn_t *conn,
+                        co_bench_result_t *result) {
+    char start[256];
+    co_bench_reply_t reply;
+    int64_t t_open, t_start, t_done;
+    int64_t *sent_time; // send time of the last byte of each frame, by frame index
+    int *sent_end;
+    int head = 0, tail = 0;
+    int offset = 0, acked = 0, limit = 0, chunk, target, n, ret;
+    int max_frames;
+    bool have_reply;
+    char *error = result->error;
+    size_t error_size = sizeof(result->error);
+
+    if (co_bench_open(conn, config, &t_open) != 0) {
+        snprintf(error, error_size, "can not connect to %s:%s", config->host, config->port);
+        return -1;
+    }
+    t_start = co_bench_now_us();
+    co_bench_samples_add(&result->handshake_ms, (t_start - t_open) / 1000.0);
+
+    n = snprintf(start, sizeof(start), "op=start&data=%d", config->image_size);
+    if (c->mode == CO_BENCH_MODE_WINDOW) {
+        n += snprintf(start + n, sizeof(start) - n, "&window=1");
+    }
+    if (config->sha256) {
+        snprintf(start + n, sizeof(start) - n, "&sha256=%s", co_bench_image_sha256);
+    }
+
+    if (co_bench_send_frame(conn, WS_OPCODE_TEXT, true, (uint8_t *)start, strlen(start), c->pattern, CO_BENCH_ALIGN_MIN) != 0 ||
+        co_bench_read_reply(conn, &reply, config->msg_timeout_ms, error, error_size) <= 0) {
+        goto fail;
+    }
+    if (sscanf(reply.data, "deviceType=%31[^&]", co_bench_device_type) != 1 || reply.offset != 0) {
+        snprintf(error, error_size, "unexpected start reply: %.200s", reply.data);
+        goto fail;
+    }
+
+    // frames are also cut at chunk and window boundaries, the arrays grow when needed
+    max_frames = config->image_size / c->frame_size + 16;
+    sent_time = malloc(max_frames * sizeof(int64_t));
+    sent_end = malloc(max_frames * sizeof(int));
+    if (sent_time == NULL || sent_end == NULL) {
+        abort();
+    }
+
+    // the same chunk size as the frontend, see co_ota_start
+    chunk = config->image_size / 10 < 10240 ? config->image_size / 10 : 10240;
+    chunk = chunk < 1 ? 1 : chunk;
+    limit = c->mode == CO_BENCH_MODE_WINDOW ? reply.window : 0;
+    t_done = 0;
+
+    while (t_done == 0) {
+        if (c->mode == CO_BENCH_MODE_CHUNK) {
+            // stop and wait: the next chunk once everything sent is acknowledged
+            target = acked < offset ? offset : offset + chunk < config->image_size ? offset + chunk : config->image_size;
+        } else {
+            target = limit < config->image_size ? limit : config->image_size;
+        }
+
+        // send what the server accepts
+        have_reply = false;
+        while (offset < target) {
+            n = target - offset < c->frame_size ? target - offset : c->frame_size;
+            if (co_bench_send_binary(conn, co_bench_image + offset, n, c) != 0) {
+                snprintf(error, error_size, "send failed (%d)", errno);
+                goto fail_free;
+            }
+            offset += n;
+            if (tail == max_frames) {
+                max_frames *= 2;
+                sent_time = realloc(sent_time, max_frames * sizeof(int64_t));
+                sent_end = realloc(sent_end, max_frames * sizeof(int));
+                if (sent_time == NULL || sent_end == NULL) {
+                    abort();
+                }
+            }
+            sent_end[tail] = offset;
+            sent_time[tail++] = co_bench_now_us();
+
+            // window mode: take the grants as they come
+            if (c->mode == CO_BENCH_MODE_WINDOW) {
+                ret = co_bench_read_reply(conn, &reply, 0, error, error_size);
+                if (ret < 0) {
+                    goto fail_free;
+                }
+                if (ret > 0) {
+                    have_reply = true;
+                    break;
+                }
+            }
+        }
+
+        if (!have_reply) {
+            ret = co_bench_read_reply(conn, &reply, config->msg_timeout_ms, error, error_size);
+            if (ret <= 0) {
+                goto fail_free;
+            }
+        }
+
+        if (reply.done) {
+            t_done = co_bench_now_us();
+        }
+
+        // ack round trip: from the last byte acknowledged being sent, to the ack.
+        // Other messages (e.g. the erase progress) have no offset.
+        if (reply.offset > 0) {
+            int64_t t = 0;
+
+            acked = reply.offset;
+            while (head < tail && sent_end[head] <= reply.offset) {
+                t = sent_time[head++];
+            }
+            if (t > 0) {
+                co_bench_samples_add(&result->ack_rtt_us, (double)(co_bench_now_us() - t));
+            }
+            if (reply.window >= 0) {
+                limit = reply.offset + reply.window;
+            }
+        }
+    }
+
+    free(sent_time);
+    free(sent_end);
+
+    co_bench_samples_add(&result->time_to_done_ms, (t_done - t_start) / 1000.0);
+    co_bench_samples_add(&result->mb_per_s, config->image_size / ((t_done - t_start) / 1e6) / 1e6);
+
+    // the server restarts now, the next run waits for it in co_bench_open
+    close(conn->fd);
+    return 0;
+
+fail_free:
+    free(sent_time);
+    free(sent_end);
+fail:
+    close(conn->fd);
+    return -1;
+}
+
+static void co_bench_json_stats(FILE *fp, const char *name, co_bench_samples_t *s, bool last) {
+    qsort(s->val, s->num, sizeof(double), co_bench_cmp_double);
+    fprintf(fp, "      \"%s\": {\"count\": %zu, \"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}%s\n",
+            name, s->num, co_bench_mean(s), co_bench_percentile(s, 0), co_bench_percentile(s, 50),
+            co_bench_percentile(s, 90), co_bench_percentile(s, 99), co_bench_percentile(s, 100), last ? "" : ",");
+}
+
+static void co_bench_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', fp);
+        }
+        fputc((unsigned char)*s >= 0x20 ? *s : ' ', fp);
+    }
+    fputc('"', fp);
+}
+
+static int co_bench_parse_list(const char *arg, char items[][24], int max) {
+    int num = 0;
+    const char *p = arg;
+    size_t len;
+
+    while (*p != '\0' && num < max) {
+        len = strcspn(p, ",");
+        if (len == 0 || len >= 24) {
+            return -1;
+        }
+        memcpy(items[num], p, len);
+        items[num++][len] = '\0';
+        p += len;
+        p += *p == ',';
+    }
+
+    return num;
+}
+
+static int co_bench_parse_pattern(const char *s, co_bench_pattern_t *pattern) {
+    snprintf(pattern->name, sizeof(pattern->name), "%.23s", s);
+    pattern->arg = 0;
+
+    if (strcmp(s, "whole") == 0) {
+        pattern->type = CO_BENCH_PATTERN_WHOLE;
+    } else if (strcmp(s, "header") == 0) {
+        pattern->type = CO_BENCH_PATTERN_HEADER;
+    } else if (strncmp(s, "split:", 6) == 0) {
+        pattern->type = CO_BENCH_PATTERN_SPLIT;
+        pattern->arg = atoi(s + 6);
+    } else if (strncmp(s, "ws:", 3) == 0) {
+        pattern->type = CO_BENCH_PATTERN_WS;
+        pattern->arg = atoi(s + 3);
+    } else {
+        return -1;
+    }
+
+    return pattern->type >= CO_BENCH_PATTERN_SPLIT && pattern->arg <= 0 ? -1 : 0;
+}
+
+static int co_bench_parse_args(int argc, char **argv, co_bench_config_t *config, const char **json_path) {
+    static const struct option options[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"size", required_argument, NULL, 's'},
+        {"runs", required_argument, NULL, 'r'},
+        {"seed", required_argument, NULL, CO_BENCH_OPT_SEED},
+        {"sha256", no_argument, NULL, CO_BENCH_OPT_SHA256},
+        {"frame-sizes", required_argument, NULL, 'f'},
+        {"patterns", required_argument, NULL, 'P'},
+        {"aligns", required_argument, NULL, 'a'},
+        {"modes", required_argument, NULL, 'm'},
+        {"connect-timeout", required_argument, NULL, CO_BENCH_OPT_CONNECT_TIMEOUT},
+        {"timeout", required_argument, NULL, CO_BENCH_OPT_TIMEOUT},
+        {"latency-us", required_argument, NULL, CO_BENCH_OPT_LATENCY},
+        {"jitter-us", required_argument, NULL, CO_BENCH_OPT_JITTER},
+        {"bandwidth-kbps", required_argument, NULL, CO_BENCH_OPT_BANDWIDTH},
+        {"mss", required_argument, NULL, CO_BENCH_OPT_MSS},
+        {"loss", required_argument, NULL, CO_BENCH_OPT_LOSS},
+        {"reorder", required_argument, NULL, CO_BENCH_OPT_REORDER},
+        {"reorder-us", required_argument, NULL, CO_BENCH_OPT_REORDER_DELAY},
+        {"rto-ms", required_argument, NULL, CO_BENCH_OPT_RTO},
+        {"link-window", required_argument, NULL, CO_BENCH_OPT_LINK_WINDOW},
+        {"json", required_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    char items[CO_BENCH_MAX_ITEMS][24];
+    int opt, num, i, j;
+
+    while ((opt = getopt_long(argc, argv, "H:p:s:r:f:P:a:m:j:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'H':
+            config->host = optarg;
+            break;
+        case 'p':
+            config->port = optarg;
+            break;
+        case 's':
+            config->image_size = (int)strtol(optarg, NULL, 0);
+            break;
+        case 'r':
+            config->runs = atoi(optarg);
+            break;
+        case CO_BENCH_OPT_SEED:
+            config->seed = strtoull(optarg, NULL, 0);
+            break;
+        case CO_BENCH_OPT_SHA256:
+            config->sha256 = true;
+            break;
+        case CO_BENCH_OPT_CONNECT_TIMEOUT:
+            config->connect_timeout_ms = atoi(optarg) * 1000;
+            break;
+        case CO_BENCH_OPT_TIMEOUT:
+            config->msg_timeout_ms = atoi(optarg) * 1000;
+            break;
+        case CO_BENCH_OPT_LATENCY:
+            config->link.latency_us = strtoul(optarg, NULL, 0);
+            config->link_enabled = true;
+            break;
+        case CO_BENCH_OPT_JITTER:
+            config->link.jitter_us = strtoul(optarg, NULL, 0);
+            config->link_enabled = true;
+            break;
+        case CO_BENCH_OPT_BANDWIDTH:
+            config->link.bandwidth_kbps = strtoul(optarg, NULL, 0);
+            config->link_enabled = true;
+            break;
+        case CO_BENCH_OPT_MSS:
+            config->link.mss = strtoul(optarg, NULL, 0);
+            config->link_enabled = true;
+            break;
+        case CO_BENCH_OPT_LOSS:
+            config->link.loss = atof(optarg);
+            config->link_enabled = true;
+            break;
+        case CO_BENCH_OPT_REORDER:
+            config->link.reorder = atof(optarg);
+            config->link_enabled = true;
+            break;
+        case CO_BENCH_OPT_REORDER_DELAY:
+            config->link.reorder_us = strtoul(optarg, NULL, 0);
+            config->link_enabled = true;
+            break;
+        case CO_BENCH_OPT_RTO:
+            config->link.rto_us = strtoul(optarg, NULL, 0) * 1000;
+            config->link_enabled = true;
+            break;
+        case CO_BENCH_OPT_LINK_WINDOW:
+            config->link.window = strtoul(optarg, NULL, 0);
+            config->link_enabled = true;
+            break;
+        case 'j':
+            *json_path = optarg;
+            break;
+        case 'f':
+        case 'P':
+        case 'a':
+        case 'm':
+            num = co_bench_parse_list(optarg, items, CO_BENCH_MAX_ITEMS);
+            if (num <= 0) {
+                return -1;
+            }
+            for (i = 0; i < num; i++) {
+                if (opt == 'f') {
+                    config->frame_sizes[i] = (int)strtol(items[i], NULL, 0);
+                    if (config->frame_sizes[i] <= 0) {
+                        return -1;
+                    }
+                } else if (opt == 'P') {
+                    if (co_bench_parse_pattern(items[i], &config->patterns[i]) != 0) {
+                        return -1;
+                    }
+                } else if (opt == 'a') {
+                    for (j = 0; j < 3 && strcmp(items[i], co_bench_align_names[j]) != 0; j++) {
+                    }
+                    if (j == 3) {
+                        return -1;
+                    }
+                    config->aligns[i] = j;
+                } else {
+                    for (j = 0; j < 2 && strcmp(items[i], co_bench_mode_names[j]) != 0; j++) {
+                    }
+                    if (j == 2) {
+                        return -1;
+                    }
+                    config->modes[i] = j;
+                }
+            }
+            if (opt == 'f') {
+                config->frame_size_num = num;
+            } else if (opt == 'P') {
+                config->pattern_num = num;
+            } else if (opt == 'a') {
+                config->align_num = num;
+            } else {
+                config->mode_num = num;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return config->image_size > 0 && config->runs > 0 ? 0 : -1;
+}
+
+static void co_bench_usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -H, --host HOST            server address (127.0.0.1)\n"
+            "  -p, --port PORT            server port (3241)\n"
+            "  -s, --size BYTES           image size (1048576)\n"
+            "  -r, --runs N               uploads of each case (3)\n"
+            "      --seed N               seed of the image and the masks (1)\n"
+            "      --sha256               send the image hash, the server verifies it\n"
+            "  -f, --frame-sizes LIST     websocket frame payload sizes (1024,4096,16384)\n"
+            "  -P, --patterns LIST        how frames are written (whole):\n"
+            "                               whole     one write per frame\n"
+            "                               header    header and payload in two writes\n"
+            "                               split:N   writes of N bytes\n"
+            "                               ws:N      continuation frames of N bytes\n"
+            "  -a, --aligns LIST          length encoding: min, 16, 64 (min)\n"
+            "  -m, --modes LIST           ack mode: chunk, window (chunk)\n"
+            "      --connect-timeout SEC  time for the server to come back after a restart (30)\n"
+            "      --timeout SEC          time to wait for a reply (30)\n"
+            "link emulator, enabled by any of:\n"
+            "      --latency-us US        one-way delay (0)\n"
+            "      --jitter-us US         extra delay, uniform in [0, US] (0)\n"
+            "      --bandwidth-kbps KBPS  bandwidth of each direction (unlimited)\n"
+            "      --mss BYTES            segment size (1460)\n"
+            "      --loss P               probability that a segment is lost (0)\n"
+            "      --reorder P            probability that a segment arrives late (0)\n"
+            "      --reorder-us US        delay of a late segment (latency)\n"
+            "      --rto-ms MS            retransmission timeout of a lost segment (200)\n"
+            "      --link-window BYTES    bytes in flight, like the TCP window (5744, lwIP default)\n"
+            "  -j, --json FILE            write the report to FILE instead of stdout\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    co_bench_config_t config = {
+        .host = "127.0.0.1",
+        .port = "3241",
+        .image_size = 1024 * 1024,
+        .runs = 3,
+        .seed = 1,
+        .connect_timeout_ms = 30 * 1000,
+        .msg_timeout_ms = 30 * 1000,
+        .frame_sizes = {1024, 4096, 16384},
+        .frame_size_num = 3,
+        .patterns = {{.type = CO_BENCH_PATTERN_WHOLE, .name = "whole"}},
+        .pattern_num = 1,
+        .aligns = {CO_BENCH_ALIGN_MIN},
+        .align_num = 1,
+        .modes = {CO_BENCH_MODE_CHUNK},
+        .mode_num = 1,
+        .link = {
+            .mss = 1460,
+            .rto_us = 200 * 1000,
+            .window = 5744,
+        },
+    };
+    const char *json_path = NULL;
+    co_bench_conn_t conn = {.fd = -1};
+    mbedtls_sha256_context sha;
+    uint8_t digest[32];
+    uint64_t rng;
+    FILE *fp = stdout;
+    int f, p, a, m, r, i, failed = 0;
+    bool first = true;
+
+    if (co_bench_parse_args(argc, argv, &config, &json_path) != 0) {
+        co_bench_usage(argv[0]);
+        return 1;
+    }
+
+    // an app image: the magic byte, then random data which does not compress
+    co_bench_image = malloc(config.image_size);
+    if (co_bench_image == NULL) {
+        return 1;
+    }
+    rng = config.seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (i = 0; i < config.image_size; i++) {
+        co_bench_image[i] = (uint8_t)(co_bench_rand(&rng) >> 56);
+    }
+    co_bench_image[0] = 0xE9;
+
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    mbedtls_sha256_update_ret(&sha, co_bench_image, config.image_size);
+    mbedtls_sha256_finish_ret(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    for (i = 0; i < 32; i++) {
+        sprintf(co_bench_image_sha256 + 2 * i, "%02x", digest[i]);
+    }
+
+    conn.rng = config.seed;
+    config.link.seed = config.seed;
+    if (config.link.reorder_us == 0) {
+        config.link.reorder_us = config.link.latency_us;
+    }
+
+    if (json_path != NULL) {
+        fp = fopen(json_path, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "can not open %s\n", json_path);
+            return 1;
+        }
+    }
+
+    fprintf(fp, "{\n  \"tool\": \"co_bench_client\",\n  \"format\": %d,\n  \"timestamp\": %lld,\n", CO_BENCH_FORMAT_VERSION,
+            (long long)time(NULL));
+    fprintf(fp, "  \"server\": {\"host\": ");
+    co_bench_json_string(fp, config.host);
+    fprintf(fp, ", \"port\": ");
+    co_bench_json_string(fp, config.port);
+    fprintf(fp, "},\n  \"image_size\": %d,\n  \"runs\": %d,\n  \"seed\": %llu,\n  \"sha256\": %s,\n",
+            config.image_size, config.runs, (unsigned long long)config.seed, config.sha256 ? "true" : "false");
+    if (config.link_enabled) {
+        fprintf(fp, "  \"link\": {\"latency_us\": %u, \"jitter_us\": %u, \"bandwidth_kbps\": %u, \"mss\": %u, \"loss\": %g, "
+                    "\"reorder\": %g, \"reorder_us\": %u, \"rto_us\": %u, \"window\": %u},\n",
+                config.link.latency_us, config.link.jitter_us, config.link.bandwidth_kbps, config.link.mss, config.link.loss,
+                config.link.reorder, config.link.reorder_us, config.link.rto_us, config.link.window);
+    } else {
+        fprintf(fp, "  \"link\": null,\n");
+    }
+    fprintf(fp, "  \"results\": [\n");
+
+    for (m = 0; m < config.mode_num; m++) {
+        for (f = 0; f < config.frame_size_num; f++) {
+            for (p = 0; p < config.pattern_num; p++) {
+                for (a = 0; a < config.align_num; a++) {
+                    co_bench_case_t c = {
+                        .frame_size = config.frame_sizes[f],
+                        .pattern = &config.patterns[p],
+                        .align = config.aligns[a],
+                        .mode = config.modes[m],
+                    };
+                    co_bench_result_t result = {0};
+                    co_link_stats_t link_start, link_end;
+
+                    co_link_get_stats(&link_start);
+
+                    for (r = 0; r < config.runs; r++) {
+                        co_bench_stream_id++;
+                        if (co_bench_run(&config, &c, &conn, &result) != 0) {
+                            result.failed++;
+                            fprintf(stderr, "  run %d failed: %s\n", r, result.error);
+                        }
+                    }
+                    failed += result.failed;
+                    co_link_get_stats(&link_end);
+
+                    fprintf(stderr, "%-6s frame=%-6d pattern=%-10s align=%-3s: %7.3f MB/s, done %8.1f ms, ack rtt p50 %.0f us (%d/%d ok)\n",
+                            co_bench_mode_names[c.mode], c.frame_size, c.pattern->name, co_bench_align_names[c.align],
+                            co_bench_mean(&result.mb_per_s), co_bench_mean(&result.time_to_done_ms),
+                            (qsort(result.ack_rtt_us.val, result.ack_rtt_us.num, sizeof(double), co_bench_cmp_double),
+                             co_bench_percentile(&result.ack_rtt_us, 50)),
+                            config.runs - result.failed, config.runs);
+
+                    fprintf(fp, "%s    {\n      \"mode\": \"%s\",\n      \"frame_size\": %d,\n      \"pattern\": \"%s\",\n      \"align\": \"%s\",\n",
+                            first ? "" : ",\n", co_bench_mode_names[c.mode], c.frame_size, c.pattern->name,
+                            co_bench_align_names[c.align]);
+                    fprintf(fp, "      \"device_type\": ");
+                    co_bench_json_string(fp, co_bench_device_type);
+                    fprintf(fp, ",\n      \"ok\": %d,\n      \"failed\": %d,\n      \"error\": ", config.runs - result.failed, result.failed);
+                    if (result.failed) {
+                        co_bench_json_string(fp, result.error);
+                    } else {
+                        fprintf(fp, "null");
+                    }
+                    fprintf(fp, ",\n");
+                    if (config.link_enabled) {
+                        fprintf(fp, "      \"link\": {\"segments\": %llu, \"lost\": %llu, \"reordered\": %llu},\n",
+                                (unsigned long long)(link_end.segments - link_start.segments),
+                                (unsigned long long)(link_end.lost - link_start.lost),
+                                (unsigned long long)(link_end.reordered - link_start.reordered));
+                    }
+                    co_bench_json_stats(fp, "mb_per_s", &result.mb_per_s, false);
+                    co_bench_json_stats(fp, "time_to_done_ms", &result.time_to_done_ms, false);
+                    co_bench_json_stats(fp, "handshake_ms", &result.handshake_ms, false);
+                    co_bench_json_stats(fp, "ack_rtt_us", &result.ack_rtt_us, true);
+                    fprintf(fp, "    }");
+                    first = false;
+
+                    free(result.mb_per_s.val);
+                    free(result.time_to_done_ms.val);
+                    free(result.handshake_ms.val);
+                    free(result.ack_rtt_us.val);
+                }
+            }
+        }
+    }
+
+    fprintf(fp, "\n  ]\n}\n");
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    free(conn.tx);
+    free(co_bench_image);
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+"""Sweep the socket buffer size of corsacOTA_host and compare the upload throughput.
+
+For each size, corsacOTA_host is started with --socket-buffer and co_bench_client uploads through it. The
+other options are passed through, so the sweep can run with a flash model and the link emulator:
+
+  ./co_buffer_sweep.py --build build --sizes 1460,5744,16384 --server-args="--flash-model esp32 -q 4" \
+      --client-args="--latency-us 5000 --bandwidth-kbps 20000 --modes chunk,window"
+"""
+import argparse
+import json
+import os
+import shlex
+import subprocess
+import sys
+import tempfile
+
+
+def run_size(args, size, workdir):
+    server = [os.path.join(args.build, "corsacOTA_host"), "--port", str(args.port), "--flash",
+              os.path.join(workdir, "flash.bin"), "--socket-buffer", str(size)]
+    server += shlex.split(args.server_args)
+    report = os.path.join(workdir, "report_%d.json" % size)
+    client = [os.path.join(args.build, "co_bench_client"), "--port", str(args.port), "--json", report]
+    client += shlex.split(args.client_args)
+
+    # the server restarts itself with the same options after each upload
+    with open(os.path.join(workdir, "server_%d.log" % size), "w") as log:
+        proc = subprocess.Popen(server, stdout=log, stderr=subprocess.STDOUT)
+        try:
+            subprocess.run(client, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, check=True)
+        finally:
+            proc.terminate()
+            proc.wait()
+
+    with open(report) as fp:
+        return json.load(fp)["results"]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--build", default="build", help="directory of corsacOTA_host and co_bench_client")
+    parser.add_argument("--port", type=int, default=3241)
+    parser.add_argument("--sizes", default="1460,2920,5744,8192,16384,32768", help="socket buffer sizes")
+    parser.add_argument("--server-args", default="", help="extra options of corsacOTA_host")
+    parser.add_argument("--client-args", default="", help="extra options of co_bench_client")
+    args = parser.parse_args()
+
+    print("%8s  %-6s %6s %-10s %9s %9s %6s" % ("buffer", "mode", "frame", "pattern", "MB/s", "p50", "failed"))
+    with tempfile.TemporaryDirectory() as workdir:
+        for size in [int(s, 0) for s in args.sizes.split(",")]:
+            for r in run_size(args, size, workdir):
+                print("%8d  %-6s %6d %-10s %9.3f %9.3f %6d" % (size, r["mode"], r["frame_size"], r["pattern"],
+                                                                r["mb_per_s"]["mean"], r["mb_per_s"]["p50"],
+                                                                r["failed"]))
+            sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
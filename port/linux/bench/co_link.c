@@ -0,0 +1,295 @@
+/**
+ * @file co_link.c
+ * @brief Link emulator, see co_link.h
+ *
+ */
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "co_link.h"
+
+#define CO_LINK_READ_SIZE (64 * 1024)
+
+typedef struct co_link_segment {
+    struct co_link_segment *next;
+    int64_t deliver_us;
+    size_t len;
+    uint8_t data[];
+} co_link_segment_t;
+
+struct co_link;
+
+// one direction of the link: src is read, dst is written
+typedef struct co_link_dir {
+    struct co_link *link;
+    int src;
+    int dst;
+    uint64_t key;          // random sequence of this direction
+    uint64_t stream_pos;   // bytes read from src
+    int64_t link_free_us;  // when the bottleneck has sent the queued segments
+    int64_t last_deliver_us;
+    co_link_segment_t *head;
+    co_link_segment_t *tail;
+    size_t inflight;
+} co_link_dir_t;
+
+typedef struct co_link {
+    co_link_config_t config;
+    co_link_dir_t dir[2];
+    int refs;
+} co_link_t;
+
+static co_link_stats_t co_link_stats;
+
+static int64_t co_link_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t co_link_mix(uint64_t x) {
+    // splitmix64 finalizer
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief Queue the segments of the data read at the current stream position.
+ *
+ * The random draws of a segment depend on its stream position, not on how the reads were split.
+ */
+static void co_link_enqueue(co_link_dir_t *dir, const uint8_t *data, size_t len, int64_t now) {
+    const co_link_config_t *config = &dir->link->config;
+    co_link_segment_t *seg;
+    size_t n;
+    uint64_t r;
+    double p;
+    int64_t t;
+
+    while (len > 0) {
+        // cut at multiples of mss in the stream
+        n = config->mss - dir->stream_pos % config->mss;
+        n = n < len ? n : len;
+
+        seg = malloc(sizeof(co_link_segment_t) + n);
+        if (seg == NULL) {
+            abort();
+        }
+        memcpy(seg->data, data, n);
+        seg->len = n;
+        seg->next = NULL;
+
+        // serialization at the bottleneck
+        t = now > dir->link_free_us ? now : dir->link_free_us;
+        if (config->bandwidth_kbps > 0) {
+            t += (int64_t)n * 8 * 1000 / config->bandwidth_kbps;
+        }
+        dir->link_free_us = t;
+
+        r = co_link_mix(dir->key ^ co_link_mix(dir->stream_pos / config->mss));
+        t += config->latency_us;
+        if (config->jitter_us > 0) {
+            t += (uint32_t)r % (config->jitter_us + 1);
+        }
+
+        p = (double)(co_link_mix(r) >> 11) / (double)(1ULL << 53);
+        if (p < config->loss) {
+            t += config->rto_us;
+            __atomic_add_fetch(&co_link_stats.lost, 1, __ATOMIC_RELAXED);
+        } else if (p < config->loss + config->reorder) {
+            t += config->reorder_us;
+            __atomic_add_fetch(&co_link_stats.reordered, 1, __ATOMIC_RELAXED);
+        }
+
+        // in-order delivery: a late segment holds the ones behind it
+        seg->deliver_us = t > dir->last_deliver_us ? t : dir->last_deliver_us;
+        dir->last_deliver_us = seg->deliver_us;
+
+        if (dir->tail != NULL) {
+            dir->tail->next = seg;
+        } else {
+            dir->head = seg;
+        }
+        dir->tail = seg;
+
+        dir->inflight += n;
+        dir->stream_pos += n;
+        data += n;
+        len -= n;
+
+        __atomic_add_fetch(&co_link_stats.segments, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&co_link_stats.bytes, n, __ATOMIC_RELAXED);
+    }
+}
+
+static int co_link_write_all(int fd, const uint8_t *data, size_t len) {
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = send(fd, data, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void co_link_release(co_link_t *link) {
+    co_link_segment_t *seg;
+    int i;
+
+    if (__atomic_sub_fetch(&link->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    for (i = 0; i < 2; i++) {
+        while ((seg = link->dir[i].head) != NULL) {
+            link->dir[i].head = seg->next;
+            free(seg);
+        }
+    }
+    close(link->dir[0].src);
+    close(link->dir[0].dst);
+    free(link);
+}
+
+static void *co_link_thread(void *arg) {
+    co_link_dir_t *dir = arg;
+    const co_link_config_t *config = &dir->link->config;
+    co_link_segment_t *seg;
+    struct pollfd pfd;
+    struct timespec ts, *timeout;
+    uint8_t *buf;
+    bool eof = false, dead = false;
+    int64_t now, wait;
+    size_t room;
+    ssize_t n;
+
+    buf = malloc(CO_LINK_READ_SIZE);
+    if (buf == NULL) {
+        abort();
+    }
+
+    while (1) {
+        now = co_link_now_us();
+
+        // deliver the segments that have arrived
+        while ((seg = dir->head) != NULL && seg->deliver_us <= now) {
+            if (co_link_write_all(dir->dst, seg->data, seg->len) != 0) {
+                dead = true; // the receiver is gone
+                break;
+            }
+            dir->head = seg->next;
+            if (dir->head == NULL) {
+                dir->tail = NULL;
+            }
+            dir->inflight -= seg->len;
+            free(seg);
+        }
+
+        if (dead || (eof && dir->head == NULL)) {
+            break;
+        }
+
+        room = CO_LINK_READ_SIZE;
+        if (config->window > 0) {
+            room = dir->inflight < config->window ? config->window - dir->inflight : 0;
+            room = room < CO_LINK_READ_SIZE ? room : CO_LINK_READ_SIZE;
+        }
+
+        pfd.fd = dir->src;
+        pfd.events = !eof && room > 0 ? POLLIN : 0;
+        pfd.revents = 0;
+        timeout = NULL;
+        if (dir->head != NULL) {
+            wait = dir->head->deliver_us - co_link_now_us();
+            wait = wait > 0 ? wait : 0;
+            ts.tv_sec = wait / 1000000;
+            ts.tv_nsec = (wait % 1000000) * 1000;
+            timeout = &ts;
+        }
+
+        if (ppoll(&pfd, 1, timeout, NULL) < 0 && errno != EINTR) {
+            break;
+        }
+
+        if ((pfd.events & POLLIN) && (pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            n = recv(dir->src, buf, room, 0);
+            if (n <= 0) {
+                eof = true;
+            } else {
+                co_link_enqueue(dir, buf, n, co_link_now_us());
+            }
+        }
+    }
+
+    shutdown(dir->dst, SHUT_WR);
+    free(buf);
+    co_link_release(dir->link);
+    return NULL;
+}
+
+int co_link_start(const co_link_config_t *config, int fd_a, int fd_b, uint64_t stream_id) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    co_link_t *link;
+    int i;
+
+    link = calloc(1, sizeof(co_link_t));
+    if (link == NULL) {
+        return -1;
+    }
+
+    link->config = *config;
+    if (link->config.mss == 0) {
+        link->config.mss = 1460;
+    }
+    link->refs = 2;
+
+    for (i = 0; i < 2; i++) {
+        link->dir[i].link = link;
+        link->dir[i].src = i == 0 ? fd_a : fd_b;
+        link->dir[i].dst = i == 0 ? fd_b : fd_a;
+        link->dir[i].key = co_link_mix(co_link_mix(config->seed) ^ (stream_id * 2 + i));
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < 2; i++) {
+        if (pthread_create(&thread, &attr, co_link_thread, &link->dir[i]) != 0) {
+            // the threads already started own the link
+            if (i == 0) {
+                free(link);
+            } else {
+                shutdown(fd_a, SHUT_RDWR);
+                co_link_release(link);
+            }
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    return 0;
+}
+
+void co_link_get_stats(co_link_stats_t *stats) {
+    stats->segments = __atomic_load_n(&co_link_stats.segments, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&co_link_stats.bytes, __ATOMIC_RELAXED);
+    stats->lost = __atomic_load_n(&co_link_stats.lost, __ATOMIC_RELAXED);
+    stats->reordered = __atomic_load_n(&co_link_stats.reordered, __ATOMIC_RELAXED);
+}
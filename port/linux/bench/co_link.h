@@ -0,0 +1,50 @@
+/**
+ * @file co_link.h
+ * @brief Link emulator for the host benchmarks, in user space: no root, no netem.
+ *
+ * Two file descriptors are connected through the emulated link, one relay thread per direction.
+ * The link models what the application sees from TCP over a lossy link: the stream is cut into
+ * segments of at most mss bytes, each one is queued behind the bandwidth limit, delayed by latency
+ * and jitter, and delivered in order. A lost segment is delivered after the retransmission timeout,
+ * a reordered one after reorder_us, and the segments behind it wait (head-of-line blocking).
+ * The random draws only depend on the seed, the stream and the position of the segment in the stream:
+ * the same bytes see the same losses whatever the timing. The messages of the server may depend on timing
+ * (e.g. the window grants), so only the client to server direction is exactly repeatable.
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef struct co_link_config {
+    uint32_t latency_us;     // one-way delay
+    uint32_t jitter_us;      // extra delay, uniform in [0, jitter_us]
+    uint32_t bandwidth_kbps; // bottleneck bandwidth of each direction (in kbit/s). 0: unlimited
+    uint32_t mss;            // maximum segment size
+    double loss;             // probability that a segment is lost
+    double reorder;          // probability that a segment arrives late
+    uint32_t reorder_us;     // extra delay of a reordered segment
+    uint32_t rto_us;         // retransmission timeout of a lost segment
+    uint32_t window;         // bytes in flight in each direction, like the TCP receive window. 0: unlimited
+    uint64_t seed;
+} co_link_config_t;
+
+typedef struct co_link_stats {
+    uint64_t segments;
+    uint64_t bytes;
+    uint64_t lost;
+    uint64_t reordered;
+} co_link_stats_t;
+
+/**
+ * @brief Relay fd_a <-> fd_b through the link, until both directions are closed. The fds are closed then.
+ *
+ * @param stream_id selects the random sequence, e.g. the connection number
+ * @return 0 on success, -1 if the threads can not be created
+ */
+int co_link_start(const co_link_config_t *config, int fd_a, int fd_b, uint64_t stream_id);
+
+/**
+ * @brief Totals of all the links since the start.
+ *
+ */
+void co_link_get_stats(co_link_stats_t *stats);
@@ -0,0 +1,671 @@
+/**
+ * @file co_microbench.c
+ * @brief Microbenchmarks of the hot functions of corsacOTA.c, in ns/call and ns/byte.
+ *
+ * corsacOTA.c is compiled in, so the static functions are timed as they are built for the server. Each case
+ * runs batches of a calibrated number of calls, timed with the cycle counter (TSC on x86, the virtual counter
+ * on arm64) and converted to ns; the median batch is reported.
+ *
+ *   co_microbench                 all cases
+ *   co_microbench --filter mask   cases whose name contains "mask"
+ *   co_microbench --mask-sweep    every length 0-1024 and alignment 0-63 of each mask kernel, as CSV
+ *
+ * Every mask kernel the host can run is timed, not only the one selected for the server, so they can be compared.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if (defined __x86_64__) || (defined __i386__)
+#include <x86intrin.h>
+#endif
+
+#include "co_host.h"
+#include "lwip/sockets.h"
+
+// The replies are counted, not sent
+#undef send
+#define send co_mb_send
+static ssize_t co_mb_send(int fd, const void *buf, size_t len, int flags);
+#define CO_SENDMSG 0 // the replies are gathered and go through co_mb_send, like on the ESP8266
+
+#include "corsacOTA.c"
+
+#define CO_MB_BATCHES     11
+#define CO_MB_MAX_LEN     65536
+#define CO_MB_MAX_ALIGN   64
+#define CO_MB_SWEEP_LEN   1024
+#define CO_MB_HASH_CHUNK  4096
+#define CO_MB_FAKE_FD     0x40000000 // not a valid fd
+
+typedef void (*co_mb_fn_t)(void *arg, uint64_t n);
+
+static double co_mb_ns_per_tick = 1.0;
+static uint64_t co_mb_batch_ns = 1000000; // target duration of a batch
+static uint64_t co_mb_send_bytes;
+
+static ssize_t co_mb_send(int fd, const void *buf, size_t len, int flags) {
+    (void)fd;
+    (void)buf;
+    (void)flags;
+
+    co_mb_send_bytes += len;
+    return len;
+}
+
+// keep the compiler from dropping the work done on p
+static inline void co_mb_clobber(const void *p) {
+    __asm__ volatile("" : : "r"(p) : "memory");
+}
+
+static inline uint64_t co_mb_ticks(void) {
+#if (defined __x86_64__) || (defined __i386__)
+    unsigned int aux;
+    return __rdtscp(&aux);
+#elif (defined __aarch64__)
+    uint64_t v;
+    __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static int64_t co_mb_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void co_mb_calibrate(void) {
+    int64_t ns = co_mb_now_ns();
+    uint64_t ticks = co_mb_ticks();
+
+    while (co_mb_now_ns() - ns < 50000000) {
+    }
+    co_mb_ns_per_tick = (double)(co_mb_now_ns() - ns) / (double)(co_mb_ticks() - ticks);
+}
+
+static int co_mb_compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Time fn, the number of calls of a batch is doubled until the batch takes co_mb_batch_ns.
+ *
+ * @return median ns per call
+ */
+static double co_mb_measure(co_mb_fn_t fn, void *arg) {
+    double batch[CO_MB_BATCHES];
+    uint64_t n = 1, start;
+    int i;
+
+    fn(arg, 16); // warm up the caches and the branch predictor
+    while (1) {
+        start = co_mb_ticks();
+        fn(arg, n);
+        if ((co_mb_ticks() - start) * co_mb_ns_per_tick >= co_mb_batch_ns / 4 || n >= (1ULL << 32)) {
+            break;
+        }
+        n *= 2;
+    }
+    n *= 4;
+
+    for (i = 0; i < CO_MB_BATCHES; i++) {
+        start = co_mb_ticks();
+        fn(arg, n);
+        batch[i] = (co_mb_ticks() - start) * co_mb_ns_per_tick / n;
+    }
+
+    qsort(batch, CO_MB_BATCHES, sizeof(batch[0]), co_mb_compare_double);
+    return batch[CO_MB_BATCHES / 2];
+}
+
+static const char *co_mb_filter;
+
+static bool co_mb_selected(const char *name) {
+    return co_mb_filter == NULL || strstr(name, co_mb_filter) != NULL;
+}
+
+static void co_mb_report(const char *name, double ns, size_t bytes) {
+    if (bytes > 0) {
+        printf("%-52s %10.1f ns/call %8.3f ns/byte %9.1f MB/s\n", name, ns, ns / bytes, bytes * 1e3 / ns);
+    } else {
+        printf("%-52s %10.1f ns/call\n", name, ns);
+    }
+}
+
+/* co_mask_copy_* kernels of co_websocket_fast_mask and co_websocket_mask_copy */
+
+typedef void (*co_mb_kernel_fn_t)(uint8_t *dst, const uint8_t *src, uint32_t mask, size_t len);
+
+static const struct {
+    const char *name;
+    co_mb_kernel_fn_t fn;
+} co_mb_kernels[] = {
+    {"word32", co_mask_copy_word32},
+    {"unroll32", co_mask_copy_unroll32},
+    {"word64", co_mask_copy_word64},
+#if (defined __SSE2__)
+    {"sse2", co_mask_copy_sse2},
+#endif
+#if (defined __AVX2__)
+    {"avx2", co_mask_copy_avx2},
+#endif
+#if (defined __ARM_NEON)
+    {"neon", co_mask_copy_neon},
+#endif
+};
+
+#define CO_MB_KERNEL_NUM (sizeof(co_mb_kernels) / sizeof(co_mb_kernels[0]))
+
+typedef struct {
+    co_mb_kernel_fn_t kernel;
+    uint8_t *dst;
+    const uint8_t *src; // NULL: in place, like co_websocket_fast_mask
+    size_t len;
+} co_mb_mask_arg_t;
+
+static void co_mb_mask(void *arg, uint64_t n) {
+    co_mb_mask_arg_t *a = arg;
+    const uint8_t *src = a->src != NULL ? a->src : a->dst;
+
+    while (n--) {
+        a->kernel(a->dst, src, 0x5A3C9617, a->len);
+        co_mb_clobber(a->dst);
+    }
+}
+
+static void co_mb_run_mask(uint8_t *dst, uint8_t *src) {
+    static const size_t lens[] = {1, 2, 3, 4, 7, 8, 15, 16, 31, 32, 33, 63, 64, 65, 127, 128, 129,
+                                  256, 536, 1024, 1460, 4096, 10240, 65536};
+    char name[64];
+    co_mb_mask_arg_t arg;
+    double ns, best, worst;
+    size_t i, k, align;
+
+    for (k = 0; k < CO_MB_KERNEL_NUM; k++) {
+        arg.kernel = co_mb_kernels[k].fn;
+        for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+            snprintf(name, sizeof(name), "mask/%s len=%zu", co_mb_kernels[k].name, lens[i]);
+            if (co_mb_selected(name)) {
+                // aligned, and the worst of the misaligned starts
+                best = worst = 0;
+                arg.src = NULL;
+                arg.len = lens[i];
+                for (align = 0; align < CO_MB_MAX_ALIGN; align += align < 8 ? 1 : 8) {
+                    arg.dst = dst + align;
+                    ns = co_mb_measure(co_mb_mask, &arg);
+                    if (align == 0) {
+                        best = ns;
+                    }
+                    worst = ns > worst ? ns : worst;
+                }
+                co_mb_report(name, best, lens[i]);
+                snprintf(name, sizeof(name), "mask/%s len=%zu worst alignment", co_mb_kernels[k].name, lens[i]);
+                co_mb_report(name, worst, lens[i]);
+            }
+
+            snprintf(name, sizeof(name), "mask/%s copy len=%zu src+1", co_mb_kernels[k].name, lens[i]);
+            if (co_mb_selected(name)) {
+                // the payload follows a header of 6, 8 or 14 bytes, the source is never aligned
+                arg.dst = dst;
+                arg.src = src + 1;
+                arg.len = lens[i];
+                co_mb_report(name, co_mb_measure(co_mb_mask, &arg), lens[i]);
+            }
+        }
+    }
+}
+
+static void co_mb_run_mask_sweep(uint8_t *dst) {
+    co_mb_mask_arg_t arg;
+    size_t k, len, align;
+
+    printf("kernel,len,align,ns_per_call,ns_per_byte\n");
+    for (k = 0; k < CO_MB_KERNEL_NUM; k++) {
+        if (!co_mb_selected(co_mb_kernels[k].name)) {
+            continue;
+        }
+        arg.kernel = co_mb_kernels[k].fn;
+        arg.src = NULL;
+        for (len = 0; len <= CO_MB_SWEEP_LEN; len++) {
+            for (align = 0; align < CO_MB_MAX_ALIGN; align++) {
+                double ns;
+
+                arg.dst = dst + align;
+                arg.len = len;
+                ns = co_mb_measure(co_mb_mask, &arg);
+                printf("%s,%zu,%zu,%.2f,%.4f\n", co_mb_kernels[k].name, len, align, ns, len > 0 ? ns / len : 0.0);
+            }
+        }
+    }
+}
+
+/* co_websocket_process_header */
+
+typedef struct {
+    co_cb_t *cb;
+    co_socket_cb_t *scb;
+    uint8_t frame[16];
+    size_t len;
+    bool bytewise; // the header arrives one byte per recv
+} co_mb_header_arg_t;
+
+static void co_mb_process_header(void *arg, uint64_t n) {
+    co_mb_header_arg_t *a = arg;
+    co_socket_cb_t *scb = a->scb;
+    size_t avail;
+
+    while (n--) {
+        scb->status = CO_SOCKET_WEBSOCKET_HEADER;
+        scb->read_offset = 0;
+        if (a->bytewise) {
+            for (avail = 1; avail <= a->len; avail++) {
+                scb->remaining_len = avail;
+                co_websocket_process_header(a->cb, scb);
+            }
+        } else {
+            scb->remaining_len = a->len;
+            co_websocket_process_header(a->cb, scb);
+        }
+        co_mb_clobber(scb);
+    }
+}
+
+static void co_mb_run_header(co_cb_t *cb) {
+    static const struct {
+        const char *name;
+        size_t payload_len;
+    } cases[] = {
+        {"2-byte", 100},
+        {"4-byte", 4096},
+        {"10-byte", 70000},
+    };
+    co_mb_header_arg_t arg = {.cb = cb, .scb = cb->socket_list[0]};
+    char name[64];
+    size_t i, n;
+    int bytewise;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        // masked binary frame, like the ones of a browser
+        arg.frame[0] = WS_FIN | WS_OPCODE_BINARY;
+        n = 2;
+        if (cases[i].payload_len < 126) {
+            arg.frame[1] = WS_MASK | cases[i].payload_len;
+        } else if (cases[i].payload_len <= 0xFFFF) {
+            arg.frame[1] = WS_MASK | 126;
+            arg.frame[n++] = cases[i].payload_len >> 8;
+            arg.frame[n++] = cases[i].payload_len;
+        } else {
+            arg.frame[1] = WS_MASK | 127;
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                arg.frame[n++] = (uint64_t)cases[i].payload_len >> shift;
+            }
+        }
+        memcpy(arg.frame + n, "\x12\x34\x56\x78", 4);
+        arg.len = n + 4;
+
+        for (bytewise = 0; bytewise < 2; bytewise++) {
+            snprintf(name, sizeof(name), "header/process_header %s%s", cases[i].name,
+                     bytewise ? " bytewise" : "");
+            if (!co_mb_selected(name)) {
+                continue;
+            }
+            memcpy(arg.scb->buf, arg.frame, arg.len);
+            arg.bytewise = bytewise;
+            co_mb_report(name, co_mb_measure(co_mb_process_header, &arg), 0);
+        }
+    }
+}
+
+/* co_http_parse / co_websocket_handshake_send_key */
+
+static const char co_mb_chrome_handshake[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: 192.168.4.1:3241\r\n"
+    "Connection: Upgrade\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Upgrade: websocket\r\n"
+    "Origin: http://192.168.4.1\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+    "\r\n";
+
+static const char co_mb_firefox_handshake[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: 192.168.4.1:3241\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "Origin: http://192.168.4.1\r\n"
+    "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Connection: keep-alive, Upgrade\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Upgrade: websocket\r\n"
+    "\r\n";
+
+typedef struct {
+    const char *text;
+    int len;
+    int recv_size; // bytes handed to the parser at a time
+    bool response; // also build and send the 101 response
+} co_mb_http_arg_t;
+
+// the work of co_websocket_handshake_process on a request, without the recv()
+static void co_mb_http_parse(void *arg, uint64_t n) {
+    co_mb_http_arg_t *a = arg;
+    co_http_parser_t p;
+    int offset, len;
+
+    while (n--) {
+        co_http_parser_init(&p);
+        for (offset = 0; offset < a->len && p.state != CO_HTTP_DONE; offset += len) {
+            len = min(a->recv_size, a->len - offset);
+            co_http_parse(&p, a->text + offset, len);
+        }
+        if (a->response) {
+            co_websocket_handshake_send_key(CO_MB_FAKE_FD, p.key);
+        }
+        co_mb_clobber(&p);
+    }
+}
+
+static void co_mb_run_http(void) {
+    static const struct {
+        const char *browser;
+        const char *text;
+        size_t len;
+    } requests[] = {
+        {"chrome", co_mb_chrome_handshake, sizeof(co_mb_chrome_handshake) - 1},
+        {"firefox", co_mb_firefox_handshake, sizeof(co_mb_firefox_handshake) - 1},
+    };
+    static const struct {
+        const char *what;
+        int recv_size;
+        bool response;
+    } cases[] = {
+        {"parse", 0, false},
+        {"parse 64-byte recv", 64, false},
+        {"parse 1-byte recv", 1, false},
+        {"parse + 101 response", 0, true},
+    };
+    co_mb_http_arg_t arg;
+    char name[64];
+    size_t i, j;
+
+    for (i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        for (j = 0; j < sizeof(cases) / sizeof(cases[0]); j++) {
+            snprintf(name, sizeof(name), "http/%s %s", cases[j].what, requests[i].browser);
+            if (!co_mb_selected(name)) {
+                continue;
+            }
+            arg.text = requests[i].text;
+            arg.len = requests[i].len;
+            arg.recv_size = cases[j].recv_size > 0 ? cases[j].recv_size : arg.len;
+            arg.response = cases[j].response;
+            co_mb_report(name, co_mb_measure(co_mb_http_parse, &arg), requests[i].len);
+        }
+    }
+}
+
+/* co_parse_request_text / co_get_process_entry */
+
+typedef struct {
+    const char *text;
+} co_mb_request_arg_t;
+
+static void co_mb_parse_request(void *arg, uint64_t n) {
+    co_mb_request_arg_t *a = arg;
+    co_request_t req;
+
+    while (n--) {
+        co_parse_request_text(a->text, &req);
+        co_mb_clobber(&req);
+    }
+}
+
+static void co_mb_process_entry(void *arg, uint64_t n) {
+    co_mb_request_arg_t *a = arg;
+    co_process_fn_t fn;
+
+    while (n--) {
+        fn = co_get_process_entry((char *)a->text);
+        co_mb_clobber(&fn);
+    }
+}
+
+static void co_mb_run_request(void) {
+    static const struct {
+        const char *name;
+        const char *text;
+    } parse_cases[] = {
+        {"request/parse_request_text start", "op=start&data=1048576"},
+        {"request/parse_request_text start+window+sha256",
+         "op=start&data=1048576&window=1&sha256=9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08"},
+        {"request/parse_request_text stop", "op=stop&data="},
+    }, entry_cases[] = {
+        {"request/get_process_entry start", "start"},
+        {"request/get_process_entry stop", "stop"},
+        {"request/get_process_entry unknown", "auth"},
+    };
+    co_mb_request_arg_t arg;
+    size_t i;
+
+    for (i = 0; i < sizeof(parse_cases) / sizeof(parse_cases[0]); i++) {
+        if (co_mb_selected(parse_cases[i].name)) {
+            arg.text = parse_cases[i].text;
+            co_mb_report(parse_cases[i].name, co_mb_measure(co_mb_parse_request, &arg), strlen(arg.text));
+        }
+    }
+    for (i = 0; i < sizeof(entry_cases) / sizeof(entry_cases[0]); i++) {
+        if (co_mb_selected(entry_cases[i].name)) {
+            arg.text = entry_cases[i].text;
+            co_mb_report(entry_cases[i].name, co_mb_measure(co_mb_process_entry, &arg), 0);
+        }
+    }
+}
+
+/* co_websocket_send_msg_with_code / co_ack_send */
+
+typedef struct {
+    int code;
+    const char *msg;
+} co_mb_msg_arg_t;
+
+static void co_mb_send_msg(void *arg, uint64_t n) {
+    co_mb_msg_arg_t *a = arg;
+
+    while (n--) {
+        co_websocket_send_msg_with_code(a->code, a->msg);
+    }
+}
+
+// the ack of co_websocket_process_binary
+static void co_mb_send_ack(void *arg, uint64_t n) {
+    co_ack_t ack;
+
+    (void)arg;
+    while (n--) {
+        co_ack_begin(&ack, CO_ACK_READY);
+        co_ack_int(&ack, 1048576);
+        co_ack_send(&ack);
+    }
+}
+
+// the window grant of co_ota_send_window
+static void co_mb_send_window(void *arg, uint64_t n) {
+    co_ack_t ack;
+
+    (void)arg;
+    while (n--) {
+        co_ack_begin(&ack, CO_ACK_READY);
+        co_ack_int(&ack, 1048576);
+        co_ack_str(&ack, "&window=");
+        co_ack_int(&ack, 20480);
+        co_ack_send(&ack);
+    }
+}
+
+static void co_mb_run_send(co_cb_t *cb) {
+    static const struct {
+        const char *name;
+        int code;
+        const char *msg;
+    } cases[] = {
+        {"send/send_msg_with_code ack", CO_RES_SUCCESS, "state=ready&offset=1048576"},
+        {"send/send_msg_with_code window", CO_RES_SUCCESS, "state=ready&offset=1048576&window=20480"},
+        {"send/send_msg_with_code error", CO_RES_INVALID_STATUS, "OTA has not started"},
+    };
+    co_mb_msg_arg_t arg;
+    size_t i;
+
+    cb->websocket = cb->socket_list[0];
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (co_mb_selected(cases[i].name)) {
+            arg.code = cases[i].code;
+            arg.msg = cases[i].msg;
+            co_mb_report(cases[i].name, co_mb_measure(co_mb_send_msg, &arg), 0);
+        }
+    }
+    if (co_mb_selected("send/ack ready")) {
+        co_mb_report("send/ack ready", co_mb_measure(co_mb_send_ack, NULL), 0);
+    }
+    if (co_mb_selected("send/ack window")) {
+        co_mb_report("send/ack window", co_mb_measure(co_mb_send_window, NULL), 0);
+    }
+    cb->websocket = NULL;
+}
+
+/* SHA-256 of the firmware, see co_ota_start */
+
+typedef struct {
+    mbedtls_sha256_context ctx;
+    const uint8_t *data;
+} co_mb_hash_arg_t;
+
+static void co_mb_sha256(void *arg, uint64_t n) {
+    co_mb_hash_arg_t *a = arg;
+
+    while (n--) {
+        mbedtls_sha256_update_ret(&a->ctx, a->data, CO_MB_HASH_CHUNK);
+    }
+}
+
+static void co_mb_run_hash(const uint8_t *data) {
+    const char *name = "hash/sha256 4096-byte updates";
+    co_mb_hash_arg_t arg = {.data = data};
+    double ns;
+
+    if (!co_mb_selected(name)) {
+        return;
+    }
+
+    mbedtls_sha256_init(&arg.ctx);
+    mbedtls_sha256_starts_ret(&arg.ctx, 0);
+    ns = co_mb_measure(co_mb_sha256, &arg);
+    mbedtls_sha256_free(&arg.ctx);
+
+    co_mb_report(name, ns, CO_MB_HASH_CHUNK);
+    printf("%-52s %10.3f ms/MB\n", "hash/sha256 per MB", ns * (1 << 20) / CO_MB_HASH_CHUNK / 1e6);
+}
+
+static void co_mb_usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "      --filter TEXT   run the cases whose name contains TEXT\n"
+            "      --mask-sweep    every length and alignment of each mask kernel, as CSV (--filter: kernel)\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"filter", required_argument, NULL, 'f'},
+        {"mask-sweep", no_argument, NULL, 'm'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    co_config_t config = {
+        .max_listen_num = 1,
+    };
+    bool mask_sweep = false;
+    uint8_t *dst, *src;
+    co_socket_cb_t *scb;
+    co_cb_t *cb;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            co_mb_filter = optarg;
+            break;
+        case 'm':
+            mask_sweep = true;
+            break;
+        default:
+            co_mb_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    // 64-byte aligned, the cases add their own offset
+    dst = aligned_alloc(64, CO_MB_MAX_LEN + CO_MB_MAX_ALIGN);
+    src = aligned_alloc(64, CO_MB_MAX_LEN + CO_MB_MAX_ALIGN);
+    if (dst == NULL || src == NULL) {
+        return 1;
+    }
+    for (i = 0; i < CO_MB_MAX_LEN + CO_MB_MAX_ALIGN; i++) {
+        dst[i] = src[i] = (uint8_t)(i * 131 + 7);
+    }
+
+    co_mb_calibrate();
+
+    if (mask_sweep) {
+        co_mb_batch_ns = 100000; // 65600 cases per kernel
+        co_mb_run_mask_sweep(dst);
+        return 0;
+    }
+
+    cb = co_control_block_create(&config);
+    if (cb == NULL) {
+        return 1;
+    }
+    co_socket_list_init(cb);
+    global_cb = cb;
+    scb = cb->socket_list[0];
+    scb->fd = CO_MB_FAKE_FD;
+    scb->buf = malloc(cb->socket_buffer_size + 1);
+    if (scb->buf == NULL) {
+        return 1;
+    }
+
+    printf("mask kernel of the server %s, %.3f ns per timer tick\n", CO_MASK_KERNEL_NAME, co_mb_ns_per_tick);
+    co_mb_run_mask(dst, src);
+    co_mb_run_header(cb);
+    co_mb_run_http();
+    co_mb_run_request();
+    co_mb_run_send(cb);
+    co_mb_run_hash(src);
+
+    scb->fd = -1; // not a real socket, co_free_all must not close it
+    co_free_all(cb);
+    free(dst);
+    free(src);
+    return 0;
+}
@@ -0,0 +1,368 @@
+/**
+ * @file co_replay.c
+ * @brief Replay a capture file through the connection handling of the server, without sockets.
+ *
+ * corsacOTA_host --capture records every accept and recv() result of the server. Here, each recorded recv()
+ * result is returned by the recv() of the server, in the same order, so the frames are split exactly like in
+ * the captured session and co_websocket_process_header goes through the same partial states. The OTA is
+ * written to a flash file like corsacOTA_host does, and a restart boots the new partition like a real one.
+ *
+ *   co_replay --runs 10 session.cap
+ *
+ * By default the records are processed back to back, which times the server code alone (ns/byte and
+ * ns/call). --realtime keeps the gaps of the capture, to reproduce a slow session together with --flash-model.
+ */
+#include <getopt.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "co_host.h"
+#include "lwip/sockets.h"
+
+// The socket calls of the server read the capture
+#undef recv
+#undef send
+#define recv co_replay_recv
+#define send co_replay_send
+static ssize_t co_replay_recv(int fd, void *buf, size_t len, int flags);
+static ssize_t co_replay_send(int fd, const void *buf, size_t len, int flags);
+
+#define CONFIG_CO_RESTART_DELAY_MS 0 // nobody waits for the final message
+
+#define CO_REPLAY_FD_BASE 0x40000000 // not a valid fd, the other socket calls of the server fail with EBADF
+#define CO_FD_BASE        CO_REPLAY_FD_BASE
+#define CO_EVENT_POLL     1 // the poll set is only a table until poll() is called, which the replay never does
+#define CO_SENDMSG        0 // every reply goes through co_replay_send
+
+#include "corsacOTA.c"
+
+#define CO_REPLAY_MAX_RECV (64 * 1024)
+
+static const char *CO_REPLAY_TAG = "co_replay";
+
+static struct {
+    co_host_capture_record_t record; // the recv() result to return
+    uint8_t data[CO_REPLAY_MAX_RECV];
+    int32_t offset; // bytes of data already returned
+    bool pending;
+
+    // run state, kept out of the locals of co_replay_run because of longjmp
+    int64_t start_ns;
+    int64_t first_us; // time of the first record
+    int64_t busy_ns;  // time spent in the server code
+    uint32_t record_num;
+    uint32_t orphan_num; // records of a connection accepted before the capture started
+    uint64_t process_num;
+    uint64_t recv_num;
+    uint64_t recv_bytes;
+    uint64_t split_num; // recv() asked for fewer bytes than captured, the buffer size differs
+    uint64_t send_num;
+    uint64_t send_bytes;
+    uint32_t restart_num;
+    co_stats_t stats; // counters of the server, summed over the boots
+} co_replay;
+
+static jmp_buf co_replay_restart_point;
+
+static ssize_t co_replay_recv(int fd, void *buf, size_t len, int flags) {
+    size_t n;
+
+    (void)flags;
+
+    if (!co_replay.pending || fd != co_replay.record.fd + CO_REPLAY_FD_BASE) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (co_replay.record.len <= 0) {
+        co_replay.pending = false;
+        errno = co_replay.record.err;
+        return co_replay.record.len;
+    }
+
+    n = co_replay.record.len - co_replay.offset;
+    if (n > len) {
+        n = len;
+        co_replay.split_num++;
+    }
+    memcpy(buf, co_replay.data + co_replay.offset, n);
+    co_replay.offset += n;
+    co_replay.pending = co_replay.offset < co_replay.record.len;
+
+    co_replay.recv_num++;
+    co_replay.recv_bytes += n;
+    return n;
+}
+
+static ssize_t co_replay_send(int fd, const void *buf, size_t len, int flags) {
+    (void)buf;
+    (void)flags;
+
+    if (fd < CO_REPLAY_FD_BASE) {
+        return len; // the flash writer wakes the event loop, which the replay does not run
+    }
+
+    co_replay.send_num++;
+    co_replay.send_bytes += len;
+    return len;
+}
+
+static void co_replay_restart(void) {
+    longjmp(co_replay_restart_point, 1);
+}
+
+static int64_t co_replay_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief One step of co_event_process for the connection that received the record
+ *
+ */
+static void co_replay_process(co_cb_t *cb, co_socket_cb_t *scb) {
+    if (scb->status == CO_SOCKET_CLOSING) {
+        co_socket_close_cleanup(cb, scb);
+    } else if (co_socket_data_process(cb, scb) != ESP_OK) {
+        co_socket_close(cb, scb);
+    }
+    co_ota_poll(cb);
+}
+
+// the counters of the server are lost with its control block at each restart
+static void co_replay_add_stats(co_cb_t *cb) {
+    co_replay.stats.recv_bytes += cb->stats.recv_bytes;
+    co_replay.stats.payload_bytes += cb->stats.payload_bytes;
+    co_replay.stats.copy_bytes += cb->stats.copy_bytes;
+}
+
+static co_cb_t *co_replay_boot(co_config_t *config, const co_host_flash_config_t *flash_config) {
+    co_cb_t *cb;
+
+    if (co_host_flash_init(flash_config) != ESP_OK) {
+        return NULL;
+    }
+
+    memset(&co_alloc, 0, sizeof(co_alloc)); // the counters of a new boot
+    cb = co_control_block_create(config);
+    if (cb == NULL) {
+        return NULL;
+    }
+    co_socket_list_init(cb);
+    global_cb = cb;
+    return cb;
+}
+
+static int co_replay_run(FILE *fp, co_config_t *config, const co_host_flash_config_t *flash_config, bool realtime) {
+    co_alloc_stats_t alloc;
+    co_socket_cb_t *scb;
+    struct timespec ts;
+    int64_t t;
+    int ret;
+
+    memset(&co_replay, 0, sizeof(co_replay));
+    co_replay.first_us = -1;
+
+    // every run starts from an erased flash
+    unlink(flash_config->path);
+    if (co_replay_boot(config, flash_config) == NULL) {
+        return -1;
+    }
+    co_replay.start_ns = co_replay_now_ns();
+
+    if (setjmp(co_replay_restart_point) != 0) {
+        // the OTA is done, the next sessions of the capture talk to the new firmware
+        co_replay.restart_num++;
+        co_replay.pending = false;
+        co_replay_add_stats(global_cb);
+        co_free_all(global_cb);
+        if (co_replay_boot(config, flash_config) == NULL) {
+            return -1;
+        }
+    }
+
+    while ((ret = co_host_capture_read(fp, &co_replay.record, co_replay.data, sizeof(co_replay.data))) == 1) {
+        co_replay.record_num++;
+
+        if (realtime) {
+            if (co_replay.first_us < 0) {
+                co_replay.first_us = co_replay.record.time_us;
+            }
+            t = co_replay.start_ns + (co_replay.record.time_us - co_replay.first_us) * 1000;
+            ts.tv_sec = t / 1000000000;
+            ts.tv_nsec = t % 1000000000;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        if (co_replay.record.event == CO_CAPTURE_ACCEPT) {
+            if (co_socket_open(global_cb, co_replay.record.fd + CO_REPLAY_FD_BASE) != ESP_OK) {
+                ESP_LOGW(CO_REPLAY_TAG, "can not open connection %d", co_replay.record.fd);
+            }
+            continue;
+        }
+
+        scb = co_socket_find(global_cb, co_replay.record.fd + CO_REPLAY_FD_BASE);
+        if (scb == NULL) {
+            co_replay.orphan_num++;
+            continue;
+        }
+
+        co_replay.offset = 0;
+        co_replay.pending = true;
+        // with a smaller socket buffer than the captured server, a record takes several recv() calls
+        while (co_replay.pending && scb->fd != -1) {
+            t = co_replay_now_ns();
+            co_replay_process(global_cb, scb);
+            co_replay.busy_ns += co_replay_now_ns() - t;
+            co_replay.process_num++;
+        }
+    }
+
+    if (ret < 0) {
+        ESP_LOGE(CO_REPLAY_TAG, "truncated capture after %u records", (unsigned)co_replay.record_num);
+    }
+
+    corsacOTA_get_alloc_stats(&alloc);
+    co_replay_add_stats(global_cb);
+    co_free_all(global_cb);
+    co_host_flash_deinit();
+
+    fprintf(stderr,
+            "%u records (%u without connection), %llu bytes in %llu recv() and %llu process calls, "
+            "%llu bytes sent, %u restarts\n",
+            (unsigned)co_replay.record_num, (unsigned)co_replay.orphan_num, (unsigned long long)co_replay.recv_bytes,
+            (unsigned long long)co_replay.recv_num, (unsigned long long)co_replay.process_num,
+            (unsigned long long)co_replay.send_bytes, (unsigned)co_replay.restart_num);
+    fprintf(stderr, "heap: %u allocations, %u releases, %u since the last session started, %u pool buffers taken\n",
+            alloc.alloc_num, alloc.free_num, alloc.session_alloc_num, alloc.pool_num);
+    // the payload is unmasked once into the flash buffer, any other copy is overhead of the parser
+    fprintf(stderr, "copy: %llu payload bytes, %llu bytes moved in the socket buffer, %.6f per payload byte\n",
+            (unsigned long long)co_replay.stats.payload_bytes, (unsigned long long)co_replay.stats.copy_bytes,
+            co_replay.stats.payload_bytes > 0 ? (double)co_replay.stats.copy_bytes / co_replay.stats.payload_bytes
+                                              : 0.0);
+    if (co_replay.split_num > 0) {
+        fprintf(stderr, "%llu records were split, the socket buffer is smaller than in the capture\n",
+                (unsigned long long)co_replay.split_num);
+    }
+    fprintf(stderr, "process %.3f ms (wall %.3f ms), %.2f ns/byte, %.0f ns/call, %.1f MB/s\n",
+            co_replay.busy_ns / 1e6, (co_replay_now_ns() - co_replay.start_ns) / 1e6,
+            co_replay.recv_bytes > 0 ? (double)co_replay.busy_ns / co_replay.recv_bytes : 0.0,
+            co_replay.process_num > 0 ? (double)co_replay.busy_ns / co_replay.process_num : 0.0,
+            co_replay.busy_ns > 0 ? co_replay.recv_bytes * 1e3 / co_replay.busy_ns : 0.0);
+
+    return ret < 0 ? -1 : 0;
+}
+
+static void co_replay_usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options] CAPTURE\n"
+            "  -r, --runs N               replays of the capture (1)\n"
+            "  -f, --flash FILE           flash file, erased before each run (co_replay_flash.bin)\n"
+            "  -s, --ota-size SIZE        size of each OTA partition (0x180000)\n"
+            "      --flash-model NAME     flash timing of esp8266, esp32, esp32c3, esp32s3 or none (none)\n"
+            "      --realtime             keep the time between the records of the capture\n"
+            "      --static-buffers       static_buffers, then the sessions must not allocate\n"
+            "      --socket-buffer N      socket_buffer_size, smaller than in the capture splits the records\n"
+            "  -v, --verbose              debug log\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"runs", required_argument, NULL, 'r'},
+        {"flash", required_argument, NULL, 'f'},
+        {"ota-size", required_argument, NULL, 's'},
+        {"flash-model", required_argument, NULL, 'm'},
+        {"realtime", no_argument, NULL, 'R'},
+        {"static-buffers", no_argument, NULL, 'A'},
+        {"socket-buffer", required_argument, NULL, 'b'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    co_host_flash_config_t flash_config = {
+        .path = "co_replay_flash.bin",
+        .ota_size = 0x180000,
+        .timing = {.name = "none"},
+    };
+    co_config_t config = {
+        .max_listen_num = 4, // the same as corsacOTA_host
+        .wait_timeout_sec = 3600,
+    };
+    const co_host_flash_timing_t *profile;
+    bool realtime = false;
+    int runs = 1, i, opt;
+    FILE *fp;
+
+    while ((opt = getopt_long(argc, argv, "r:f:s:vh", options, NULL)) != -1) {
+        switch (opt) {
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'f':
+            flash_config.path = optarg;
+            break;
+        case 's':
+            flash_config.ota_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            profile = co_host_flash_get_profile(optarg);
+            if (profile == NULL) {
+                fprintf(stderr, "unknown flash model %s\n", optarg);
+                return 1;
+            }
+            flash_config.timing = *profile;
+            break;
+        case 'R':
+            realtime = true;
+            break;
+        case 'A':
+            config.static_buffers = 1;
+            break;
+        case 'b':
+            config.socket_buffer_size = strtol(optarg, NULL, 0);
+            break;
+        case 'v':
+            esp_log_level_set("*", ESP_LOG_DEBUG);
+            break;
+        default:
+            co_replay_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        co_replay_usage(argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[optind], "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "can not open %s\n", argv[optind]);
+        return 1;
+    }
+
+    co_host_set_restart_handler(co_replay_restart);
+
+    for (i = 0; i < runs; i++) {
+        rewind(fp);
+        if (co_host_capture_check(fp) != ESP_OK) {
+            fprintf(stderr, "%s is not a capture file\n", argv[optind]);
+            return 1;
+        }
+
+        fprintf(stderr, "run %d: ", i + 1);
+        if (co_replay_run(fp, &config, &flash_config, realtime) != 0) {
+            return 1;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file co_host_capture.c
+ * @brief Capture files of the recv() results of a session, see co_host_capture_record_t.
+ *
+ */
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "co_host.h"
+#include "esp_log.h"
+
+static const char *CO_HOST_TAG = "co_host_capture";
+
+FILE *co_host_capture_open(const char *path) {
+    FILE *fp = fopen(path, "ab");
+
+    if (fp == NULL) {
+        ESP_LOGE(CO_HOST_TAG, "can not open %s (%d)", path, errno);
+        return NULL;
+    }
+
+    if (ftell(fp) == 0) {
+        fwrite(CO_HOST_CAPTURE_MAGIC, 1, CO_HOST_CAPTURE_MAGIC_SIZE, fp);
+    }
+    return fp;
+}
+
+void co_host_capture_write(void *arg, int fd, co_capture_event_t event, const void *data, int len) {
+    co_host_capture_record_t record;
+    struct timespec ts;
+    FILE *fp = arg;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record.time_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    record.fd = fd;
+    record.event = event;
+    record.len = len;
+    record.err = len < 0 ? errno : 0;
+
+    fwrite(&record, sizeof(record), 1, fp);
+    if (event == CO_CAPTURE_RECV && len > 0) {
+        fwrite(data, 1, len, fp);
+    }
+    // the process may be killed at any time, the end of the session is the interesting part
+    fflush(fp);
+}
+
+esp_err_t co_host_capture_check(FILE *fp) {
+    char magic[CO_HOST_CAPTURE_MAGIC_SIZE];
+
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, CO_HOST_CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+int co_host_capture_read(FILE *fp, co_host_capture_record_t *record, void *data, size_t size) {
+    size_t n = fread(record, 1, sizeof(*record), fp);
+
+    if (n == 0) {
+        return 0;
+    }
+    if (n != sizeof(*record)) {
+        return -1;
+    }
+
+    if (record->event == CO_CAPTURE_RECV && record->len > 0) {
+        if ((size_t)record->len > size || fread(data, 1, record->len, fp) != (size_t)record->len) {
+            return -1;
+        }
+    }
+    return 1;
+}
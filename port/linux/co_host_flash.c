@@ -0,0 +1,469 @@
+/**
+ * @file co_host_flash.c
+ * @brief esp_partition and esp_ota stand-in backed by a memory mapped file.
+ *
+ * Erase sets the bytes to 0xFF and write clears bits, like NOR flash. Every operation holds the flash lock
+ * for the duration given by the timing model, as the SPI flash can only do one thing at a time. With
+ * cache_stall, the other tasks also wait at their next stall point, as the cache is disabled on the chip.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "co_host.h"
+#include "esp_image_format.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+
+static const char *CO_HOST_TAG = "co_host_flash";
+
+#define CO_HOST_OTADATA_SIZE  (2 * SPI_FLASH_SEC_SIZE)
+#define CO_HOST_OTADATA_MAGIC 0x4F544144 // "OTAD"
+#define CO_HOST_FLASH_BLOCK_SIZE (64 * 1024)
+
+typedef struct co_host_otadata {
+    uint32_t magic;
+    uint32_t boot_index;
+} co_host_otadata_t;
+
+static struct {
+    co_host_flash_config_t config;
+    int fd;
+    uint8_t *mem;
+    size_t size;
+
+    esp_partition_t otadata;
+    esp_partition_t app[2];
+    const esp_partition_t *boot;
+    const esp_partition_t *running;
+    int64_t confirm_us; // the running app is confirmed at this time, see esp_ota_get_state_partition
+
+    pthread_mutex_t lock;
+    co_host_flash_stats_t stats;
+
+    // cache_stall: set while an operation runs, the other tasks wait on stall_cond
+    pthread_mutex_t stall_lock;
+    pthread_cond_t stall_cond;
+    bool stalled;
+    pthread_t stall_owner;
+} co_host_flash = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .stall_lock = PTHREAD_MUTEX_INITIALIZER,
+    .stall_cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Typical numbers of the flash chips the modules ship with (e.g. GD25Q32/W25Q32 class), in the default SPI mode
+// and clock of each target. Real chips vary by 2x, override them with the explicit timing options.
+static const co_host_flash_timing_t co_host_flash_profiles[] = {
+    {.name = "none"},
+    {
+        .name = "esp8266", // 40MHz, no block erase in spi_flash_erase_range
+        .op_us = 50,
+        .sector_erase_us = 40000,
+        .page_program_us = 700,
+        .read_mb_s = 8,
+        .cache_stall = true,
+    },
+    {
+        .name = "esp32", // 40MHz DIO
+        .op_us = 30,
+        .sector_erase_us = 40000,
+        .block_erase_us = 150000,
+        .page_program_us = 600,
+        .read_mb_s = 10,
+        .cache_stall = true,
+    },
+    {
+        .name = "esp32c3", // 80MHz DIO
+        .op_us = 20,
+        .sector_erase_us = 35000,
+        .block_erase_us = 140000,
+        .page_program_us = 500,
+        .read_mb_s = 20,
+        .cache_stall = true,
+    },
+    {
+        .name = "esp32s3", // 80MHz QIO
+        .op_us = 15,
+        .sector_erase_us = 30000,
+        .block_erase_us = 120000,
+        .page_program_us = 400,
+        .read_mb_s = 40,
+        .cache_stall = true,
+    },
+};
+
+const co_host_flash_timing_t *co_host_flash_get_profile(const char *name) {
+    size_t i;
+
+    for (i = 0; i < sizeof(co_host_flash_profiles) / sizeof(co_host_flash_profiles[0]); i++) {
+        if (strcmp(co_host_flash_profiles[i].name, name) == 0) {
+            return &co_host_flash_profiles[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Default timing model, offset is the flash address of the operation.
+ *
+ */
+static uint32_t co_host_flash_default_duration(const co_host_flash_timing_t *timing, co_host_flash_op_t op,
+                                               size_t offset, size_t size) {
+    uint64_t us = timing->op_us;
+    size_t end = offset + size;
+
+    switch (op) {
+    case CO_HOST_FLASH_OP_READ:
+        if (timing->read_mb_s != 0) {
+            us += size / timing->read_mb_s; // 1MB/s is a byte per microsecond
+        }
+        break;
+    case CO_HOST_FLASH_OP_WRITE:
+        // pages spanned by the range
+        us += (uint64_t)((end - 1) / CO_HOST_FLASH_PAGE_SIZE - offset / CO_HOST_FLASH_PAGE_SIZE + 1) *
+              timing->page_program_us;
+        break;
+    case CO_HOST_FLASH_OP_ERASE:
+        while (offset < end) {
+            if (timing->block_erase_us != 0 && offset % CO_HOST_FLASH_BLOCK_SIZE == 0 &&
+                end - offset >= CO_HOST_FLASH_BLOCK_SIZE) {
+                us += timing->block_erase_us;
+                offset += CO_HOST_FLASH_BLOCK_SIZE;
+            } else {
+                us += timing->sector_erase_us;
+                offset += SPI_FLASH_SEC_SIZE;
+            }
+        }
+        break;
+    }
+
+    return us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static uint32_t co_host_flash_duration(co_host_flash_op_t op, size_t address, size_t size) {
+    const co_host_flash_timing_t *timing = &co_host_flash.config.timing;
+
+    if (timing->duration_us != NULL) {
+        return timing->duration_us(timing, op, address, size);
+    }
+    return co_host_flash_default_duration(timing, op, address, size);
+}
+
+static void co_host_flash_delay(uint32_t us) {
+    struct timespec deadline;
+
+    if (us == 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += us / 1000000;
+    deadline.tv_nsec += (long)(us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+}
+
+static esp_err_t co_host_flash_check_range(const esp_partition_t *partition, size_t offset, size_t size) {
+    if (co_host_flash.mem == NULL || partition == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (offset > partition->size || size > partition->size - offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+static void co_host_flash_lock(int64_t *start) {
+    pthread_mutex_lock(&co_host_flash.lock);
+    *start = esp_timer_get_time();
+
+    if (co_host_flash.config.timing.cache_stall) {
+        pthread_mutex_lock(&co_host_flash.stall_lock);
+        co_host_flash.stall_owner = pthread_self();
+        __atomic_store_n(&co_host_flash.stalled, true, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&co_host_flash.stall_lock);
+    }
+}
+
+static void co_host_flash_unlock(int64_t start) {
+    if (co_host_flash.config.timing.cache_stall) {
+        pthread_mutex_lock(&co_host_flash.stall_lock);
+        __atomic_store_n(&co_host_flash.stalled, false, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&co_host_flash.stall_cond);
+        pthread_mutex_unlock(&co_host_flash.stall_lock);
+    }
+
+    co_host_flash.stats.busy_us += esp_timer_get_time() - start;
+    pthread_mutex_unlock(&co_host_flash.lock);
+}
+
+void co_host_flash_stall_point(void) {
+    int64_t start;
+
+    if (!__atomic_load_n(&co_host_flash.stalled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_mutex_lock(&co_host_flash.stall_lock);
+    if (co_host_flash.stalled && !pthread_equal(co_host_flash.stall_owner, pthread_self())) {
+        start = esp_timer_get_time();
+        while (co_host_flash.stalled) {
+            pthread_cond_wait(&co_host_flash.stall_cond, &co_host_flash.stall_lock);
+        }
+        __atomic_add_fetch(&co_host_flash.stats.stall_us, esp_timer_get_time() - start, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&co_host_flash.stall_lock);
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size) {
+    int64_t start;
+    esp_err_t ret = co_host_flash_check_range(partition, src_offset, size);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    co_host_flash_lock(&start);
+    memcpy(dst, co_host_flash.mem + partition->address + src_offset, size);
+    co_host_flash_delay(co_host_flash_duration(CO_HOST_FLASH_OP_READ, partition->address + src_offset, size));
+    co_host_flash.stats.read_bytes += size;
+    co_host_flash_unlock(start);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size) {
+    int64_t start;
+    uint8_t *dst;
+    const uint8_t *data = src;
+    size_t i;
+    bool dirty = false;
+    esp_err_t ret = co_host_flash_check_range(partition, dst_offset, size);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (size == 0) {
+        return ESP_OK;
+    }
+
+    co_host_flash_lock(&start);
+    dst = co_host_flash.mem + partition->address + dst_offset;
+    for (i = 0; i < size; i++) {
+        dirty |= (data[i] & ~dst[i]) != 0;
+        dst[i] &= data[i];
+    }
+
+    co_host_flash_delay(co_host_flash_duration(CO_HOST_FLASH_OP_WRITE, partition->address + dst_offset, size));
+
+    co_host_flash.stats.write_bytes += size;
+    if (dirty) {
+        co_host_flash.stats.dirty_writes++;
+    }
+    co_host_flash_unlock(start);
+
+    if (dirty) {
+        ESP_LOGW(CO_HOST_TAG, "%s: write to a non-erased range at 0x%x+%zu", partition->label,
+                 (unsigned)dst_offset, size);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size) {
+    int64_t start;
+    esp_err_t ret = co_host_flash_check_range(partition, offset, size);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (offset % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (size % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    co_host_flash_lock(&start);
+    memset(co_host_flash.mem + partition->address + offset, 0xFF, size);
+    co_host_flash_delay(co_host_flash_duration(CO_HOST_FLASH_OP_ERASE, partition->address + offset, size));
+    co_host_flash.stats.erase_num += size / SPI_FLASH_SEC_SIZE;
+    co_host_flash_unlock(start);
+
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_boot_partition(void) {
+    return co_host_flash.boot;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void) {
+    return co_host_flash.running;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from) {
+    if (co_host_flash.running == NULL) {
+        return NULL;
+    }
+    if (start_from == NULL) {
+        start_from = co_host_flash.running;
+    }
+
+    return start_from == &co_host_flash.app[0] ? &co_host_flash.app[1] : &co_host_flash.app[0];
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) {
+    co_host_otadata_t otadata;
+    uint8_t magic;
+    esp_err_t ret;
+
+    if (partition != &co_host_flash.app[0] && partition != &co_host_flash.app[1]) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    ret = esp_partition_read(partition, 0, &magic, 1);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (magic != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(CO_HOST_TAG, "%s: invalid image magic 0x%02x", partition->label, magic);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+
+    otadata.magic = CO_HOST_OTADATA_MAGIC;
+    otadata.boot_index = partition == &co_host_flash.app[1];
+    ret = esp_partition_erase_range(&co_host_flash.otadata, 0, SPI_FLASH_SEC_SIZE);
+    if (ret == ESP_OK) {
+        ret = esp_partition_write(&co_host_flash.otadata, 0, &otadata, sizeof(otadata));
+    }
+    if (ret != ESP_OK) {
+        return ESP_ERR_OTA_SELECT_INFO_INVALID;
+    }
+
+    co_host_flash.boot = partition;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state) {
+    if (partition != &co_host_flash.app[0] && partition != &co_host_flash.app[1]) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (partition != co_host_flash.running) {
+        *ota_state = ESP_OTA_IMG_UNDEFINED;
+    } else if (co_host_flash.confirm_us < 0 || esp_timer_get_time() < co_host_flash.confirm_us) {
+        *ota_state = ESP_OTA_IMG_PENDING_VERIFY;
+    } else {
+        *ota_state = ESP_OTA_IMG_VALID;
+    }
+    return ESP_OK;
+}
+
+static void co_host_partition_set(esp_partition_t *partition, esp_partition_type_t type,
+                                  esp_partition_subtype_t subtype, uint32_t address, uint32_t size, const char *label) {
+    partition->type = type;
+    partition->subtype = subtype;
+    partition->address = address;
+    partition->size = size;
+    strncpy(partition->label, label, sizeof(partition->label) - 1);
+    partition->encrypted = false;
+}
+
+esp_err_t co_host_flash_init(const co_host_flash_config_t *config) {
+    co_host_otadata_t otadata;
+    struct stat st;
+    size_t size;
+    int fd;
+
+    if (config == NULL || config->path == NULL || config->ota_size == 0 ||
+        config->ota_size % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size = CO_HOST_OTA_0_ADDRESS + 2 * (size_t)config->ota_size;
+    fd = open(config->path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        ESP_LOGE(CO_HOST_TAG, "can not open %s (%d)", config->path, errno);
+        return ESP_FAIL;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+        // a new (or resized) flash is erased
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+            ESP_LOGE(CO_HOST_TAG, "can not resize %s (%d)", config->path, errno);
+            close(fd);
+            return ESP_FAIL;
+        }
+        co_host_flash.mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (co_host_flash.mem != MAP_FAILED) {
+            memset(co_host_flash.mem, 0xFF, size);
+        }
+    } else {
+        co_host_flash.mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    if (co_host_flash.mem == MAP_FAILED) {
+        ESP_LOGE(CO_HOST_TAG, "can not map %s (%d)", config->path, errno);
+        co_host_flash.mem = NULL;
+        close(fd);
+        return ESP_FAIL;
+    }
+
+    co_host_flash.config = *config;
+    co_host_flash.fd = fd;
+    co_host_flash.size = size;
+    memset(&co_host_flash.stats, 0, sizeof(co_host_flash.stats));
+
+    co_host_partition_set(&co_host_flash.otadata, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA,
+                          CO_HOST_OTADATA_ADDRESS, CO_HOST_OTADATA_SIZE, "otadata");
+    co_host_partition_set(&co_host_flash.app[0], ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0,
+                          CO_HOST_OTA_0_ADDRESS, config->ota_size, "ota_0");
+    co_host_partition_set(&co_host_flash.app[1], ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1,
+                          CO_HOST_OTA_0_ADDRESS + config->ota_size, config->ota_size, "ota_1");
+
+    // "boot" the partition selected by the last esp_ota_set_boot_partition, ota_0 by default
+    memcpy(&otadata, co_host_flash.mem + CO_HOST_OTADATA_ADDRESS, sizeof(otadata));
+    if (otadata.magic == CO_HOST_OTADATA_MAGIC && otadata.boot_index < 2) {
+        co_host_flash.boot = &co_host_flash.app[otadata.boot_index];
+    } else {
+        co_host_flash.boot = &co_host_flash.app[0];
+    }
+    co_host_flash.running = co_host_flash.boot;
+    co_host_flash.confirm_us = config->pending_verify_ms < 0 ? -1 : esp_timer_get_time() + config->pending_verify_ms * 1000;
+
+    ESP_LOGI(CO_HOST_TAG, "%s: %zu bytes, running %s, timing %s", config->path, size, co_host_flash.running->label,
+             config->timing.name != NULL ? config->timing.name : "custom");
+    return ESP_OK;
+}
+
+void co_host_flash_deinit(void) {
+    if (co_host_flash.mem == NULL) {
+        return;
+    }
+
+    msync(co_host_flash.mem, co_host_flash.size, MS_SYNC);
+    munmap(co_host_flash.mem, co_host_flash.size);
+    close(co_host_flash.fd);
+
+    co_host_flash.mem = NULL;
+    co_host_flash.fd = -1;
+    co_host_flash.boot = NULL;
+    co_host_flash.running = NULL;
+}
+
+void co_host_flash_get_stats(co_host_flash_stats_t *stats) {
+    pthread_mutex_lock(&co_host_flash.lock);
+    *stats = co_host_flash.stats;
+    stats->stall_us = __atomic_load_n(&co_host_flash.stats.stall_us, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&co_host_flash.lock);
+}
@@ -0,0 +1,114 @@
+/**
+ * @file co_host_heap.c
+ * @brief Capability heaps of the Linux host port.
+ *
+ * Every buffer comes from malloc(). The buffers of MALLOC_CAP_SPIRAM are counted against the size of the
+ * simulated external RAM, so a board with or without PSRAM can be reproduced.
+ *
+ * The internal heap is unlimited unless a size is set. Then the free size shrinks by the spike of the application
+ * while it lasts, and by the internal buffers of heap_caps_malloc, so memory pressure can be reproduced.
+ */
+#include <stdlib.h>
+
+#include "co_host.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+#define CO_HOST_HEAP_HEADER_SIZE 16 // keeps the alignment of malloc()
+#define CO_HOST_HEAP_UNLIMITED   ((size_t)1 << 30)
+
+typedef struct co_host_heap_header {
+    size_t size;
+    uint32_t caps;
+} co_host_heap_header_t;
+
+static struct {
+    size_t psram_size;
+    size_t psram_used;
+    size_t internal_size; // 0: unlimited
+    size_t internal_used;
+    size_t spike_size;
+    int64_t spike_start_us;
+    int64_t spike_end_us;
+} co_host_heap;
+
+void co_host_heap_init(size_t psram_size) {
+    co_host_heap.psram_size = psram_size;
+    co_host_heap.psram_used = 0;
+}
+
+void co_host_heap_set_internal(size_t internal_size, size_t spike_size, int64_t spike_start_ms,
+                               int64_t spike_duration_ms) {
+    co_host_heap.internal_size = internal_size;
+    co_host_heap.internal_used = 0;
+    co_host_heap.spike_size = spike_size;
+    co_host_heap.spike_start_us = spike_start_ms * 1000;
+    co_host_heap.spike_end_us = (spike_start_ms + spike_duration_ms) * 1000;
+}
+
+static size_t co_host_heap_internal_free(void) {
+    size_t used;
+    int64_t now;
+
+    if (co_host_heap.internal_size == 0) {
+        return CO_HOST_HEAP_UNLIMITED;
+    }
+
+    used = __atomic_load_n(&co_host_heap.internal_used, __ATOMIC_RELAXED);
+    now = esp_timer_get_time();
+    if (now >= co_host_heap.spike_start_us && now < co_host_heap.spike_end_us) {
+        used += co_host_heap.spike_size;
+    }
+    return used < co_host_heap.internal_size ? co_host_heap.internal_size - used : 0;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    co_host_heap_header_t *header;
+
+    if (size > heap_caps_get_free_size(caps)) {
+        return NULL;
+    }
+
+    header = malloc(CO_HOST_HEAP_HEADER_SIZE + size);
+    if (header == NULL) {
+        return NULL;
+    }
+    header->size = size;
+    header->caps = caps;
+
+    if (caps & MALLOC_CAP_SPIRAM) {
+        __atomic_add_fetch(&co_host_heap.psram_used, size, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&co_host_heap.internal_used, size, __ATOMIC_RELAXED);
+    }
+
+    return (uint8_t *)header + CO_HOST_HEAP_HEADER_SIZE;
+}
+
+void heap_caps_free(void *ptr) {
+    co_host_heap_header_t *header;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    header = (co_host_heap_header_t *)((uint8_t *)ptr - CO_HOST_HEAP_HEADER_SIZE);
+    if (header->caps & MALLOC_CAP_SPIRAM) {
+        __atomic_sub_fetch(&co_host_heap.psram_used, header->size, __ATOMIC_RELAXED);
+    } else {
+        __atomic_sub_fetch(&co_host_heap.internal_used, header->size, __ATOMIC_RELAXED);
+    }
+    free(header);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+    if (caps & MALLOC_CAP_SPIRAM) {
+        return co_host_heap.psram_size - __atomic_load_n(&co_host_heap.psram_used, __ATOMIC_RELAXED);
+    }
+
+    return co_host_heap_internal_free();
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return heap_caps_get_free_size(caps);
+}
@@ -0,0 +1,168 @@
+/**
+ * @file co_host_nvs.c
+ * @brief NVS blobs kept as files "<namespace>.<key>" in a directory.
+ *
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "co_host.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+static const char *CO_HOST_TAG = "co_host_nvs";
+
+#define CO_HOST_NVS_MAX_HANDLE   8
+#define CO_HOST_NVS_KEY_NAME_MAX 15 // NVS_KEY_NAME_MAX_SIZE - 1
+
+static struct {
+    char dir[PATH_MAX];
+    bool init;
+    char ns[CO_HOST_NVS_MAX_HANDLE][CO_HOST_NVS_KEY_NAME_MAX + 1]; // empty: free handle
+    bool writable[CO_HOST_NVS_MAX_HANDLE];
+} co_host_nvs;
+
+esp_err_t co_host_nvs_init(const char *dir) {
+    if (dir == NULL || strlen(dir) >= sizeof(co_host_nvs.dir)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        ESP_LOGE(CO_HOST_TAG, "can not create %s (%d)", dir, errno);
+        return ESP_FAIL;
+    }
+
+    strcpy(co_host_nvs.dir, dir);
+    co_host_nvs.init = true;
+    return ESP_OK;
+}
+
+// handles start from 1, 0 is never valid
+static const char *co_host_nvs_get_ns(nvs_handle_t handle) {
+    if (handle == 0 || handle > CO_HOST_NVS_MAX_HANDLE || co_host_nvs.ns[handle - 1][0] == '\0') {
+        return NULL;
+    }
+    return co_host_nvs.ns[handle - 1];
+}
+
+static esp_err_t co_host_nvs_path(nvs_handle_t handle, const char *key, char *path, size_t size) {
+    const char *ns = co_host_nvs_get_ns(handle);
+    if (ns == NULL) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    if (key == NULL || key[0] == '\0' || strlen(key) > CO_HOST_NVS_KEY_NAME_MAX || strchr(key, '/') != NULL) {
+        return ESP_ERR_NVS_INVALID_NAME;
+    }
+
+    snprintf(path, size, "%s/%s.%s", co_host_nvs.dir, ns, key);
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle) {
+    int i;
+
+    if (!co_host_nvs.init) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (name == NULL || name[0] == '\0' || strlen(name) > CO_HOST_NVS_KEY_NAME_MAX || strchr(name, '/') != NULL) {
+        return ESP_ERR_NVS_INVALID_NAME;
+    }
+
+    for (i = 0; i < CO_HOST_NVS_MAX_HANDLE; i++) {
+        if (co_host_nvs.ns[i][0] == '\0') {
+            strcpy(co_host_nvs.ns[i], name);
+            co_host_nvs.writable[i] = open_mode == NVS_READWRITE;
+            *out_handle = i + 1;
+            return ESP_OK;
+        }
+    }
+
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length) {
+    char path[PATH_MAX + 32];
+    struct stat st;
+    FILE *fp;
+    esp_err_t ret = co_host_nvs_path(handle, key, path, sizeof(path));
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (stat(path, &st) != 0) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    if (out_value == NULL) { // query the length
+        *length = st.st_size;
+        return ESP_OK;
+    }
+    if (*length < (size_t)st.st_size) {
+        *length = st.st_size;
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    *length = fread(out_value, 1, st.st_size, fp);
+    fclose(fp);
+
+    return *length == (size_t)st.st_size ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+    char path[PATH_MAX + 32], tmp[PATH_MAX + 36];
+    FILE *fp;
+    size_t n;
+    esp_err_t ret = co_host_nvs_path(handle, key, path, sizeof(path));
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (!co_host_nvs.writable[handle - 1]) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // like NVS, the old value stays valid until the new one is completely written
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        return ESP_FAIL;
+    }
+    n = fwrite(value, 1, length, fp);
+    if (fclose(fp) != 0 || n != length || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+    char path[PATH_MAX + 32];
+    esp_err_t ret = co_host_nvs_path(handle, key, path, sizeof(path));
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (!co_host_nvs.writable[handle - 1]) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return unlink(path) == 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    // the values are written immediately
+    return co_host_nvs_get_ns(handle) != NULL ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+void nvs_close(nvs_handle_t handle) {
+    if (co_host_nvs_get_ns(handle) != NULL) {
+        co_host_nvs.ns[handle - 1][0] = '\0';
+    }
+}
@@ -0,0 +1,138 @@
+/**
+ * @file co_host_system.c
+ * @brief Log, timer, error names and restart of the Linux host port.
+ *
+ */
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "co_host.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+static const char *CO_HOST_TAG = "co_host";
+
+esp_log_level_t esp_log_default_level = ESP_LOG_INFO;
+
+static char **co_host_argv;
+static bool co_host_exit_on_restart;
+static void (*co_host_restart_handler)(void);
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+    (void)tag;
+    esp_log_default_level = level;
+}
+
+uint32_t esp_log_timestamp(void) {
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+    va_list args;
+
+    (void)level;
+    (void)tag;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+int64_t esp_timer_get_time(void) {
+    static struct timespec boot;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (boot.tv_sec == 0 && boot.tv_nsec == 0) {
+        boot = now;
+    }
+
+    return (int64_t)(now.tv_sec - boot.tv_sec) * 1000000 + (now.tv_nsec - boot.tv_nsec) / 1000;
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+        return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+        return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_FLASH_OP_FAIL:
+        return "ESP_ERR_FLASH_OP_FAIL";
+    case ESP_ERR_FLASH_OP_TIMEOUT:
+        return "ESP_ERR_FLASH_OP_TIMEOUT";
+    case ESP_ERR_OTA_SELECT_INFO_INVALID:
+        return "ESP_ERR_OTA_SELECT_INFO_INVALID";
+    case ESP_ERR_OTA_VALIDATE_FAILED:
+        return "ESP_ERR_OTA_VALIDATE_FAILED";
+    case ESP_ERR_NVS_NOT_FOUND:
+        return "ESP_ERR_NVS_NOT_FOUND";
+    default:
+        return "UNKNOWN ERROR";
+    }
+}
+
+void co_host_set_restart(char **argv, bool exit_on_restart) {
+    co_host_argv = argv;
+    co_host_exit_on_restart = exit_on_restart;
+}
+
+void co_host_set_restart_handler(void (*handler)(void)) {
+    co_host_restart_handler = handler;
+}
+
+void esp_restart(void) {
+    co_host_flash_stats_t stats;
+    int fd;
+
+    co_host_flash_get_stats(&stats);
+    ESP_LOGI(CO_HOST_TAG, "flash: %u sectors erased, %llu bytes written, %llu bytes read, busy %lld ms, stalled %lld ms",
+             (unsigned)stats.erase_num, (unsigned long long)stats.write_bytes, (unsigned long long)stats.read_bytes,
+             (long long)(stats.busy_us / 1000), (long long)(stats.stall_us / 1000));
+    co_host_flash_deinit(); // sync the flash file
+
+    if (co_host_restart_handler != NULL) {
+        co_host_restart_handler();
+        abort(); // must not return
+    }
+
+    if (co_host_exit_on_restart || co_host_argv == NULL) {
+        ESP_LOGI(CO_HOST_TAG, "restart: exit");
+        exit(0);
+    }
+
+    ESP_LOGI(CO_HOST_TAG, "restart: boot %s", co_host_argv[0]);
+    fflush(NULL);
+
+    setenv(CO_HOST_RESTART_ENV, "1", 1);
+
+    // the sockets must not leak into the new process, it binds the listen port again
+    for (fd = STDERR_FILENO + 1; fd < 1024; fd++) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    execv("/proc/self/exe", co_host_argv);
+
+    ESP_LOGE(CO_HOST_TAG, "restart failed");
+    abort();
+}
@@ -0,0 +1,197 @@
+/**
+ * @file co_host_task.c
+ * @brief FreeRTOS tasks and task notifications on pthreads.
+ *
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "co_host.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+struct co_host_task {
+    pthread_t thread;
+    TaskFunction_t func;
+    void *arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notify_value;
+};
+
+static __thread struct co_host_task *co_host_current_task;
+
+static struct co_host_task *co_host_task_alloc(void) {
+    struct co_host_task *task = calloc(1, sizeof(struct co_host_task));
+    if (task == NULL) {
+        return NULL;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // ulTaskNotifyTake deadlines
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return task;
+}
+
+static void co_host_task_free(struct co_host_task *task) {
+    pthread_cond_destroy(&task->cond);
+    pthread_mutex_destroy(&task->lock);
+    free(task);
+}
+
+static void *co_host_task_entry(void *arg) {
+    struct co_host_task *task = arg;
+
+    co_host_current_task = task;
+    task->func(task->arg);
+
+    // returning from a task function is not allowed in FreeRTOS, just clean up
+    co_host_current_task = NULL;
+    co_host_task_free(task);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char *pcName, uint32_t usStackDepth,
+                                   void *pvParameters, UBaseType_t uxPriority, TaskHandle_t *pvCreatedTask,
+                                   BaseType_t xCoreID) {
+    pthread_attr_t attr;
+    struct co_host_task *task;
+
+    (void)usStackDepth;
+    (void)uxPriority;
+
+    task = co_host_task_alloc();
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    task->func = pvTaskCode;
+    task->arg = pvParameters;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (xCoreID != tskNO_AFFINITY) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(xCoreID, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    if (pvCreatedTask != NULL) { // set before the task runs, like FreeRTOS
+        *pvCreatedTask = task;
+    }
+
+    if (pthread_create(&task->thread, &attr, co_host_task_entry, task) != 0) {
+        pthread_attr_destroy(&attr);
+        co_host_task_free(task);
+        if (pvCreatedTask != NULL) {
+            *pvCreatedTask = NULL;
+        }
+        return pdFAIL;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (pcName != NULL) { // thread names show up in perf and top
+        char name[16];
+        strncpy(name, pcName, sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+        pthread_setname_np(task->thread, name);
+    }
+
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t xTaskToDelete) {
+    struct co_host_task *task = co_host_current_task;
+
+    if (xTaskToDelete != NULL && xTaskToDelete != task) {
+        abort(); // deleting another task is not supported
+    }
+
+    co_host_current_task = NULL;
+    if (task != NULL) {
+        co_host_task_free(task);
+    }
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t xTicksToDelay) {
+    struct timespec ts = {
+        .tv_sec = xTicksToDelay / configTICK_RATE_HZ,
+        .tv_nsec = (long)(xTicksToDelay % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ),
+    };
+
+    if (xTicksToDelay == 0) {
+        sched_yield();
+        return;
+    }
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+    co_host_flash_stall_point();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    // threads not created by xTaskCreate (e.g. main) get a handle on first use
+    if (co_host_current_task == NULL) {
+        co_host_current_task = co_host_task_alloc();
+        if (co_host_current_task == NULL) {
+            abort();
+        }
+        co_host_current_task->thread = pthread_self();
+    }
+
+    return co_host_current_task;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify) {
+    pthread_mutex_lock(&xTaskToNotify->lock);
+    xTaskToNotify->notify_value++;
+    pthread_cond_signal(&xTaskToNotify->cond);
+    pthread_mutex_unlock(&xTaskToNotify->lock);
+
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait) {
+    struct co_host_task *task = xTaskGetCurrentTaskHandle();
+    struct timespec deadline;
+    uint32_t value;
+
+    if (xTicksToWait != portMAX_DELAY) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += xTicksToWait / configTICK_RATE_HZ;
+        deadline.tv_nsec += (long)(xTicksToWait % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&task->lock);
+    while (task->notify_value == 0 && xTicksToWait != 0) {
+        if (xTicksToWait == portMAX_DELAY) {
+            pthread_cond_wait(&task->cond, &task->lock);
+        } else if (pthread_cond_timedwait(&task->cond, &task->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    value = task->notify_value;
+    if (value != 0) {
+        task->notify_value = xClearCountOnExit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+
+    // a woken task runs when the cache is enabled again
+    co_host_flash_stall_point();
+
+    return value;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file co_host.h
+ * @brief Setup of the Linux host port: the flash file, NVS, the external RAM and the restart behavior.
+ *
+ * The flash file has the layout of a small ESP-IDF partition table, file offsets are flash addresses:
+ *   0xd000  otadata (2 sectors)
+ *   0x10000 ota_0
+ *   0x10000 + ota_size ota_1
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "corsacOTA.h"
+#include "esp_err.h"
+
+#define CO_HOST_OTADATA_ADDRESS 0xd000
+#define CO_HOST_OTA_0_ADDRESS   0x10000
+#define CO_HOST_FLASH_PAGE_SIZE 256
+
+#define CO_HOST_RESTART_ENV     "CO_HOST_RESTARTED" // set in the environment of a restarted process
+
+#define CO_HOST_CAPTURE_MAGIC   "COCAP001"
+#define CO_HOST_CAPTURE_MAGIC_SIZE 8
+
+typedef enum co_host_flash_op {
+    CO_HOST_FLASH_OP_READ,
+    CO_HOST_FLASH_OP_WRITE,
+    CO_HOST_FLASH_OP_ERASE,
+} co_host_flash_op_t;
+
+/**
+ * @brief Timing model of the SPI flash.
+ *
+ * The default model charges op_us per operation (flash guard, cache flush, command), the page programs of a
+ * write, the sector or 64KB block erases of an erase (like spi_flash_erase_range, aligned 64KB ranges use a
+ * block erase when block_erase_us is set) and reads at read_mb_s. Set duration_us to plug in another model.
+ */
+typedef struct co_host_flash_timing {
+    const char *name;
+    uint32_t op_us;          // fixed cost of every operation (in microseconds)
+    uint32_t sector_erase_us; // 4KB sector erase (in microseconds)
+    uint32_t block_erase_us; // 64KB block erase (in microseconds). 0: erase the block sector by sector
+    uint32_t page_program_us; // program of a page of CO_HOST_FLASH_PAGE_SIZE bytes (in microseconds)
+    uint32_t read_mb_s;      // read throughput (in MB/s). 0: reads take no time
+    bool cache_stall;        // the cache is disabled during flash operations, the other tasks stall
+
+    // custom model, returns the duration of an operation (in microseconds). NULL: the default model
+    uint32_t (*duration_us)(const struct co_host_flash_timing *timing, co_host_flash_op_t op, size_t offset,
+                            size_t size);
+} co_host_flash_timing_t;
+
+typedef struct co_host_flash_config {
+    const char *path;  // flash file, created if it does not exist
+    uint32_t ota_size; // size of each app partition, multiple of SPI_FLASH_SEC_SIZE
+    int64_t pending_verify_ms; // the running app is pending verification for this time after the start, -1: forever
+
+    co_host_flash_timing_t timing;
+} co_host_flash_config_t;
+
+typedef struct co_host_flash_stats {
+    uint32_t erase_num;     // sectors erased
+    uint64_t write_bytes;
+    uint64_t read_bytes;
+    uint32_t dirty_writes;  // writes that tried to set bits of a non-erased range, a bug on real flash
+    int64_t busy_us;        // time spent in flash operations, including the simulated latency
+    int64_t stall_us;       // time the other tasks were stalled by the disabled cache
+} co_host_flash_stats_t;
+
+/**
+ * @brief Typical flash timing of a chip.
+ *
+ * @param name "esp8266", "esp32", "esp32c3", "esp32s3" or "none" (every operation is instant)
+ * @return the profile, NULL if name is unknown
+ */
+const co_host_flash_timing_t *co_host_flash_get_profile(const char *name);
+
+/**
+ * @brief Wait while another task runs a flash operation with the cache disabled.
+ *
+ * On the chip, code in flash can not run until the operation is done. The socket and task calls of the port
+ * are stall points, so the network processing of the server pauses like it does on the chip.
+ */
+void co_host_flash_stall_point(void);
+
+/**
+ * @brief Map the flash file and boot the partition selected in otadata.
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_ERR_INVALID_ARG: ota_size is not a multiple of the sector size
+ *  - ESP_FAIL: the file can not be opened or mapped
+ */
+esp_err_t co_host_flash_init(const co_host_flash_config_t *config);
+void co_host_flash_deinit(void);
+void co_host_flash_get_stats(co_host_flash_stats_t *stats);
+
+/**
+ * @brief Keep the NVS keys as files in dir, it is created if it does not exist.
+ *
+ */
+esp_err_t co_host_nvs_init(const char *dir);
+
+/**
+ * @brief Set the size of the simulated external RAM of heap_caps_malloc, 0 for a board without PSRAM.
+ *
+ */
+void co_host_heap_init(size_t psram_size);
+
+/**
+ * @brief Limit the internal heap of heap_caps_get_free_size, and send() of the server, which fails with ENOMEM like
+ *        lwIP when the free size is below the length of the message.
+ *
+ * @param internal_size size of the internal heap, 0: unlimited
+ * @param spike_size memory taken by the application from spike_start_ms to spike_start_ms + spike_duration_ms after
+ *        the start of the process
+ */
+void co_host_heap_set_internal(size_t internal_size, size_t spike_size, int64_t spike_start_ms,
+                               int64_t spike_duration_ms);
+
+/**
+ * @brief Set how esp_restart restarts the process.
+ *
+ * @param argv arguments the process is executed again with, they must outlive the process
+ * @param exit_on_restart exit with status 0 instead, for scripted benchmarks
+ */
+void co_host_set_restart(char **argv, bool exit_on_restart);
+
+/**
+ * @brief Call handler in place of the restart, after the flash file is synced. handler must not return.
+ *
+ */
+void co_host_set_restart_handler(void (*handler)(void));
+
+/**
+ * @brief Record of a capture file.
+ *
+ * A capture file is CO_HOST_CAPTURE_MAGIC followed by records, each one is this header (little endian, as
+ * written by the host) followed by the len bytes received when event is CO_CAPTURE_RECV and len > 0.
+ * Any co_capture_cb_t that writes this format (e.g. to the UART of a board) produces a file co_replay reads.
+ */
+typedef struct co_host_capture_record {
+    int64_t time_us; // CLOCK_MONOTONIC, the same clock across a restart
+    int32_t fd;
+    int32_t event; // co_capture_event_t
+    int32_t len;   // result of recv()
+    int32_t err;   // errno when len < 0
+} co_host_capture_record_t;
+
+/**
+ * @brief Open a capture file for co_host_capture_write. The records are appended, so the sessions after a
+ *        restart go to the same file.
+ *
+ * @return the file, NULL on failure
+ */
+FILE *co_host_capture_open(const char *path);
+
+/**
+ * @brief co_capture_cb_t writing to the capture file arg.
+ *
+ */
+void co_host_capture_write(void *arg, int fd, co_capture_event_t event, const void *data, int len);
+
+/**
+ * @brief Read the next record of a capture file, its magic already read by co_host_capture_check.
+ *
+ * @param data receives the bytes of the record, at least size bytes
+ * @return 1 for a record, 0 at the end of the file, -1 if the file is truncated or a record is larger than size
+ */
+int co_host_capture_read(FILE *fp, co_host_capture_record_t *record, void *data, size_t size);
+
+/**
+ * @brief Read and check the magic at the beginning of a capture file.
+ *
+ */
+esp_err_t co_host_capture_check(FILE *fp);
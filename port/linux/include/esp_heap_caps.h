@@ -0,0 +1,39 @@
+/**
+ * @file esp_heap_caps.h
+ * @brief Capability heaps of the Linux host port. The external RAM (PSRAM) is simulated, see co_host_heap_init.
+ *
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the values match ESP-IDF
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT  (1 << 12)
+
+/**
+ * @brief Allocate from the heap with the caps. MALLOC_CAP_SPIRAM takes from the simulated external RAM.
+ *
+ */
+void *heap_caps_malloc(size_t size, uint32_t caps);
+
+/**
+ * @brief Release a buffer of heap_caps_malloc.
+ *
+ */
+void heap_caps_free(void *ptr);
+
+/**
+ * @brief Get the free size of the heap with the caps. The internal heap has no limit on the host.
+ *
+ */
+size_t heap_caps_get_free_size(uint32_t caps);
+
+/**
+ * @brief Get the largest buffer heap_caps_malloc can return, the simulated external RAM is never fragmented.
+ *
+ */
+size_t heap_caps_get_largest_free_block(uint32_t caps);
@@ -0,0 +1,8 @@
+/**
+ * @file esp_image_format.h
+ * @brief App image format of the Linux host port, only the header magic is used.
+ *
+ */
+#pragma once
+
+#define ESP_IMAGE_HEADER_MAGIC 0xE9 // first byte of an app image
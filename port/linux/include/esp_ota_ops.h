@@ -0,0 +1,50 @@
+/**
+ * @file esp_ota_ops.h
+ * @brief OTA API of the Linux host port. The flash file holds two app partitions (ota_0, ota_1)
+ *        and the otadata sector recording the boot partition.
+ *
+ */
+#pragma once
+
+#include "esp_err.h"
+#include "esp_partition.h"
+
+#define ESP_ERR_OTA_BASE                   (0x1500)
+#define ESP_ERR_OTA_PARTITION_CONFLICT     (ESP_ERR_OTA_BASE + 0x01)
+#define ESP_ERR_OTA_SELECT_INFO_INVALID    (ESP_ERR_OTA_BASE + 0x02)
+#define ESP_ERR_OTA_VALIDATE_FAILED        (ESP_ERR_OTA_BASE + 0x03)
+#define ESP_ERR_OTA_ROLLBACK_INVALID_STATE (ESP_ERR_OTA_BASE + 0x06)
+
+typedef enum {
+    ESP_OTA_IMG_NEW = 0x0U,
+    ESP_OTA_IMG_PENDING_VERIFY = 0x1U,
+    ESP_OTA_IMG_VALID = 0x2U,
+    ESP_OTA_IMG_INVALID = 0x3U,
+    ESP_OTA_IMG_ABORTED = 0x4U,
+    ESP_OTA_IMG_UNDEFINED = 0xFFFFFFFFU,
+} esp_ota_img_states_t;
+
+const esp_partition_t *esp_ota_get_boot_partition(void);
+const esp_partition_t *esp_ota_get_running_partition(void);
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from);
+
+/**
+ * @brief Select the partition booted by the next restart. Like the bootloader, only the magic byte
+ *        of the image header is checked.
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_ERR_INVALID_ARG: not an app partition
+ *  - ESP_ERR_OTA_VALIDATE_FAILED: no valid image in the partition
+ */
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition);
+
+/**
+ * @brief Get the rollback state of an app partition. The running app is pending verification for the
+ *        pending_verify_ms of co_host_flash_config_t, then valid. The other one is undefined.
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_ERR_INVALID_ARG: not an app partition
+ */
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state);
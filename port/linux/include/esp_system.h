@@ -0,0 +1,17 @@
+/**
+ * @file esp_system.h
+ * @brief System functions of the Linux host port.
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/**
+ * @brief Restart the process with the same arguments, it boots the partition selected by
+ *        esp_ota_set_boot_partition. See co_host_set_restart.
+ *
+ */
+void esp_restart(void) __attribute__((noreturn));
@@ -0,0 +1,14 @@
+/**
+ * @file esp_timer.h
+ * @brief Timer of the Linux host port.
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief Get time in microseconds since the process started (CLOCK_MONOTONIC).
+ *
+ */
+int64_t esp_timer_get_time(void);
@@ -0,0 +1,25 @@
+/**
+ * @file FreeRTOS.h
+ * @brief FreeRTOS types of the Linux host port. A task is a pthread, a tick is one millisecond.
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+#include <unistd.h>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE             ((BaseType_t)0)
+#define pdTRUE              ((BaseType_t)1)
+#define pdPASS              (pdTRUE)
+#define pdFAIL              (pdFALSE)
+
+#define configTICK_RATE_HZ  1000
+#define portTICK_PERIOD_MS  ((TickType_t)1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY       ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(((TickType_t)(ms) * (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000U))
+
+#define portNUM_PROCESSORS  ((int)sysconf(_SC_NPROCESSORS_ONLN))
@@ -0,0 +1,12 @@
+/**
+ * @file err.h
+ * @brief lwIP error type of the Linux host port.
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef int8_t err_t;
+
+#define ERR_OK 0
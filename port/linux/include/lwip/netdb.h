@@ -0,0 +1,8 @@
+/**
+ * @file netdb.h
+ * @brief The Linux host port uses the resolver of the system.
+ *
+ */
+#pragma once
+
+#include <netdb.h>
@@ -0,0 +1,99 @@
+/**
+ * @file sockets.h
+ * @brief The Linux host port uses the BSD sockets of the system in place of lwIP.
+ *
+ */
+#pragma once
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/poll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "esp_heap_caps.h"
+
+// The calls of the server are stall points of the flash timing model, see co_host_flash_stall_point
+void co_host_flash_stall_point(void);
+
+static inline int co_host_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    co_host_flash_stall_point();
+    int ret = accept(fd, addr, addrlen);
+    co_host_flash_stall_point();
+    return ret;
+}
+
+static inline ssize_t co_host_recv(int fd, void *buf, size_t len, int flags) {
+    co_host_flash_stall_point();
+    ssize_t ret = recv(fd, buf, len, flags);
+    co_host_flash_stall_point();
+    return ret;
+}
+
+// lwIP fails a send() when the heap has no room for the pbufs of the message, see co_host_heap_set_internal
+static inline bool co_host_send_nomem(size_t len) {
+    if (heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT) < len) {
+        errno = ENOMEM;
+        return true;
+    }
+    return false;
+}
+
+static inline ssize_t co_host_send(int fd, const void *buf, size_t len, int flags) {
+    co_host_flash_stall_point();
+    if (co_host_send_nomem(len)) {
+        return -1;
+    }
+    return send(fd, buf, len, flags);
+}
+
+static inline ssize_t co_host_sendmsg(int fd, const struct msghdr *msg, int flags) {
+    size_t len = 0;
+    size_t i;
+
+    co_host_flash_stall_point();
+    for (i = 0; i < msg->msg_iovlen; i++) {
+        len += msg->msg_iov[i].iov_len;
+    }
+    if (co_host_send_nomem(len)) {
+        return -1;
+    }
+    return sendmsg(fd, msg, flags);
+}
+
+static inline int co_host_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+                                 struct timeval *timeout) {
+    co_host_flash_stall_point();
+    int ret = select(nfds, readfds, writefds, exceptfds, timeout);
+    co_host_flash_stall_point();
+    return ret;
+}
+
+static inline int co_host_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    co_host_flash_stall_point();
+    int ret = poll(fds, nfds, timeout);
+    co_host_flash_stall_point();
+    return ret;
+}
+
+static inline int co_host_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    co_host_flash_stall_point();
+    int ret = epoll_wait(epfd, events, maxevents, timeout);
+    co_host_flash_stall_point();
+    return ret;
+}
+
+#define accept     co_host_accept
+#define recv       co_host_recv
+#define send       co_host_send
+#define sendmsg    co_host_sendmsg
+#define select     co_host_select
+#define poll       co_host_poll
+#define epoll_wait co_host_epoll_wait
@@ -0,0 +1,6 @@
+/**
+ * @file sys.h
+ * @brief Nothing is needed from the lwIP system layer on the Linux host port.
+ *
+ */
+#pragma once
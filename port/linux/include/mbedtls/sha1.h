@@ -0,0 +1,13 @@
+/**
+ * @file sha1.h
+ * @brief The host port links the system mbedtls. mbedtls 3 dropped the "_ret" names used by ESP-IDF 4.
+ *
+ */
+#pragma once
+
+#include_next <mbedtls/sha1.h>
+#include <mbedtls/version.h>
+
+#if MBEDTLS_VERSION_MAJOR >= 3
+#define mbedtls_sha1_ret mbedtls_sha1
+#endif
@@ -0,0 +1,16 @@
+/**
+ * @file sha256.h
+ * @brief The host port links the system mbedtls. mbedtls 3 dropped the "_ret" names used by ESP-IDF 4.
+ *
+ */
+#pragma once
+
+#include_next <mbedtls/sha256.h>
+#include <mbedtls/version.h>
+
+#if MBEDTLS_VERSION_MAJOR >= 3
+#define mbedtls_sha256_starts_ret mbedtls_sha256_starts
+#define mbedtls_sha256_update_ret mbedtls_sha256_update
+#define mbedtls_sha256_finish_ret mbedtls_sha256_finish
+#define mbedtls_sha256_ret        mbedtls_sha256
+#endif
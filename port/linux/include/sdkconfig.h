@@ -0,0 +1,19 @@
+/**
+ * @file sdkconfig.h
+ * @brief Configuration of the Linux host port, in place of the one generated by the ESP-IDF build.
+ *
+ */
+#pragma once
+
+#define CONFIG_IDF_TARGET_LINUX 1
+
+// esp_ota_get_state_partition reports the running app pending verification with --pending-verify
+#define CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE 1
+
+// IPv4 only, the same as the default lwIP configuration of the examples
+#define CONFIG_LWIP_IPV6 0
+
+// The process restarts quickly, the client only needs time to receive the final message
+#ifndef CONFIG_CO_RESTART_DELAY_MS
+#define CONFIG_CO_RESTART_DELAY_MS 200
+#endif
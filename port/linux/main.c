@@ -0,0 +1,351 @@
+/**
+ * @file main.c
+ * @brief corsacOTA server on a Linux host, to benchmark and profile the real server on a workstation.
+ *
+ */
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "co_host.h"
+#include "corsacOTA.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+
+static const char *CO_HOST_TAG = "co_host_main";
+
+#define CO_HOST_KEY_MAX_SIZE 4096
+
+// timing options, indexes of timing_us
+enum {
+    CO_HOST_TIMING_OP,
+    CO_HOST_TIMING_SECTOR_ERASE,
+    CO_HOST_TIMING_BLOCK_ERASE,
+    CO_HOST_TIMING_PAGE_PROGRAM,
+    CO_HOST_TIMING_READ,
+    CO_HOST_TIMING_MAX,
+};
+
+static void co_host_usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -p, --port PORT            listen port (3241)\n"
+            "  -f, --flash FILE           flash file, created if it does not exist (corsacOTA_flash.bin)\n"
+            "  -s, --ota-size SIZE        size of each OTA partition (0x180000)\n"
+            "      --flash-model NAME     flash timing of esp8266, esp32, esp32c3, esp32s3 or none (none)\n"
+            "      --op-us US             fixed cost of a flash operation\n"
+            "      --erase-us US          time to erase a 4KB sector\n"
+            "      --block-erase-us US    time to erase an aligned 64KB block, 0: sector by sector\n"
+            "      --write-us US          time to program a 256-byte page\n"
+            "      --read-mb-s N          read throughput, 0: instant\n"
+            "      --no-cache-stall       other tasks keep running during flash operations\n"
+            "      --running-image FILE   write FILE to the running partition before the server starts\n"
+            "  -q, --queue-depth N        flash_queue_depth (0)\n"
+            "      --pre-erase            pre_erase\n"
+            "      --resume-checkpoint N  resume_checkpoint_size (0)\n"
+            "      --sign-key FILE        PEM public key, sign_public_key\n"
+            "      --skip-unchanged       skip_unchanged\n"
+            "      --static-buffers       static_buffers\n"
+            "      --socket-buffer N      socket_buffer_size (0: default of the target)\n"
+            "      --text-buffer N        text_buffer_size (0: 512)\n"
+            "      --ack-chunk N          ack_chunk_size (0: 10KB)\n"
+            "      --window-max N         window_max_size (0: 64KB)\n"
+            "      --staging              staging, the image is received into the external RAM first\n"
+            "      --psram-size SIZE      external RAM of the board, for staging (0: no PSRAM)\n"
+            "      --low-memory N         low_memory_threshold, free heap below which the buffers shrink (0: off)\n"
+            "      --heap-size SIZE       internal heap of the board (0: unlimited)\n"
+            "      --heap-spike S,T,D     the application takes S bytes of the heap T ms after the start for D ms\n"
+            "      --timeout SEC          wait_timeout_sec (3600)\n"
+            "      --capture FILE         append every accept and recv() result to FILE, for co_replay\n"
+            "      --exit-on-restart      exit instead of restarting the process when the OTA is done\n"
+            "      --pending-verify MS    the running app waits MS ms for its verification (app rollback, -1: forever)\n"
+            "  -v, --verbose              debug log\n",
+            name);
+}
+
+static void co_host_timing_override(co_host_flash_timing_t *timing, uint32_t *field, long value) {
+    if (value >= 0) {
+        *field = (uint32_t)value;
+        timing->name = NULL; // no longer the profile, logged as custom
+    }
+}
+
+static char *co_host_read_file(const char *path, size_t max_size, size_t *size) {
+    FILE *fp = fopen(path, "rb");
+    char *buf;
+
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    buf = malloc(max_size + 1);
+    if (buf == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    *size = fread(buf, 1, max_size, fp);
+    buf[*size] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+static esp_err_t co_host_install_image(const char *path) {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    size_t size;
+    esp_err_t ret;
+    char *image = co_host_read_file(path, running->size, &size);
+
+    if (image == NULL) {
+        ESP_LOGE(CO_HOST_TAG, "can not read %s", path);
+        return ESP_FAIL;
+    }
+
+    ret = esp_partition_erase_range(running, 0, (size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE);
+    if (ret == ESP_OK) {
+        ret = esp_partition_write(running, 0, image, size);
+    }
+    free(image);
+
+    ESP_LOGI(CO_HOST_TAG, "%s: %zu bytes written to %s", path, size, running->label);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"port", required_argument, NULL, 'p'},
+        {"flash", required_argument, NULL, 'f'},
+        {"ota-size", required_argument, NULL, 's'},
+        {"flash-model", required_argument, NULL, 'm'},
+        {"op-us", required_argument, NULL, 'O'},
+        {"erase-us", required_argument, NULL, 'E'},
+        {"block-erase-us", required_argument, NULL, 'B'},
+        {"write-us", required_argument, NULL, 'W'},
+        {"read-mb-s", required_argument, NULL, 'R'},
+        {"no-cache-stall", no_argument, NULL, 'S'},
+        {"running-image", required_argument, NULL, 'i'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"pre-erase", no_argument, NULL, 'e'},
+        {"resume-checkpoint", required_argument, NULL, 'c'},
+        {"sign-key", required_argument, NULL, 'k'},
+        {"skip-unchanged", no_argument, NULL, 'u'},
+        {"static-buffers", no_argument, NULL, 'A'},
+        {"socket-buffer", required_argument, NULL, 'b'},
+        {"text-buffer", required_argument, NULL, 'T'},
+        {"ack-chunk", required_argument, NULL, 'a'},
+        {"window-max", required_argument, NULL, 'w'},
+        {"staging", no_argument, NULL, 'g'},
+        {"psram-size", required_argument, NULL, 'P'},
+        {"low-memory", required_argument, NULL, 'L'},
+        {"heap-size", required_argument, NULL, 'H'},
+        {"heap-spike", required_argument, NULL, 'K'},
+        {"timeout", required_argument, NULL, 't'},
+        {"capture", required_argument, NULL, 'C'},
+        {"exit-on-restart", no_argument, NULL, 'x'},
+        {"pending-verify", required_argument, NULL, 'V'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    co_host_flash_config_t flash_config = {
+        .path = "corsacOTA_flash.bin",
+        .ota_size = 0x180000,
+    };
+    const co_host_flash_timing_t *profile = co_host_flash_get_profile("none");
+    long timing_us[CO_HOST_TIMING_MAX] = {-1, -1, -1, -1, -1};
+    bool no_cache_stall = false;
+    co_host_flash_timing_t *timing;
+    co_config_t config = {
+        .thread_name = "corsacOTA",
+        .stack_size = 4096,
+        .thread_prio = 8,
+        .listen_port = 3241,
+        .max_listen_num = 4,
+        .wait_timeout_sec = 3600,
+        .wait_timeout_usec = 0,
+    };
+    const char *running_image = NULL;
+    const char *sign_key_path = NULL;
+    const char *capture_path = NULL;
+    bool exit_on_restart = false;
+    char nvs_dir[4096];
+    co_handle_t handle;
+    size_t psram_size = 0;
+    size_t heap_size = 0;
+    long long spike[3] = {0, 0, 0};
+    size_t key_size;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "p:f:s:q:vh", options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            config.listen_port = atoi(optarg);
+            break;
+        case 'f':
+            flash_config.path = optarg;
+            break;
+        case 's':
+            flash_config.ota_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            profile = co_host_flash_get_profile(optarg);
+            if (profile == NULL) {
+                fprintf(stderr, "unknown flash model %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'O':
+            timing_us[CO_HOST_TIMING_OP] = strtol(optarg, NULL, 0);
+            break;
+        case 'E':
+            timing_us[CO_HOST_TIMING_SECTOR_ERASE] = strtol(optarg, NULL, 0);
+            break;
+        case 'B':
+            timing_us[CO_HOST_TIMING_BLOCK_ERASE] = strtol(optarg, NULL, 0);
+            break;
+        case 'W':
+            timing_us[CO_HOST_TIMING_PAGE_PROGRAM] = strtol(optarg, NULL, 0);
+            break;
+        case 'R':
+            timing_us[CO_HOST_TIMING_READ] = strtol(optarg, NULL, 0);
+            break;
+        case 'S':
+            no_cache_stall = true;
+            break;
+        case 'i':
+            running_image = optarg;
+            break;
+        case 'q':
+            config.flash_queue_depth = atoi(optarg);
+            break;
+        case 'e':
+            config.pre_erase = 1;
+            break;
+        case 'c':
+            config.resume_checkpoint_size = strtol(optarg, NULL, 0);
+            break;
+        case 'k':
+            sign_key_path = optarg;
+            break;
+        case 'u':
+            config.skip_unchanged = 1;
+            break;
+        case 'A':
+            config.static_buffers = 1;
+            break;
+        case 'b':
+            config.socket_buffer_size = strtol(optarg, NULL, 0);
+            break;
+        case 'T':
+            config.text_buffer_size = strtol(optarg, NULL, 0);
+            break;
+        case 'a':
+            config.ack_chunk_size = strtol(optarg, NULL, 0);
+            break;
+        case 'w':
+            config.window_max_size = strtol(optarg, NULL, 0);
+            break;
+        case 'g':
+            config.staging = 1;
+            break;
+        case 'P':
+            psram_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'L':
+            config.low_memory_threshold = strtol(optarg, NULL, 0);
+            break;
+        case 'H':
+            heap_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'K':
+            if (sscanf(optarg, "%lli,%lli,%lli", &spike[0], &spike[1], &spike[2]) != 3) {
+                fprintf(stderr, "--heap-spike takes SIZE,START_MS,DURATION_MS\n");
+                return 1;
+            }
+            break;
+        case 't':
+            config.wait_timeout_sec = atoi(optarg);
+            break;
+        case 'C':
+            capture_path = optarg;
+            break;
+        case 'x':
+            exit_on_restart = true;
+            break;
+        case 'V':
+            flash_config.pending_verify_ms = strtoll(optarg, NULL, 0);
+            break;
+        case 'v':
+            esp_log_level_set("*", ESP_LOG_DEBUG);
+            break;
+        default:
+            co_host_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    // the explicit timing options override the profile, whatever their order
+    timing = &flash_config.timing;
+    *timing = *profile;
+    co_host_timing_override(timing, &timing->op_us, timing_us[CO_HOST_TIMING_OP]);
+    co_host_timing_override(timing, &timing->sector_erase_us, timing_us[CO_HOST_TIMING_SECTOR_ERASE]);
+    co_host_timing_override(timing, &timing->block_erase_us, timing_us[CO_HOST_TIMING_BLOCK_ERASE]);
+    co_host_timing_override(timing, &timing->page_program_us, timing_us[CO_HOST_TIMING_PAGE_PROGRAM]);
+    co_host_timing_override(timing, &timing->read_mb_s, timing_us[CO_HOST_TIMING_READ]);
+    if (no_cache_stall) {
+        timing->cache_stall = false;
+    }
+
+    // a closed connection must not kill the process, lwIP has no SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    co_host_set_restart(argv, exit_on_restart);
+
+    if (co_host_flash_init(&flash_config) != ESP_OK) {
+        return 1;
+    }
+    co_host_heap_init(psram_size);
+    co_host_heap_set_internal(heap_size, (size_t)spike[0], spike[1], spike[2]);
+
+    snprintf(nvs_dir, sizeof(nvs_dir), "%s.nvs", flash_config.path);
+    if (co_host_nvs_init(nvs_dir) != ESP_OK) {
+        return 1;
+    }
+
+    // only at the first start, a restart boots the firmware just received
+    if (running_image != NULL && getenv(CO_HOST_RESTART_ENV) == NULL && co_host_install_image(running_image) != ESP_OK) {
+        return 1;
+    }
+
+    if (sign_key_path != NULL) {
+        config.sign_public_key = co_host_read_file(sign_key_path, CO_HOST_KEY_MAX_SIZE, &key_size);
+        if (config.sign_public_key == NULL) {
+            ESP_LOGE(CO_HOST_TAG, "can not read %s", sign_key_path);
+            return 1;
+        }
+    }
+
+    if (capture_path != NULL) {
+        config.capture = co_host_capture_write;
+        config.capture_arg = co_host_capture_open(capture_path);
+        if (config.capture_arg == NULL) {
+            return 1;
+        }
+    }
+
+    if (corsacOTA_init(&handle, &config) != ESP_OK) {
+        ESP_LOGE(CO_HOST_TAG, "can not start corsacOTA");
+        return 1;
+    }
+
+    ESP_LOGI(CO_HOST_TAG, "listening on port %d", config.listen_port);
+    while (1) {
+        pause();
+    }
+
+    return 0;
+}
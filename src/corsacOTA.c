@@ -19,7 +19,12 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+#include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
 
@@ -31,11 +36,17 @@
 #include "freertos/task.h"
 
 #include "mbedtls/base64.h"
+#include "mbedtls/pk.h"
 #include "mbedtls/sha1.h"
+#include "mbedtls/sha256.h"
 
+#include "esp_heap_caps.h"
+#include "esp_image_format.h"
 #include "esp_ota_ops.h"
 #include "esp_partition.h"
 #include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -85,18 +96,156 @@
 #include "soc/rtc.h"
 #endif
 
-#if (!defined CO_TARGET_ESP8266) && (!defined CO_TARGET_ESP32) && (!defined CONFIG_IDF_TARGET_ESP32S2) && (!defined CONFIG_IDF_TARGET_ESP32C3) && (!defined CONFIG_IDF_TARGET_ESP32S3)
+#if (defined CONFIG_IDF_TARGET_LINUX) && (CONFIG_IDF_TARGET_LINUX == 1)
+#define CO_DEVICE_TYPE_NAME "linux"
+#define CO_TARGET_LINUX     1 // host build, see port/linux
+#endif
+
+#if (!defined CO_TARGET_ESP8266) && (!defined CO_TARGET_ESP32) && (!defined CONFIG_IDF_TARGET_ESP32S2) && (!defined CONFIG_IDF_TARGET_ESP32C3) && (!defined CONFIG_IDF_TARGET_ESP32S3) && (!defined CO_TARGET_LINUX)
 #error Unknown hardware platform
 #endif
 
+// event loop backend, see co_event_wait
+#if (!defined CO_EVENT_EPOLL) && (!defined CO_EVENT_POLL) && (!defined CO_EVENT_SELECT)
+#if (CO_TARGET_LINUX)
+#define CO_EVENT_EPOLL 1
+#elif (CO_TARGET_ESP8266)
+#define CO_EVENT_SELECT 1 // the RTOS SDK has no poll()
+#else
+#define CO_EVENT_POLL 1
+#endif
+#endif
+
+#if (CO_EVENT_EPOLL)
+#include <sys/epoll.h>
+#elif (CO_EVENT_POLL)
+#include <sys/poll.h>
+#endif
+
+// scatter-gather send, see co_socket_sendv
+#if (!defined CO_SENDMSG)
+#if (CO_TARGET_ESP8266)
+#define CO_SENDMSG 0 // the lwIP of the RTOS SDK may not support sendmsg() on TCP
+#else
+#define CO_SENDMSG 1
+#endif
+#endif
+
+// external RAM is added to the heap
+#if (defined CONFIG_SPIRAM) || (defined CONFIG_SPIRAM_SUPPORT)
+#define CO_TARGET_PSRAM 1
+#else
+#define CO_TARGET_PSRAM 0
+#endif
+
+// the heap watched by co_memory_check
+#if (CO_TARGET_ESP8266)
+#define CO_HEAP_CAPS_INTERNAL MALLOC_CAP_8BIT // there is only internal RAM
+#else
+#define CO_HEAP_CAPS_INTERNAL (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+
+// a whole image can be staged in external RAM, see co_malloc_psram
+#if (CO_TARGET_PSRAM) || (CO_TARGET_LINUX)
+#define CO_STAGING_SUPPORTED 1
+#else
+#define CO_STAGING_SUPPORTED 0
+#endif
+
+// first fd of a connection, the index 0 of the fd map
+#if (!defined CO_FD_BASE)
+#if (defined LWIP_SOCKET_OFFSET)
+#define CO_FD_BASE LWIP_SOCKET_OFFSET // lwIP numbers its sockets from here
+#else
+#define CO_FD_BASE 0
+#endif
+#endif
+
 #if (defined CONFIG_PARTITION_TABLE_SINGLE_APP) && (CONFIG_PARTITION_TABLE_SINGLE_APP == 1)
 #warning No OTA partition configured. corsacOTA may not work!
 #endif
 
 static const char *CO_TAG = "corsacOTA";
 
-#define CONFIG_CO_SOCKET_BUFFER_SIZE  1500
-#define CONFIG_CO_WS_TEXT_BUFFER_SIZE 100
+// Defaults of the sizes of co_config_t. One recv() drains the segments received so far, up to the socket buffer size
+#ifndef CONFIG_CO_SOCKET_BUFFER_SIZE
+#if (CO_TARGET_ESP8266)
+#define CONFIG_CO_SOCKET_BUFFER_SIZE 1460 // one TCP segment, the heap is small
+#elif (CO_TARGET_PSRAM) || (CO_TARGET_LINUX)
+#define CONFIG_CO_SOCKET_BUFFER_SIZE 16384
+#else
+#define CONFIG_CO_SOCKET_BUFFER_SIZE 5744 // the default TCP receive window of ESP-IDF
+#endif
+#endif
+#define CONFIG_CO_WS_TEXT_BUFFER_SIZE 512 // room for "sha256" and "sig" of op=start
+#define CONFIG_CO_ACK_CHUNK_SIZE      (10 * 1024)
+
+#define CO_SOCKET_BUFFER_MIN_SIZE     256 // a whole control frame (139 bytes) with the header of the next one
+#define CO_SOCKET_BUFFER_MAX_SIZE     (64 * 1024)
+#define CO_WS_TEXT_BUFFER_MIN_SIZE    128 // op=start with sha256
+#define CO_WS_TEXT_BUFFER_MAX_SIZE    4096
+#define CO_WINDOW_MIN_SIZE            1024
+
+#ifdef SPI_FLASH_SEC_SIZE
+#define CO_FLASH_SECTOR_SIZE SPI_FLASH_SEC_SIZE
+#else
+#define CO_FLASH_SECTOR_SIZE 4096
+#endif
+#define CO_FLASH_BLOCK_SIZE  (64 * 1024) // erased at once, faster than its 16 sectors one by one
+
+#ifndef CONFIG_CO_RESTART_DELAY_MS
+#define CONFIG_CO_RESTART_DELAY_MS 5000 // let the client receive the final message before the restart
+#endif
+
+#define CONFIG_CO_FLASH_WRITER_STACK_SIZE 3072
+#define CONFIG_CO_FLASH_POLL_INTERVAL_MS  10
+#define CONFIG_CO_IDLE_ERASE_INTERVAL_MS  1 // wait between two idle erases, the other tasks get the CPU
+#define CONFIG_CO_ERASE_REPORT_SIZE       (64 * 1024) // report the erase progress every 64KB
+#define CONFIG_CO_ROLLBACK_CHECK_INTERVAL_MS 1000 // pre-erase waits for the running app to be confirmed
+
+#define CO_FLASH_ENCRYPTED_ALIGN          16 // encrypted writes must be 16-byte aligned
+#define CONFIG_CO_FLASH_COMPARE_CHUNK     256 // a sector is compared with the partition in chunks of this size
+
+#define CONFIG_CO_HANDSHAKE_TIMEOUT_MS    10000 // from the accept to the end of the http upgrade
+#define CONFIG_CO_HTTP_HEADER_MAX_SIZE    8192  // the upgrade request is rejected beyond this size
+#define CONFIG_CO_HTTP_ARENA_SIZE         1024  // shared recv buffer of the handshakes, a browser request fits in one recv()
+#define CONFIG_CO_CLOSE_LINGER_MS         3000  // time for the client to close its side after our shutdown
+#define CONFIG_CO_TIMER_TICK_MS           100
+#define CO_TIMER_WHEEL_SIZE               64 // slots of the timer wheel, a power of 2
+
+#define CONFIG_CO_SEND_GATHER_SIZE        256 // without sendmsg(), messages up to this size are sent in one piece
+#define CONFIG_CO_SEND_NOMEM_RETRY_NUM    10  // lwIP has no pbuf for a message, it is tried again this many times
+#define CONFIG_CO_SEND_NOMEM_DELAY_MS     10
+
+#define CONFIG_CO_MEMORY_CHECK_INTERVAL_MS 100
+#define CONFIG_CO_LOW_MEMORY_BUFFER_SIZE  1460 // socket buffer of the websocket under memory pressure, one TCP segment
+#define CO_LOW_MEMORY_PIPE_DEPTH          2    // flash blocks of a session started under memory pressure
+
+#ifdef CONFIG_LWIP_MAX_SOCKETS
+#define CONFIG_CO_FD_MAP_SIZE             CONFIG_LWIP_MAX_SOCKETS // the fd map of static buffers never grows on lwIP
+#else
+#define CONFIG_CO_FD_MAP_SIZE             64
+#endif
+
+#define CONFIG_CO_WINDOW_MAX_SIZE         (64 * 1024) // default of window_max_size
+#define CONFIG_CO_WINDOW_PING_INTERVAL_MS 500
+
+#define CO_NVS_NAMESPACE                  "corsacOTA"
+#define CO_NVS_SESSION_KEY                "session"
+#define CO_SESSION_MAGIC                  0x4F54414F // "OATO"
+#define CONFIG_CO_RESUME_YIELD_SIZE       (64 * 1024) // let the idle task run while a resumed session is verified
+
+#define CONFIG_CO_STAGING_RESERVE_SIZE    (256 * 1024) // external RAM left to the application by a staged image
+#define CONFIG_CO_STAGING_BURST_SIZE      CO_FLASH_BLOCK_SIZE // a staged image is written by flash blocks
+
+#define CO_SIGNATURE_MAX_SIZE             256 // RSA-2048
+
+#define CO_PATCH_MAGIC                    "COD1" // corsacOTA delta, see co_patch_write
+#define CO_PATCH_MAGIC_LEN                4
+#define CO_PATCH_OP_COPY                  1
+#define CO_PATCH_OP_ADD                   2
+#define CO_PATCH_OP_INSERT                3
+#define CO_PATCH_OP_SEEK                  4
 
 #define LOG_FMT(x)                    "%s: " x, __func__
 
@@ -104,6 +253,7 @@ static const char *CO_TAG = "corsacOTA";
 
 #define CO_NO_RETURN                  __attribute__((noreturn))
 #define CO_INLINE                     __attribute__((always_inline))
+#define CO_UNUSED                     __attribute__((unused))
 
 #define CO_TEST_MODE                  0
 
@@ -111,6 +261,61 @@ static const char *CO_TAG = "corsacOTA";
 #warning corsacOTA test mode is in use
 #endif
 
+struct co_socket_cb;
+
+#define CO_WS_KEY_LEN 24 // base64 of the 16-byte Sec-WebSocket-Key
+
+typedef enum co_http_state {
+    CO_HTTP_REQUEST_LINE = 0,
+    CO_HTTP_FIELD_NAME,
+    CO_HTTP_FIELD_VALUE,
+    CO_HTTP_DONE, // the empty line ending the header has been read
+} co_http_state_t;
+
+// fields of the upgrade request, see co_http_fields. Their names start with different letters.
+#define CO_HTTP_UPGRADE    0
+#define CO_HTTP_CONNECTION 1
+#define CO_HTTP_WS_KEY     2
+#define CO_HTTP_FIELD_NUM  3
+#define CO_HTTP_NO_FIELD   0xFF
+
+/**
+ * @brief State of the http upgrade parser, kept between two recv() calls
+ *
+ */
+typedef struct co_http_parser {
+    uint8_t state;      // co_http_state_t
+    uint8_t field;     // field of the current line, or of the name read so far. CO_HTTP_NO_FIELD for the others
+    uint8_t name_len;  // saturates at 255
+    uint8_t token_len; // saturates at 255
+    bool token_match;  // the current value token still matches the expected one
+    uint8_t found;     // bit mask of the fields with the expected value
+    uint8_t key_len;   // saturates at 255
+    char key[CO_WS_KEY_LEN];
+    uint32_t size; // header bytes read
+} co_http_parser_t;
+
+/**
+ * @brief Deadline of a connection, in a slot of the timer wheel
+ *
+ */
+typedef struct co_timer {
+    struct co_timer *next;
+    struct co_timer **pprev;   // NULL when the timer is not armed
+    uint32_t expire_tick;      // in CONFIG_CO_TIMER_TICK_MS
+    struct co_socket_cb *owner;
+} co_timer_t;
+
+/**
+ * @brief Hashed timer wheel: a timer is in the slot of its expire tick, a slot holds the timers of every turn.
+ *
+ */
+typedef struct co_timer_wheel {
+    co_timer_t *slots[CO_TIMER_WHEEL_SIZE];
+    uint32_t tick; // next tick to run, the ones before have been run
+    int num;       // armed timers
+} co_timer_wheel_t;
+
 /**
  * @brief corsacOTA websocket control block
  *
@@ -149,14 +354,144 @@ typedef struct co_socket_cb {
         CO_SOCKET_CLOSING                  // waiting to close
     } status;
 
-    char *buf;            // data from raw socket
-    size_t remaining_len; // the number of available bytes remaining in buf
-    size_t read_len;      // the number of bytes that have been processed
+    char *buf;            // data from raw socket, allocated on the first read of the websocket, NULL before and after
+    size_t buf_size;      // capacity of buf, without the byte of the text terminator
+    size_t remaining_len; // write cursor: the end of the valid data in buf
+    size_t read_offset;   // read cursor: the start of the current frame in buf
+    size_t read_len;      // the number of bytes of the current frame header that have been processed
 
     co_websocket_cb_t wcb; // websocket control block
+    co_http_parser_t http; // upgrade request parser, before the handshake
 
+    bool read_paused; // not in the read set of the event loop, see co_event_set_read
+    int event_index;  // position in the poll set (poll backend)
+
+    co_timer_t timer;  // handshake, idle or close deadline, depending on the status
+    int64_t active_ms; // last time data was read, for the idle deadline
 } co_socket_cb_t;
 
+typedef struct co_event_ready {
+    int fd;
+    bool invalid; // the fd is not open (any more), drop it
+} co_event_ready_t;
+
+/**
+ * @brief Event loop: the listen socket and the connections waiting to be read.
+ *
+ */
+typedef struct co_event {
+#if (CO_EVENT_EPOLL)
+    int epfd;
+    struct epoll_event *events;
+#elif (CO_EVENT_POLL)
+    struct pollfd *fds; // the listen socket and the connections, in no particular order
+    int fd_num;
+#else
+    fd_set read_set; // fds to wait for
+    int maxfd;
+#endif
+    int capacity;            // the listen socket, the wake socket and max_listen_num connections
+    co_event_ready_t *ready; // fds to read, filled by co_event_wait
+    int ready_num;
+    int wake_fd;      // loopback socket the flash writer sends to when a block is written, -1 without
+    int wake_send_fd; // the flash writer side of wake_fd
+} co_event_t;
+
+/**
+ * @brief Flash state of the update partition. Sectors are erased progressively, just before they are written
+ * or ahead of the write cursor when there is nothing else to do.
+ *
+ */
+typedef struct co_flash {
+    const esp_partition_t *ptn;
+    size_t erased;      // [0, erased) of the partition has been erased
+    size_t erase_limit; // erase ahead stops here
+    int32_t write_num;  // the number of flash program calls
+    int32_t erase_num;  // the number of sector erase calls
+    bool compare;       // skip the sectors that already hold the data, there is no erase ahead
+    int32_t skip_num;   // the number of unchanged sectors skipped
+} co_flash_t;
+
+/**
+ * @brief A flash sector buffer travelling between the corsacOTA thread and the flash writer
+ *
+ */
+typedef struct co_flash_block {
+    uint8_t *buf;
+    size_t len;
+    size_t offset; // partition offset of buf
+} co_flash_block_t;
+
+/**
+ * @brief Lock-free single-producer/single-consumer queue of flash blocks
+ *
+ */
+typedef struct co_spsc_queue {
+    uint32_t head; // only written by the consumer
+    uint32_t tail; // only written by the producer
+    uint32_t size; // number of slots, one slot is always left empty
+    co_flash_block_t **slots;
+} co_spsc_queue_t;
+
+/**
+ * @brief Flash writer pipeline. The corsacOTA thread fills the blocks and the flash writer thread commits them.
+ *
+ */
+typedef struct co_flash_pipe {
+    co_spsc_queue_t full_queue; // corsacOTA thread -> flash writer
+    co_spsc_queue_t free_queue; // flash writer -> corsacOTA thread
+
+    co_flash_block_t *blocks;
+    int depth; // number of blocks
+
+    co_flash_t flash;    // owned by the flash writer
+    TaskHandle_t owner;  // corsacOTA thread
+    TaskHandle_t writer; // flash writer thread
+    int wake_fd;         // wakes the event loop of the owner, see co_event_wake_init
+    bool wake_pending;   // a wakeup has been sent and not read yet
+
+    int32_t submitted; // bytes handed to the writer (corsacOTA thread only)
+    int32_t committed; // bytes written to flash (flash writer only)
+    esp_err_t err;     // first error of the flash writer
+    bool exit;               // request the flash writer to exit
+    bool running;            // flash writer thread is alive
+    bool park;               // request the flash writer to wait for the next session (static buffers)
+    bool parked;             // the flash writer waits, the pipe can be reset
+} co_flash_pipe_t;
+
+/**
+ * @brief Resumable OTA session, saved in NVS
+ *
+ */
+typedef struct co_ota_session {
+    uint32_t magic;       // CO_SESSION_MAGIC
+    uint32_t ptn_address; // address of the update partition
+    int32_t total_size;   // total firmware size
+    int32_t offset;       // [0, offset) of the firmware has been written to flash
+    uint8_t sha256[32];   // SHA-256 of [0, offset)
+} co_ota_session_t;
+
+/**
+ * @brief Delta patch decoder state, see co_patch_write
+ *
+ */
+typedef struct co_patch {
+    enum co_patch_state {
+        CO_PATCH_HEADER = 0, // magic
+        CO_PATCH_OP,         // record op
+        CO_PATCH_ARG,        // varint argument of the record
+        CO_PATCH_DATA,       // data of the ADD/INSERT record
+    } state;
+    uint8_t op;
+    int header_len;   // magic bytes received
+    uint32_t arg;     // varint being decoded
+    int arg_shift;    // bits of arg decoded
+    uint32_t remain;  // data bytes left in the record
+    size_t old_pos;   // read position in the running partition
+    int32_t out_len;  // bytes of the new firmware produced
+    int32_t new_size; // size of the new firmware
+} co_patch_t;
+
 /**
  * @brief corsacOTA OTA control block
  *
@@ -174,15 +509,68 @@ typedef struct co_ota_cb {
 
     const esp_partition_t *update_ptn;
     const esp_partition_t *running_ptn;
-    esp_ota_handle_t update_handle;
+    co_flash_t flash; // flash state, when there is no flash writer
 
     int32_t total_size;        // Total firmware size
     int32_t offset;            // Current processed size
     int32_t chunk_size;        // The response will be made every time the chunk size is reached
     int32_t last_index_offset; // The offset recorded in the last response
 
+    uint8_t *sector_buf; // staging buffer, only whole flash sectors are written
+    uint8_t *staging_buf; // the whole image in external RAM, sector_buf moves through it. NULL: written during the upload
+    size_t sector_len;   // the number of bytes staged in sector_buf
+    size_t write_offset; // partition offset of sector_buf
+    size_t erase_report; // the erase progress last reported to the client
+
+    co_flash_pipe_t *pipe;     // flash writer pipeline, NULL if flash is written in the corsacOTA thread
+    co_flash_block_t *block;   // the block that sector_buf belongs to (pipeline only)
+    int32_t pending_ack;       // the offset to be acknowledged once ack_commit is committed (pipeline only)
+    int32_t ack_commit;        // the write offset the pending acknowledgement waits for (pipeline only)
+
+    bool window_mode;      // credit-based flow control instead of the chunk_size acknowledgement
+    bool window_pending;   // the last window grant could not be sent, co_ota_poll sends a new one
+    int32_t window;        // the last granted window: the client may send up to window_offset + window
+    int32_t window_offset; // the offset of the last window grant
+    int64_t window_time;   // the time of the last window grant (in microseconds)
+    uint32_t rate;         // smoothed receive rate (bytes per second)
+    uint32_t rtt;          // smoothed round trip time measured by ping/pong (in microseconds)
+    int64_t ping_time;     // the time of the last ping (in microseconds)
+
+    bool patch_mode;  // the upload is a delta patch against running_ptn
+    co_patch_t patch; // patch decoder (patch mode only)
+
+    bool resumable;                 // the session is checkpointed to NVS
+    bool verify;                    // the firmware is checked against expected_sha256 at the end
+    bool hashing;                   // sha256 is updated with the received firmware
+    uint8_t expected_sha256[32];    // given by the client at start
+    mbedtls_sha256_context sha256;  // SHA-256 of the received firmware
+    co_ota_session_t checkpoint;    // the last checkpoint taken
+    bool checkpoint_pending;        // the checkpoint is saved once its data has been committed
+    int32_t durable_offset;         // the offset of the last checkpoint saved in NVS
+
 } co_ota_cb_t;
 
+/**
+ * @brief Fixed size buffers allocated once. Without memory (num 0), the buffers come from the heap.
+ *
+ */
+typedef struct co_pool {
+    uint8_t *mem;    // num buffers of size bytes
+    void *free_list; // the free buffers, each one starts with the pointer to the next
+    size_t size;
+    int num;
+} co_pool_t;
+
+/**
+ * @brief corsacOTA runtime counters
+ *
+ */
+typedef struct co_stats {
+    uint64_t recv_bytes;    // bytes received from the websocket
+    uint64_t payload_bytes; // websocket payload bytes processed
+    uint64_t copy_bytes;    // bytes moved inside the socket buffer to keep a partial frame contiguous
+} co_stats_t;
+
 /**
  * @brief corsacOTA http control block
  *
@@ -191,14 +579,58 @@ typedef struct co_cb {
     int listen_fd;        // server listener FD
     int websocket_fd;     // only one websocket is allowed.
     uint8_t *recv_data;   // recv buffer at websocket stage (text mode)
+    char *http_arena;     // recv buffer of the handshakes and of the closing sockets, the bytes are not kept
     int recv_data_offset; // (text mode)
     int max_listen_num;   // maxium number of connections. In fact, after the handshake is complete, there is only one connection to provide services
 
     int wait_timeout_sec;  // timeout (in seconds)
     int wait_timeout_usec; // timeout (in microseconds)
+    int idle_timeout_ms;   // the websocket is closed after this time without data, 0: never
+
+    int socket_buffer_size;  // receive buffer of the websocket
+    int recv_size;           // recv() size of the websocket: socket_buffer_size, or less under memory pressure
+    int text_buffer_size;    // longest text request
+    int32_t ack_chunk_size;  // largest chunk between two acknowledgements
+    int32_t window_max_size; // largest window granted in window mode
+
+    int flash_queue_depth; // number of flash blocks in the pipeline, 0 for no flash writer thread
+    int flash_writer_prio; // flash writer thread priority
+    int flash_writer_core; // flash writer thread affinity
+
+    co_flash_t idle_flash;   // pre-erase progress of the inactive OTA partition, ptn is NULL when disabled
+    size_t idle_erase_start; // pre-erase starts here, the sectors before it belong to a resumable session
+    bool app_confirmed;      // the running app is not pending verification, the update partition can be erased
+    int64_t app_check_ms;    // next time app_confirmed is checked
+
+    int32_t checkpoint_size; // bytes written between two resume checkpoints, 0 for no resume
+
+    bool skip_unchanged; // compare each sector with the update partition before it is erased
+
+    bool staging; // receive the image into external RAM when it fits, then write it to flash
+
+    size_t low_memory_threshold; // the buffers and the window shrink while the free heap is below, 0: not watched
+    bool low_memory;             // the free heap went below low_memory_threshold and has not recovered yet
+    int64_t memory_check_ms;     // the time of the last check (in milliseconds)
+
+    bool static_buffers;         // every buffer is allocated at init, nothing is allocated by a session
+    co_pool_t socket_pool;       // socket buffers (static buffers only)
+    co_pool_t sector_pool;       // the sector buffer of a session without flash writer (static buffers only)
+    co_flash_pipe_t *flash_pipe; // the flash writer, parked between two sessions (static buffers only)
+
+    mbedtls_pk_context *sign_key; // public key verifying the firmware signature, NULL when it is not required
+
+    co_capture_cb_t capture; // session capture, NULL when disabled
+    void *capture_arg;
 
     co_socket_cb_t **socket_list; // socket control block list
     co_socket_cb_t *websocket;    // the only valid socket in the list
+    co_socket_cb_t **free_list;   // unused control blocks of socket_list
+    int free_num;
+    co_socket_cb_t **fd_map; // fd to socket control block, indexed by fd - CO_FD_BASE
+    int fd_map_size;
+
+    co_event_t event;
+    co_timer_wheel_t timers;
 
     int accept_num; // current number of established connections
 
@@ -206,25 +638,256 @@ typedef struct co_cb {
 
     co_ota_cb_t ota; // ota control block
 
+    co_stats_t stats; // runtime counters
+
 } co_cb_t;
 
 static co_cb_t *global_cb = NULL;
 
-typedef void (*co_process_fn_t)(void *);
+// Heap usage of corsacOTA, only written by the corsacOTA thread (and by corsacOTA_init before it starts)
+static struct {
+    co_alloc_stats_t stats;
+    unsigned int session_mark; // alloc_num + free_num when the last OTA session started
+    bool session;              // an OTA session has started
+} co_alloc;
+
+// Count the heap usage of a new OTA session, before it takes any buffer
+static inline void co_alloc_session_start(void) {
+    co_alloc.session_mark = co_alloc.stats.alloc_num + co_alloc.stats.free_num;
+    co_alloc.session = true;
+}
+
+static void *co_malloc(size_t size) {
+    void *p = malloc(size);
+    if (p != NULL) {
+        co_alloc.stats.alloc_num++;
+    }
+    return p;
+}
+
+static void *co_calloc(size_t num, size_t size) {
+    void *p = calloc(num, size);
+    if (p != NULL) {
+        co_alloc.stats.alloc_num++;
+    }
+    return p;
+}
+
+static void *co_realloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (p != NULL) {
+        co_alloc.stats.alloc_num++;
+        if (ptr != NULL) {
+            co_alloc.stats.free_num++;
+        }
+    }
+    return p;
+}
+
+static void co_free(void *ptr) {
+    if (ptr != NULL) {
+        co_alloc.stats.free_num++;
+        free(ptr);
+    }
+}
+
+/**
+ * @brief Allocate from the external RAM, if it has room for the buffer and reserve bytes more
+ *
+ * @return void* NULL without external RAM
+ */
+static void *co_malloc_psram(size_t size, size_t reserve) {
+#if (CO_STAGING_SUPPORTED)
+    void *p;
+
+    if (heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) < size || heap_caps_get_free_size(MALLOC_CAP_SPIRAM) < size + reserve) {
+        return NULL;
+    }
+
+    p = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (p != NULL) {
+        co_alloc.stats.alloc_num++;
+    }
+    return p;
+#else
+    return NULL;
+#endif
+}
+
+static void co_free_psram(void *ptr) {
+#if (CO_STAGING_SUPPORTED)
+    if (ptr != NULL) {
+        co_alloc.stats.free_num++;
+        heap_caps_free(ptr);
+    }
+#endif
+}
+
+/**
+ * @brief Allocate the buffers of a pool
+ *
+ * @param pool pool to set up, zeroed
+ * @param size buffer size
+ * @param num number of buffers, 0 for a pool that takes its buffers from the heap
+ * @return esp_err_t
+ */
+static esp_err_t co_pool_init(co_pool_t *pool, size_t size, int num) {
+    int i;
+
+    // each buffer holds the free list link while it is free
+    size = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+    pool->size = size;
+    pool->num = num;
+    if (num == 0) {
+        return ESP_OK;
+    }
+
+    pool->mem = co_malloc(size * num);
+    if (pool->mem == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (i = num - 1; i >= 0; i--) {
+        *(void **)(pool->mem + i * size) = pool->free_list;
+        pool->free_list = pool->mem + i * size;
+    }
+    return ESP_OK;
+}
+
+static void co_pool_deinit(co_pool_t *pool) {
+    co_free(pool->mem);
+    memset(pool, 0, sizeof(co_pool_t));
+}
+
+/**
+ * @brief Take a buffer from the pool, or from the heap when the pool has no memory of its own
+ *
+ * @return void* NULL when there is none left
+ */
+static void *co_pool_get(co_pool_t *pool, size_t size) {
+    void *buf;
+
+    if (pool->mem == NULL) {
+        return co_malloc(size);
+    }
+
+    buf = pool->free_list;
+    if (buf == NULL) {
+        co_alloc.stats.pool_empty_num++;
+        return NULL;
+    }
+    pool->free_list = *(void **)buf;
+    co_alloc.stats.pool_num++;
+    return buf;
+}
+
+static void co_pool_put(co_pool_t *pool, void *buf) {
+    if (pool->mem == NULL) {
+        co_free(buf);
+        return;
+    }
+
+    if (buf != NULL) {
+        *(void **)buf = pool->free_list;
+        pool->free_list = buf;
+    }
+}
+
+static inline int64_t co_time_ms(void) {
+    return esp_timer_get_time() / 1000;
+}
+
+/**
+ * @brief Remove a timer from the wheel, nothing is done if it is not armed
+ *
+ */
+static void co_timer_del(co_timer_wheel_t *wheel, co_timer_t *timer) {
+    if (timer->pprev == NULL) {
+        return;
+    }
+
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->pprev = NULL;
+    wheel->num--;
+}
+
+/**
+ * @brief (Re)arm a timer, it expires at least timeout_ms from now
+ *
+ */
+static void co_timer_add(co_timer_wheel_t *wheel, co_timer_t *timer, int timeout_ms) {
+    co_timer_del(wheel, timer);
+
+    timer->expire_tick = (uint32_t)((co_time_ms() + timeout_ms + CONFIG_CO_TIMER_TICK_MS - 1) / CONFIG_CO_TIMER_TICK_MS);
+    if ((int32_t)(timer->expire_tick - wheel->tick) < 0) {
+        timer->expire_tick = wheel->tick;
+    }
+
+    co_timer_t **slot = &wheel->slots[timer->expire_tick & (CO_TIMER_WHEEL_SIZE - 1)];
+    timer->next = *slot;
+    if (timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+    wheel->num++;
+}
+
+/**
+ * @brief Time until the first non-empty slot of the wheel
+ *
+ * @return int milliseconds, -1 when no timer is armed
+ */
+static int co_timer_next_ms(co_timer_wheel_t *wheel) {
+    uint32_t i, tick;
+    int64_t wait;
+
+    if (wheel->num == 0) {
+        return -1;
+    }
+
+    // a timer of a later turn only causes an early wakeup
+    for (i = 0; i < CO_TIMER_WHEEL_SIZE; i++) {
+        tick = wheel->tick + i;
+        if (wheel->slots[tick & (CO_TIMER_WHEEL_SIZE - 1)] != NULL) {
+            break;
+        }
+    }
+
+    wait = (int64_t)tick * CONFIG_CO_TIMER_TICK_MS - co_time_ms();
+    return wait > 0 ? (int)wait : 0;
+}
+
+/**
+ * @brief corsacOTA request: "op=start&data=12345&key1=value1&key2=value2"
+ *
+ */
+typedef struct co_request {
+    char op[10 + 1];   // operation field
+    char data[10 + 1]; // data field
+    const char *args;  // optional "key=value" pairs after the data field, "" if there is none
+} co_request_t;
+
+typedef void (*co_process_fn_t)(co_request_t *);
 
 typedef struct co_process_entry {
     const char *str;
     co_process_fn_t fn;
 } co_process_entry_t;
 
-static void co_ota_start(void *data);
-static void co_ota_stop(void *data);
+static void co_ota_resume(co_request_t *req);
+static void co_ota_start(co_request_t *req);
+static void co_ota_stop(co_request_t *req);
 
 #define CO_ENTRY_DICT_LEN      (sizeof(co_entry_dict) / sizeof(co_entry_dict[0]))
 #define CO_ENTRT_DICT_ITEM_LEN (sizeof(co_entry_dict[0]))
 
 // must be sorted alphabetically
 static const co_process_entry_t co_entry_dict[] = {
+    {"resume", co_ota_resume},
     {"start", co_ota_start},
     {"stop", co_ota_stop},
 };
@@ -380,32 +1043,81 @@ void CO_NO_RETURN co_hardware_restart() {
 
 #endif // CO_TARGET_ESP32
 
+#if (CO_TARGET_LINUX)
+/**
+ * @brief The host port restarts the process, which then runs the partition selected by esp_ota_set_boot_partition.
+ *
+ */
+static void CO_NO_RETURN co_hardware_restart() {
+    esp_restart();
+}
+#endif // CO_TARGET_LINUX
+
 /**
- * @brief Parse the request text and populate the op and data.
+ * @brief Parse the request text and populate the op, data and the optional arguments.
  *
- * @param text Original request text
- * @param[in] op operation field
- * @param[in] data data field
+ * @param text Original request text, must outlive the request
+ * @param[in] req request
  * @return co_err_t
  * - CO_OK
  * - CO_FAIL
  */
-static co_err_t co_parse_request_text(const char *text, char *op, char *data) {
-    int ret, n;
+static co_err_t co_parse_request_text(const char *text, co_request_t *req) {
+    int ret, n, m;
 
     n = 0;
+    m = 0;
     // "op=auth&data=password"
     // "op=start&data=12345"
+    // "op=start&data=12345&window=1"
     // "op=stop&data="
-    ret = sscanf(text, "op=%10[^&]&data=%n%10s", op, &n, data);
-    if (ret == 2) {
-        return CO_OK;
-    } else if (ret == 1 && text[n] == '\0') { // data is empty
-        data[0] = '\0';
-        return CO_OK;
-    } else {
+    ret = sscanf(text, "op=%10[^&]&data=%n%10[^&]%n", req->op, &n, req->data, &m);
+    if (ret < 1 || n == 0) {
         return CO_FAIL;
+    } else if (ret == 1) { // data is empty
+        req->data[0] = '\0';
+        m = n;
+    }
+
+    if (text[m] == '\0') {
+        req->args = "";
+    } else if (text[m] == '&') {
+        req->args = text + m + 1;
+    } else {
+        return CO_FAIL; // data field too long
+    }
+
+    return CO_OK;
+}
+
+/**
+ * @brief Find an optional argument of the request.
+ *
+ * @param req request
+ * @param key argument name
+ * @param[out] value_len length of the value
+ * @return const char* The start of the value (not terminated), or NULL for not found.
+ */
+static const char *co_request_get_arg(const co_request_t *req, const char *key, size_t *value_len) {
+    const char *p = req->args;
+    const char *end;
+    size_t key_len = strlen(key);
+
+    while (*p != '\0') {
+        end = strchr(p, '&');
+        if (end == NULL) {
+            end = p + strlen(p);
+        }
+
+        if ((size_t)(end - p) > key_len && strncmp(p, key, key_len) == 0 && p[key_len] == '=') {
+            *value_len = end - p - key_len - 1;
+            return p + key_len + 1;
+        }
+
+        p = *end == '&' ? end + 1 : end;
     }
+
+    return NULL;
 }
 
 /*  RFC 6455: The WebSocket Protocol
@@ -452,11 +1164,14 @@ static co_err_t co_websocket_process_header(co_cb_t *cb, co_socket_cb_t *scb) {
     uint8_t opcode, fin, mask;
     uint64_t payload_len;
     uint8_t *data;
+    size_t avail_len;
 
-    data = (uint8_t *)scb->buf;
+    // the header is parsed where it lands in buf
+    data = (uint8_t *)scb->buf + scb->read_offset;
+    avail_len = scb->remaining_len - scb->read_offset;
 
     if (scb->status == CO_SOCKET_WEBSOCKET_HEADER) {
-        if (scb->remaining_len < 2) {
+        if (avail_len < 2) {
             return CO_OK;
         }
 
@@ -482,9 +1197,12 @@ static co_err_t co_websocket_process_header(co_cb_t *cb, co_socket_cb_t *scb) {
             break;
         case WS_OPCODE_PING:
         case WS_OPCODE_PONG:
-            scb->wcb.OPCODE = opcode;
-            break;
         case WS_OPCODE_CLOSE:
+            // control frames are whole and short, they are buffered before processing
+            if (!fin || payload_len > 125) {
+                ESP_LOGE(CO_TAG, "invalid control frame");
+                return CO_FAIL;
+            }
             scb->wcb.OPCODE = opcode;
             break;
         default:
@@ -508,7 +1226,7 @@ static co_err_t co_websocket_process_header(co_cb_t *cb, co_socket_cb_t *scb) {
 
     if (scb->status == CO_SOCKET_WEBSOCKET_EXTEND_LENGTH) {
         if (scb->wcb.payload_len == 126) {
-            if (scb->remaining_len < scb->read_len + 2) { // 2 byte extended length
+            if (avail_len < scb->read_len + 2) { // 2 byte extended length
                 return CO_OK;
             }
 
@@ -516,7 +1234,7 @@ static co_err_t co_websocket_process_header(co_cb_t *cb, co_socket_cb_t *scb) {
 
             scb->read_len += 2;
         } else if (scb->wcb.payload_len == 127) { // 8 byte extended length
-            if (scb->remaining_len < scb->read_len + 8) {
+            if (avail_len < scb->read_len + 8) {
                 return CO_OK;
             }
 
@@ -546,7 +1264,7 @@ static co_err_t co_websocket_process_header(co_cb_t *cb, co_socket_cb_t *scb) {
     }
 
     if (scb->status == CO_SOCKET_WEBSOCKET_MASK) {
-        if (scb->remaining_len < scb->read_len + 4) { // 4 byte mask
+        if (avail_len < scb->read_len + 4) { // 4 byte mask
             return CO_OK;
         }
 
@@ -560,89 +1278,535 @@ static co_err_t co_websocket_process_header(co_cb_t *cb, co_socket_cb_t *scb) {
     return CO_OK;
 }
 
-// We promise that the length of the payload should not exceed 65535
-static co_err_t co_websocket_send_frame(void *frame_buffer, size_t payload_len, int frame_type) {
-    int sz;
-    uint16_t payload_length;
-    uint8_t *p;
+/**
+ * @brief Whether a failed send() should be tried again: lwIP had no memory for the pbufs, which is short-lived
+ * unless the heap is exhausted.
+ *
+ * @param retry_num tries so far, incremented
+ */
+static bool co_socket_send_retry(int *retry_num) {
+    if (errno == EINTR) {
+        return true;
+    }
 
-    payload_length = payload_len;
-    sz = co_websocket_get_res_payload_offset(payload_len) + payload_len;
+    if ((errno == ENOMEM || errno == ENOBUFS) && (*retry_num)++ < CONFIG_CO_SEND_NOMEM_RETRY_NUM) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_CO_SEND_NOMEM_DELAY_MS));
+        return true;
+    }
 
-    p = frame_buffer;
-    // 2 bytes
-    *p++ = WS_FIN | frame_type; // frame_type
-    *p++ = (payload_length >= 126 ? 126 : payload_length);
+    return false;
+}
+
+/**
+ * @brief send() all of buf, a short write is continued
+ *
+ * @return co_err_t
+ * - CO_OK: everything has been sent
+ * - CO_ERROR_NO_MEM: nothing has been sent, lwIP is out of memory. The message can be sent again later
+ * - CO_FAIL: the connection is broken or the send timeout expired
+ */
+static co_err_t co_socket_send_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    int ret, retry_num = 0;
+
+    while (len > 0) {
+        ret = send(fd, p, len, 0);
+        if (ret < 0) {
+            if (co_socket_send_retry(&retry_num)) {
+                continue;
+            }
+            if ((errno == ENOMEM || errno == ENOBUFS) && p == buf) {
+                ESP_LOGD(CO_TAG, LOG_FMT("no memory to send (%d)"), errno);
+                return CO_ERROR_NO_MEM;
+            }
+            ESP_LOGW(CO_TAG, LOG_FMT("error in send (%d)"), errno);
+            return CO_FAIL;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return CO_OK;
+}
+
+/**
+ * @brief Send the pieces of iov as one message, a short write is continued from where it stopped.
+ *        Without sendmsg(), small messages are gathered on the stack so that they still leave in one segment.
+ *
+ * @param fd socket file descriptor
+ * @param iov pieces of the message, modified
+ * @param iovcnt number of pieces
+ * @return co_err_t see co_socket_send_all
+ */
+static co_err_t co_socket_sendv(int fd, struct iovec *iov, int iovcnt) {
+#if (CO_SENDMSG)
+    struct msghdr msg;
+    bool sent = false;
+    int ret, retry_num = 0;
+    size_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0) {
+        ret = sendmsg(fd, &msg, 0);
+        if (ret < 0) {
+            if (co_socket_send_retry(&retry_num)) {
+                continue;
+            }
+            if ((errno == ENOMEM || errno == ENOBUFS) && !sent) {
+                ESP_LOGD(CO_TAG, LOG_FMT("no memory to send (%d)"), errno);
+                return CO_ERROR_NO_MEM;
+            }
+            ESP_LOGW(CO_TAG, LOG_FMT("error in sendmsg (%d)"), errno);
+            return CO_FAIL;
+        }
+        sent = true;
 
-    // extended length
-    if (payload_length >= 126) {
-        payload_length = htons(payload_length);
-        memcpy(p, &payload_length, 2);
-        p += 2;
+        // skip what has been sent
+        for (n = ret; msg.msg_iovlen > 0 && n >= msg.msg_iov->iov_len; msg.msg_iovlen--, msg.msg_iov++) {
+            n -= msg.msg_iov->iov_len;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
     }
+    return CO_OK;
+#else
+    uint8_t buf[CONFIG_CO_SEND_GATHER_SIZE];
+    size_t len = 0;
+    int i, ret;
 
-    // no mask
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
 
-    send(global_cb->websocket->fd, frame_buffer, sz, 0);
+    if (len <= sizeof(buf)) {
+        for (len = 0, i = 0; i < iovcnt; i++) {
+            memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        return co_socket_send_all(fd, buf, len);
+    }
 
+    for (i = 0; i < iovcnt; i++) {
+        ret = co_socket_send_all(fd, iov[i].iov_base, iov[i].iov_len);
+        if (ret != CO_OK) {
+            return i == 0 ? ret : CO_FAIL; // the start of the message has left
+        }
+    }
     return CO_OK;
+#endif // CO_SENDMSG
 }
 
-// Create a new frame buffer, construct text and send frame.
-static co_err_t co_websocket_send_msg_with_code(int code, const char *msg) {
-    char *buffer;
-    int len, ret;
-    int offset;
+/**
+ * @brief Write the header of an unmasked frame
+ *
+ * @return int The header length: 2, or 4 with the 16-bit extended length
+ */
+static inline int co_websocket_write_header(uint8_t *header, size_t payload_len, int frame_type) {
+    // We promise that the length of the payload should not exceed 65535
+    header[0] = WS_FIN | frame_type;
+    if (payload_len < 126) {
+        header[1] = payload_len;
+        return 2;
+    }
+    header[1] = 126;
+    header[2] = payload_len >> 8;
+    header[3] = payload_len & 0xFF;
+    return 4;
+}
 
-    len = strlen(msg);
-    offset = co_websocket_get_res_payload_offset(len);
-    buffer = malloc(offset + len + 25);
-    if (buffer == NULL) {
-        ret = CO_ERROR_NO_MEM;
-        goto cleanup;
+// The header is written on the stack and sent together with the payload, wherever the payload is.
+static co_err_t co_websocket_send_frame(const void *payload, size_t payload_len, int frame_type) {
+    uint8_t header[4];
+    struct iovec iov[2];
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = co_websocket_write_header(header, payload_len, frame_type);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payload_len;
+
+    return co_socket_sendv(global_cb->websocket->fd, iov, 2);
+}
+
+/**
+ * @brief Format an unsigned integer in decimal
+ *
+ * @return int The number of characters written, no terminator
+ */
+static inline int co_utoa(char *dst, uint32_t value) {
+    char tmp[10];
+    int n = 0, i;
+
+    do {
+        tmp[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    for (i = 0; i < n; i++) {
+        dst[i] = tmp[n - 1 - i];
+    }
+    return n;
+}
+
+static inline int co_itoa(char *dst, int value) {
+    if (value < 0) {
+        *dst = '-';
+        return 1 + co_utoa(dst + 1, 0U - (uint32_t)value);
     }
+    return co_utoa(dst, value);
+}
 
+// Send `code=<code>&data="<msg>"`, or `code=<code>&data="msg=<msg>"` for an error, without copying msg.
+static co_err_t co_websocket_send_msg_with_code(int code, const char *msg) {
+    uint8_t head[4 + 32]; // frame header and `code=-2147483648&data="msg=`
+    char *text = (char *)head + 4;
+    struct iovec iov[3];
+    int text_len, len, offset;
+
+    memcpy(text, "code=", 5);
+    text_len = 5;
+    text_len += co_itoa(text + text_len, code);
     if (code == CO_RES_SUCCESS) {
-        ret = snprintf(buffer + offset, len + 24, "code=%d&data=\"%s\"", code, msg);
+        memcpy(text + text_len, "&data=\"", 7);
+        text_len += 7;
     } else {
-        ret = snprintf(buffer + offset, len + 24, "code=%d&data=\"msg=%s\"", code, msg);
+        memcpy(text + text_len, "&data=\"msg=", 11);
+        text_len += 11;
     }
 
-    if (ret < 0) {
-        ESP_LOGE(CO_TAG, "invalid arg");
-        ret = CO_ERROR_INVALID_ARG;
-        goto cleanup;
-    }
+    len = strlen(msg);
+    // the frame header goes right before the text
+    offset = 4 - co_websocket_get_res_payload_offset(text_len + len + 1);
+    co_websocket_write_header(head + offset, text_len + len + 1, WS_OPCODE_TEXT);
+
+    iov[0].iov_base = head + offset;
+    iov[0].iov_len = 4 - offset + text_len;
+    iov[1].iov_base = (void *)msg;
+    iov[1].iov_len = len;
+    iov[2].iov_base = "\"";
+    iov[2].iov_len = 1;
+
+    return co_socket_sendv(global_cb->websocket->fd, iov, 3);
+}
 
-    ret = co_websocket_send_frame(buffer, ret, WS_OPCODE_TEXT);
+/*
+ * Acknowledgements are sent at the chunk or window rate. They are built from a preformatted template on the
+ * stack, their length always fits the 2-byte frame header:
+ *
+ *   co_ack_t ack;
+ *   co_ack_begin(&ack, CO_ACK_READY);
+ *   co_ack_int(&ack, offset);
+ *   co_ack_send(&ack);
+ */
+#define CO_ACK_READY  "code=0&data=\"state=ready&offset="
+#define CO_ACK_DONE   "code=0&data=\"state=done&offset="
+#define CO_ACK_ERASE  "code=0&data=\"state=erase&erased="
 
-cleanup:
-    free(buffer);
-    return ret;
+#define CO_ACK_MAX_SIZE 125 // payload of a frame with a 2-byte header
+
+typedef struct co_ack {
+    uint8_t frame[2 + CO_ACK_MAX_SIZE];
+    int len; // payload length
+} co_ack_t;
+
+#define co_ack_begin(ack, template) co_ack_begin_n(ack, template, sizeof(template) - 1)
+#define co_ack_str(ack, str)        co_ack_str_n(ack, str, sizeof(str) - 1)
+
+static inline void co_ack_begin_n(co_ack_t *ack, const char *template, int len) {
+    memcpy(ack->frame + 2, template, len);
+    ack->len = len;
+}
+
+static inline void co_ack_str_n(co_ack_t *ack, const char *str, int len) {
+    memcpy(ack->frame + 2 + ack->len, str, len);
+    ack->len += len;
+}
+
+static inline void co_ack_int(co_ack_t *ack, int value) {
+    ack->len += co_itoa((char *)ack->frame + 2 + ack->len, value);
+}
+
+static co_err_t co_ack_send(co_ack_t *ack) {
+    ack->frame[2 + ack->len++] = '"';
+    co_websocket_write_header(ack->frame, ack->len, WS_OPCODE_TEXT);
+    return co_socket_send_all(global_cb->websocket->fd, ack->frame, 2 + ack->len);
 }
 
 #if (CO_TEST_MODE == 1)
 // use for test
 static co_err_t co_websocket_send_echo(void *data, size_t len, int frame_type) {
-    char *buffer;
-    int ret;
-    int offset;
-
-    offset = co_websocket_get_res_payload_offset(len);
-    buffer = malloc(offset + len);
-    if (buffer == NULL) {
-        ret = CO_ERROR_NO_MEM;
-        goto cleanup;
+    return co_websocket_send_frame(data, len, frame_type);
+}
+#endif // (CO_TEST_MODE == 1)
+
+static inline CO_INLINE uint32_t co_rotr32(uint32_t n, unsigned int c) {
+    const unsigned int mask = (CHAR_BIT * sizeof(n) - 1);
+    c &= mask;
+    return (n >> c) | (n << ((-c) & mask));
+}
+
+static inline CO_INLINE uint32_t co_rotl32(uint32_t n, unsigned int c) {
+    const unsigned int mask = (CHAR_BIT * sizeof(n) - 1);
+    c &= mask;
+    return (n << c) | (n >> ((-c) & mask));
+}
+
+/**
+ * @brief Get the mask to be used after `len` bytes have been processed.
+ *
+ * The mask is always kept in memory order (mask.data[0] is the first byte on the wire),
+ * so the rotation direction depends on the endianness.
+ */
+static inline CO_INLINE uint32_t co_websocket_get_new_mask(uint32_t mask, size_t len) {
+#if (defined __BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    return co_rotl32(mask, (len & 0b11) * 8U);
+#else
+    return co_rotr32(mask, (len & 0b11) * 8U);
+#endif
+}
+
+/*
+ * Unmask kernels
+ *
+ * All kernels share the same prototype: `dst` and `src` may be the same buffer (unmask in place),
+ * or `dst` may be a separate buffer, in which case the payload is unmasked while being copied.
+ * The head bytes are processed one by one until `dst` is aligned, then the widest store available
+ * is used, and the tail is processed one by one again.
+ *
+ * One of them is selected at compile time:
+ *  - AVX2 / SSE2 / NEON: host build
+ *  - 64bit word        : other 64bit host
+ *  - unrolled 32bit    : RISC-V (esp32c3)
+ *  - 32bit word        : xtensa (esp8266/lx106, esp32, esp32s3)
+ */
+typedef uint32_t __attribute__((may_alias)) co_u32_alias_t;
+typedef uint64_t __attribute__((may_alias)) co_u64_alias_t;
+
+static inline CO_INLINE void co_mask_bytes(uint8_t *dst, const uint8_t *src, uint32_t mask, size_t len) {
+    const uint8_t *p_mask = (const uint8_t *)&mask;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        dst[i] = src[i] ^ p_mask[i & 0b11];
     }
-    memcpy(buffer + offset, data, len);
+}
+
+/**
+ * @brief Process the unaligned head bytes, so that dst is aligned to `align` bytes.
+ *
+ * @return size_t The number of bytes processed
+ */
+static inline CO_INLINE size_t co_mask_align_head(uint8_t *dst, const uint8_t *src, uint32_t *mask, size_t len, size_t align) {
+    size_t head_len;
 
-    ret = co_websocket_send_frame(buffer, len, frame_type);
+    head_len = (-(uintptr_t)dst) & (align - 1);
+    head_len = min(head_len, len);
 
-cleanup:
-    free(buffer);
-    return ret;
+    co_mask_bytes(dst, src, *mask, head_len);
+    *mask = co_websocket_get_new_mask(*mask, head_len);
+
+    return head_len;
+}
+
+static inline CO_INLINE uint32_t co_load32(const uint8_t *src) {
+    uint32_t val;
+    memcpy(&val, src, 4); // unaligned load
+    return val;
+}
+
+static inline CO_INLINE uint64_t co_load64(const uint8_t *src) {
+    uint64_t val;
+    memcpy(&val, src, 8); // unaligned load
+    return val;
+}
+
+// For xtensa: single fetch: 4 byte(32bit). Unaligned access is not allowed.
+static void CO_UNUSED co_mask_copy_word32(uint8_t *dst, const uint8_t *src, uint32_t mask, size_t len) {
+    size_t n;
+
+    if (len >= 8) {
+        n = co_mask_align_head(dst, src, &mask, len, 4);
+        dst += n;
+        src += n;
+        len -= n;
+
+        if (((uintptr_t)src & 0b11) == 0) {
+            for (; len >= 4; len -= 4, dst += 4, src += 4) {
+                *(co_u32_alias_t *)dst = *(const co_u32_alias_t *)src ^ mask;
+            }
+        } else {
+            for (; len >= 4; len -= 4, dst += 4, src += 4) {
+                *(co_u32_alias_t *)dst = co_load32(src) ^ mask;
+            }
+        }
+    }
+
+    // There are just a few bytes to process
+    co_mask_bytes(dst, src, mask, len);
+}
+
+// For RISC-V (esp32c3): rv32 has no 64bit register, unroll the 32bit loop instead.
+static void CO_UNUSED co_mask_copy_unroll32(uint8_t *dst, const uint8_t *src, uint32_t mask, size_t len) {
+    size_t n;
+
+    if (len >= 16) {
+        n = co_mask_align_head(dst, src, &mask, len, 4);
+        dst += n;
+        src += n;
+        len -= n;
+
+        if (((uintptr_t)src & 0b11) == 0) {
+            for (; len >= 16; len -= 16, dst += 16, src += 16) {
+                ((co_u32_alias_t *)dst)[0] = ((const co_u32_alias_t *)src)[0] ^ mask;
+                ((co_u32_alias_t *)dst)[1] = ((const co_u32_alias_t *)src)[1] ^ mask;
+                ((co_u32_alias_t *)dst)[2] = ((const co_u32_alias_t *)src)[2] ^ mask;
+                ((co_u32_alias_t *)dst)[3] = ((const co_u32_alias_t *)src)[3] ^ mask;
+            }
+        }
+
+        for (; len >= 4; len -= 4, dst += 4, src += 4) {
+            *(co_u32_alias_t *)dst = co_load32(src) ^ mask;
+        }
+    }
+
+    co_mask_bytes(dst, src, mask, len);
+}
+
+static void CO_UNUSED co_mask_copy_word64(uint8_t *dst, const uint8_t *src, uint32_t mask, size_t len) {
+    uint64_t mask64;
+    size_t n;
+
+    if (len >= 16) {
+        n = co_mask_align_head(dst, src, &mask, len, 8);
+        dst += n;
+        src += n;
+        len -= n;
+
+        // The mask repeats every 4 bytes, so both halves are the same in memory order.
+        mask64 = ((uint64_t)mask << 32) | mask;
+        for (; len >= 8; len -= 8, dst += 8, src += 8) {
+            *(co_u64_alias_t *)dst = co_load64(src) ^ mask64;
+        }
+    }
+
+    co_mask_bytes(dst, src, mask, len);
+}
+
+#if (defined __SSE2__)
+#include <emmintrin.h>
+
+static void CO_UNUSED co_mask_copy_sse2(uint8_t *dst, const uint8_t *src, uint32_t mask, size_t len) {
+    __m128i mask128;
+    size_t n;
+
+    if (len >= 32) {
+        n = co_mask_align_head(dst, src, &mask, len, 16);
+        dst += n;
+        src += n;
+        len -= n;
+
+        mask128 = _mm_set1_epi32((int)mask);
+        for (; len >= 16; len -= 16, dst += 16, src += 16) {
+            _mm_store_si128((__m128i *)dst, _mm_xor_si128(_mm_loadu_si128((const __m128i *)src), mask128));
+        }
+    }
+
+    co_mask_copy_word64(dst, src, mask, len);
+}
+#endif // __SSE2__
+
+#if (defined __AVX2__)
+#include <immintrin.h>
+
+static void CO_UNUSED co_mask_copy_avx2(uint8_t *dst, const uint8_t *src, uint32_t mask, size_t len) {
+    __m256i mask256;
+    size_t n;
+
+    if (len >= 64) {
+        n = co_mask_align_head(dst, src, &mask, len, 32);
+        dst += n;
+        src += n;
+        len -= n;
+
+        mask256 = _mm256_set1_epi32((int)mask);
+        for (; len >= 32; len -= 32, dst += 32, src += 32) {
+            _mm256_store_si256((__m256i *)dst, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)src), mask256));
+        }
+    }
+
+    co_mask_copy_sse2(dst, src, mask, len);
+}
+#endif // __AVX2__
+
+#if (defined __ARM_NEON)
+#include <arm_neon.h>
+
+static void CO_UNUSED co_mask_copy_neon(uint8_t *dst, const uint8_t *src, uint32_t mask, size_t len) {
+    uint8x16_t mask128;
+    size_t n;
+
+    if (len >= 32) {
+        n = co_mask_align_head(dst, src, &mask, len, 16);
+        dst += n;
+        src += n;
+        len -= n;
+
+        mask128 = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+        for (; len >= 16; len -= 16, dst += 16, src += 16) {
+            vst1q_u8(dst, veorq_u8(vld1q_u8(src), mask128));
+        }
+    }
+
+    co_mask_copy_word64(dst, src, mask, len);
+}
+#endif // __ARM_NEON
+
+#if (defined __AVX2__)
+#define co_mask_copy_kernel co_mask_copy_avx2
+#define CO_MASK_KERNEL_NAME "avx2"
+#elif (defined __SSE2__)
+#define co_mask_copy_kernel co_mask_copy_sse2
+#define CO_MASK_KERNEL_NAME "sse2"
+#elif (defined __ARM_NEON)
+#define co_mask_copy_kernel co_mask_copy_neon
+#define CO_MASK_KERNEL_NAME "neon"
+#elif (defined __riscv)
+#define co_mask_copy_kernel co_mask_copy_unroll32
+#define CO_MASK_KERNEL_NAME "unroll32"
+#elif (UINTPTR_MAX > 0xFFFFFFFFUL)
+#define co_mask_copy_kernel co_mask_copy_word64
+#define CO_MASK_KERNEL_NAME "word64"
+#else
+#define co_mask_copy_kernel co_mask_copy_word32
+#define CO_MASK_KERNEL_NAME "word32"
+#endif
+
+/**
+ * @brief Quick calculation WebSocket. The process of calculating the mask is one of the performance bottlenecks
+ * of the entire websocket. The performance between the optimized version and the version without mask is not significant.
+ *
+ * @param data data buffer ptr
+ * @param mask websocket mask, in memory order.
+ * @param len data length
+ */
+void co_websocket_fast_mask(uint8_t *data, uint32_t mask, size_t len) {
+    co_mask_copy_kernel(data, data, mask, len);
+}
+
+/**
+ * @brief Unmask the payload and copy it to the destination buffer in one pass.
+ *
+ * @param dst destination buffer ptr, must not overlap with src unless dst == src
+ * @param src masked data ptr
+ * @param mask websocket mask, in memory order.
+ * @param len data length
+ */
+void co_websocket_mask_copy(uint8_t *dst, const uint8_t *src, uint32_t mask, size_t len) {
+    co_mask_copy_kernel(dst, src, mask, len);
 }
-#endif // (CO_TEST_MODE == 1)
 
 static const char *co_ota_error_to_msg(esp_err_t err) {
     switch (err) {
@@ -665,92 +1829,1333 @@ static const char *co_ota_error_to_msg(esp_err_t err) {
         return "Flash write failed";
     case ESP_ERR_INVALID_STATE:
         return "Flash encryption is enabled";
+#ifdef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+    case ESP_ERR_OTA_ROLLBACK_INVALID_STATE:
+        return "Running firmware is not confirmed";
+#endif
     default:
         return "OTA Failed";
     }
 }
 
-/**
- * @brief OTA init
- *
- * @param size Total firmware size
- * @return const char* Error message, returns NULL indicating that no error occurred
- */
-static const char *co_ota_init(int32_t size) {
-    const esp_partition_t *boot_ptn, *running_ptn, *update_ptn;
+// Erase the next sector after the erased area.
+static esp_err_t co_flash_erase_next(co_flash_t *flash) {
+    size_t erased = flash->erased;
     esp_err_t ret;
 
-    boot_ptn = esp_ota_get_boot_partition();
-    running_ptn = esp_ota_get_running_partition();
-    if (boot_ptn != running_ptn) {
-        //// TODO:  boot image become corrupted
+    if (erased + CO_FLASH_SECTOR_SIZE > flash->ptn->size) {
+        return ESP_ERR_INVALID_SIZE;
     }
 
-    update_ptn = esp_ota_get_next_update_partition(NULL);
-    if (update_ptn == NULL) {
-        global_cb->ota.status = CO_OTA_FATAL_ERROR;
-        global_cb->ota.error_code = CO_ERROR_INVALID_OTA_PTN;
-        return "Invalid OTA data partition";
+    ret = esp_partition_erase_range(flash->ptn, erased, CO_FLASH_SECTOR_SIZE);
+    if (ret == ESP_OK) {
+        flash->erase_num++;
+        __atomic_store_n(&flash->erased, erased + CO_FLASH_SECTOR_SIZE, __ATOMIC_RELEASE);
     }
 
-    // Start erase flash
-    //// TODO: full chip erase
-    ret = esp_ota_begin(update_ptn, size, &global_cb->ota.update_handle);
+    return ret;
+}
 
-    global_cb->ota.update_ptn = update_ptn;
+// Erase the flash block after the erased area at once, or the next sector when it is not at a block boundary.
+static esp_err_t co_flash_erase_block(co_flash_t *flash) {
+    size_t erased = flash->erased;
+    esp_err_t ret;
 
-    return co_ota_error_to_msg(ret);
+    if (erased % CO_FLASH_BLOCK_SIZE != 0 || erased + CO_FLASH_BLOCK_SIZE > flash->ptn->size) {
+        return co_flash_erase_next(flash);
+    }
+
+    ret = esp_partition_erase_range(flash->ptn, erased, CO_FLASH_BLOCK_SIZE);
+    if (ret == ESP_OK) {
+        flash->erase_num += CO_FLASH_BLOCK_SIZE / CO_FLASH_SECTOR_SIZE;
+        __atomic_store_n(&flash->erased, erased + CO_FLASH_BLOCK_SIZE, __ATOMIC_RELEASE);
+    }
+
+    return ret;
 }
 
-// write ota data
-static const char *co_ota_write(void *data, size_t len) {
-    esp_err_t ret = esp_ota_write(global_cb->ota.update_handle, data, len);
-    return co_ota_error_to_msg(ret);
+// Whether the partition already holds the data
+static bool co_flash_is_unchanged(co_flash_t *flash, size_t offset, const uint8_t *data, size_t len) {
+    uint8_t buf[CONFIG_CO_FLASH_COMPARE_CHUNK];
+    size_t n;
+
+    for (; len > 0; offset += n, data += n, len -= n) {
+        n = min(len, sizeof(buf));
+        if (esp_partition_read(flash->ptn, offset, buf, n) != ESP_OK || memcmp(buf, data, n) != 0) {
+            return false;
+        }
+    }
+
+    return true;
 }
 
-static const char *co_ota_end() {
-    esp_err_t ret = esp_ota_end(global_cb->ota.update_handle);
+// Program the data into the partition, the sectors that have not been erased are erased first.
+static esp_err_t co_flash_program(co_flash_t *flash, size_t offset, const void *data, size_t len) {
+    esp_err_t ret;
 
-    if (ret != ESP_OK) {
-        return co_ota_error_to_msg(ret);
+    // Only a whole sector that has not been touched yet can be skipped.
+    if (flash->compare && flash->erased == offset && len == CO_FLASH_SECTOR_SIZE &&
+        co_flash_is_unchanged(flash, offset, data, len)) {
+        flash->skip_num++;
+        __atomic_store_n(&flash->erased, offset + len, __ATOMIC_RELEASE);
+        return ESP_OK;
     }
 
-    ret = esp_ota_set_boot_partition(global_cb->ota.update_ptn);
-    return co_ota_error_to_msg(ret);
+    while (flash->erased < offset + len) {
+        ret = co_flash_erase_next(flash);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+
+    flash->write_num++;
+    return esp_partition_write(flash->ptn, offset, data, len);
+}
+
+static inline bool co_flash_can_erase_ahead(co_flash_t *flash) {
+    return flash->ptn != NULL && !flash->compare && flash->erased < flash->erase_limit;
+}
+
+static bool co_spsc_push(co_spsc_queue_t *q, co_flash_block_t *block) {
+    uint32_t tail = q->tail;
+    uint32_t next = (tail + 1) % q->size;
+
+    if (next == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+        return false; // full
+    }
+
+    q->slots[tail] = block;
+    __atomic_store_n(&q->tail, next, __ATOMIC_RELEASE);
+    return true;
+}
+
+static co_flash_block_t *co_spsc_pop(co_spsc_queue_t *q) {
+    uint32_t head = q->head;
+    co_flash_block_t *block;
+
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        return NULL; // empty
+    }
+
+    block = q->slots[head];
+    __atomic_store_n(&q->head, (head + 1) % q->size, __ATOMIC_RELEASE);
+    return block;
+}
+
+static inline bool co_spsc_is_empty(co_spsc_queue_t *q) {
+    return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t co_spsc_count(co_spsc_queue_t *q) {
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+    return (tail + q->size - head) % q->size;
 }
 
 /**
- * @brief Process OTA start request
+ * @brief Tell the corsacOTA thread that a block has been written. It waits in co_event_wait and not for the task
+ * notification, so the event loop is woken too. One wakeup at a time is in flight.
  *
- * @param data Pointer to a string indicating the size of the firmware
  */
-static void co_ota_start(void *data) { // TODO: return value -> status
-    const char *res_msg = "deviceType=" CO_DEVICE_TYPE_NAME "&state=ready&offset=0";
-    const char *err_msg;
-    int size;
+static void co_flash_pipe_notify(co_flash_pipe_t *pipe) {
+    xTaskNotifyGive(pipe->owner);
 
-    // may be we should ignore status...
-    // if (global_cb->ota.status != CO_OTA_INIT && global_cb->ota.status != CO_OTA_STOP) {
-    //     co_websocket_send_msg_with_code(CO_RES_INVALID_STATUS, "OTA has not started");
-    //     return;
-    // }
+    if (pipe->wake_fd >= 0 && !__atomic_exchange_n(&pipe->wake_pending, true, __ATOMIC_ACQ_REL)) {
+        if (send(pipe->wake_fd, "", 1, 0) < 0) {
+            __atomic_store_n(&pipe->wake_pending, false, __ATOMIC_RELEASE); // the loop still polls the pipe
+        }
+    }
+}
 
-    size = atoi(data);
-    if (size < 1) {
-        co_websocket_send_msg_with_code(CO_RES_INVALID_SIZE, "Invalid size");
+static void co_flash_writer_thread(void *pvParameter) {
+    co_flash_pipe_t *pipe = pvParameter;
+    co_flash_block_t *block;
+    esp_err_t ret;
+
+    while (1) {
+        block = co_spsc_pop(&pipe->full_queue);
+        if (block == NULL) {
+            if (__atomic_load_n(&pipe->exit, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+
+            // between two sessions, until co_flash_pipe_attach has reset the pipe
+            if (__atomic_load_n(&pipe->park, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&pipe->parked, true, __ATOMIC_RELEASE);
+                if (pipe->owner != NULL) {
+                    xTaskNotifyGive(pipe->owner);
+                }
+                while (__atomic_load_n(&pipe->park, __ATOMIC_ACQUIRE) && !__atomic_load_n(&pipe->exit, __ATOMIC_ACQUIRE)) {
+                    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                }
+                __atomic_store_n(&pipe->parked, false, __ATOMIC_RELEASE);
+                if (pipe->owner != NULL) {
+                    xTaskNotifyGive(pipe->owner);
+                }
+                continue;
+            }
+
+            // nothing to write, erase ahead of the write cursor
+            if (co_flash_can_erase_ahead(&pipe->flash) && __atomic_load_n(&pipe->err, __ATOMIC_ACQUIRE) == ESP_OK) {
+                ret = co_flash_erase_next(&pipe->flash);
+                if (ret != ESP_OK) {
+                    __atomic_store_n(&pipe->err, ret, __ATOMIC_RELEASE);
+                }
+                xTaskNotifyGive(pipe->owner);
+                continue;
+            }
+
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        // after the first error, the blocks are just recycled
+        if (__atomic_load_n(&pipe->err, __ATOMIC_ACQUIRE) == ESP_OK) {
+            ret = co_flash_program(&pipe->flash, block->offset, block->buf, block->len);
+            if (ret != ESP_OK) {
+                __atomic_store_n(&pipe->err, ret, __ATOMIC_RELEASE);
+            }
+        }
+
+        __atomic_store_n(&pipe->committed, pipe->committed + (int32_t)block->len, __ATOMIC_RELEASE);
+        block->len = 0;
+        co_spsc_push(&pipe->free_queue, block);
+
+        co_flash_pipe_notify(pipe);
+    }
+
+    __atomic_store_n(&pipe->running, false, __ATOMIC_RELEASE); // the pipe must not be touched after this
+    vTaskDelete(NULL);
+}
+
+static void co_flash_pipe_destroy(co_flash_pipe_t *pipe) {
+    int i;
+
+    if (pipe->writer != NULL) {
+        __atomic_store_n(&pipe->exit, true, __ATOMIC_RELEASE);
+        xTaskNotifyGive(pipe->writer);
+        while (__atomic_load_n(&pipe->running, __ATOMIC_ACQUIRE)) {
+            vTaskDelay(1);
+        }
+    }
+
+    // a pipe that failed to be created may have no blocks
+    for (i = 0; pipe->blocks != NULL && i < pipe->depth; i++) {
+        co_free(pipe->blocks[i].buf);
+    }
+    co_free(pipe->blocks);
+    co_free(pipe->full_queue.slots);
+    co_free(pipe->free_queue.slots);
+    co_free(pipe);
+}
+
+/**
+ * @brief Create the flash writer pipeline and start its thread
+ *
+ * @param flash flash state of the session, NULL for a pipe created at init that waits parked for its first session
+ * @param depth number of flash blocks
+ */
+static co_flash_pipe_t *co_flash_pipe_create(co_cb_t *cb, co_flash_t *flash, int depth) {
+    co_flash_pipe_t *pipe;
+    int i, ret;
+
+    pipe = co_calloc(1, sizeof(co_flash_pipe_t));
+    if (pipe == NULL) {
+        return NULL;
+    }
+
+    pipe->depth = depth;
+    pipe->wake_fd = cb->event.wake_send_fd;
+    if (flash != NULL) {
+        pipe->flash = *flash;
+        pipe->owner = xTaskGetCurrentTaskHandle();
+    } else {
+        pipe->park = true; // created at init, the writer waits for the first session and its owner
+    }
+    pipe->full_queue.size = pipe->depth + 1;
+    pipe->free_queue.size = pipe->depth + 1;
+    pipe->full_queue.slots = co_calloc(pipe->depth + 1, sizeof(co_flash_block_t *));
+    pipe->free_queue.slots = co_calloc(pipe->depth + 1, sizeof(co_flash_block_t *));
+    pipe->blocks = co_calloc(pipe->depth, sizeof(co_flash_block_t));
+    if (pipe->full_queue.slots == NULL || pipe->free_queue.slots == NULL || pipe->blocks == NULL) {
+        goto fail;
+    }
+
+    for (i = 0; i < pipe->depth; i++) {
+        pipe->blocks[i].buf = co_malloc(CO_FLASH_SECTOR_SIZE);
+        if (pipe->blocks[i].buf == NULL) {
+            goto fail;
+        }
+        co_spsc_push(&pipe->free_queue, &pipe->blocks[i]);
+    }
+
+    pipe->running = true;
+#if (CO_TARGET_ESP8266)
+    ret = xTaskCreate(co_flash_writer_thread, "co_flash", CONFIG_CO_FLASH_WRITER_STACK_SIZE, pipe,
+                      cb->flash_writer_prio, &pipe->writer);
+#else
+    ret = xTaskCreatePinnedToCore(co_flash_writer_thread, "co_flash", CONFIG_CO_FLASH_WRITER_STACK_SIZE, pipe,
+                                  cb->flash_writer_prio, &pipe->writer,
+                                  (cb->flash_writer_core < 0 || cb->flash_writer_core >= portNUM_PROCESSORS) ? tskNO_AFFINITY : cb->flash_writer_core);
+#endif
+    if (ret != pdPASS) {
+        ESP_LOGE(CO_TAG, "can not create flash writer thread:%d", ret);
+        pipe->writer = NULL;
+        goto fail;
+    }
+
+    return pipe;
+
+fail:
+    co_flash_pipe_destroy(pipe);
+    return NULL;
+}
+
+/**
+ * @brief Wait until the flash writer has written the submitted blocks and parked, the pipe is kept for the next session
+ *
+ */
+static void co_flash_pipe_park(co_flash_pipe_t *pipe) {
+    __atomic_store_n(&pipe->park, true, __ATOMIC_RELEASE);
+    xTaskNotifyGive(pipe->writer);
+    while (!__atomic_load_n(&pipe->parked, __ATOMIC_ACQUIRE)) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_CO_FLASH_POLL_INTERVAL_MS));
+    }
+}
+
+/**
+ * @brief Reset a parked pipe for a new session and resume the flash writer
+ *
+ * @param pipe pipe created at init
+ * @param flash flash state of the session
+ */
+static void co_flash_pipe_attach(co_flash_pipe_t *pipe, co_flash_t *flash) {
+    int i;
+
+    // the writer does not touch the pipe while it is parked
+    pipe->owner = xTaskGetCurrentTaskHandle();
+    pipe->flash = *flash;
+    pipe->full_queue.head = pipe->full_queue.tail = 0;
+    pipe->free_queue.head = pipe->free_queue.tail = 0;
+    for (i = 0; i < pipe->depth; i++) {
+        pipe->blocks[i].len = 0;
+        co_spsc_push(&pipe->free_queue, &pipe->blocks[i]);
+    }
+    pipe->submitted = 0;
+    pipe->committed = 0;
+    pipe->err = ESP_OK;
+    pipe->wake_pending = false;
+
+    __atomic_store_n(&pipe->park, false, __ATOMIC_RELEASE);
+    xTaskNotifyGive(pipe->writer);
+    while (__atomic_load_n(&pipe->parked, __ATOMIC_ACQUIRE)) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_CO_FLASH_POLL_INTERVAL_MS));
+    }
+}
+
+/**
+ * @brief Get an empty block from the flash writer. Block until one is available.
+ *
+ */
+static co_flash_block_t *co_flash_pipe_get_block(co_flash_pipe_t *pipe) {
+    co_flash_block_t *block;
+
+    while ((block = co_spsc_pop(&pipe->free_queue)) == NULL) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_CO_FLASH_POLL_INTERVAL_MS));
+    }
+
+    return block;
+}
+
+// Wait until all submitted blocks are written to flash.
+static esp_err_t co_flash_pipe_drain(co_flash_pipe_t *pipe) {
+    while (__atomic_load_n(&pipe->committed, __ATOMIC_ACQUIRE) != pipe->submitted) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_CO_FLASH_POLL_INTERVAL_MS));
+    }
+
+    return __atomic_load_n(&pipe->err, __ATOMIC_ACQUIRE);
+}
+
+static esp_err_t co_session_load(co_ota_session_t *session) {
+    nvs_handle handle;
+    size_t len = sizeof(co_ota_session_t);
+    esp_err_t ret;
+
+    ret = nvs_open(CO_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = nvs_get_blob(handle, CO_NVS_SESSION_KEY, session, &len);
+    nvs_close(handle);
+    if (ret == ESP_OK && (len != sizeof(co_ota_session_t) || session->magic != CO_SESSION_MAGIC)) {
+        ret = ESP_ERR_NOT_FOUND; // written by another version
+    }
+
+    return ret;
+}
+
+static esp_err_t co_session_save(const co_ota_session_t *session) {
+    nvs_handle handle;
+    esp_err_t ret;
+
+    ret = nvs_open(CO_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = nvs_set_blob(handle, CO_NVS_SESSION_KEY, session, sizeof(co_ota_session_t));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    return ret;
+}
+
+static void co_session_erase() {
+    nvs_handle handle;
+
+    if (nvs_open(CO_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+
+    if (nvs_erase_key(handle, CO_NVS_SESSION_KEY) == ESP_OK) {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+/**
+ * @brief Release the resources of the OTA control block and reset it.
+ *
+ * @param status new OTA status
+ */
+static void co_ota_reset(enum co_ota_status status) {
+    size_t durable_end;
+
+    if (global_cb->ota.staging_buf != NULL) {
+        co_free_psram(global_cb->ota.staging_buf); // sector_buf points into it
+    } else if (global_cb->ota.pipe != NULL && global_cb->ota.pipe == global_cb->flash_pipe) {
+        co_flash_pipe_park(global_cb->ota.pipe); // sector_buf is owned by the pipe
+    } else if (global_cb->ota.pipe != NULL) {
+        co_flash_pipe_destroy(global_cb->ota.pipe);
+    } else {
+        co_pool_put(&global_cb->sector_pool, global_cb->ota.sector_buf);
+    }
+    mbedtls_sha256_free(&global_cb->ota.sha256);
+
+    if (global_cb->ota.update_ptn != NULL && global_cb->ota.update_ptn == global_cb->idle_flash.ptn) {
+        // keep the sectors of a resumable session, the rest of the partition is erased again while idle
+        durable_end = (global_cb->ota.durable_offset + CO_FLASH_SECTOR_SIZE - 1) / CO_FLASH_SECTOR_SIZE * CO_FLASH_SECTOR_SIZE;
+        global_cb->idle_flash.erased = durable_end;
+        global_cb->idle_erase_start = durable_end;
+    }
+
+    memset(&global_cb->ota, 0, sizeof(global_cb->ota));
+    global_cb->ota.status = status;
+}
+
+/**
+ * @brief Check what esp_ota_begin checks before the update partition is written: with app rollback, the running
+ * app must have been confirmed. Until then, the update partition holds the image a rollback returns to.
+ *
+ */
+static esp_err_t co_ota_check_rollback(void) {
+#ifdef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+    esp_ota_img_states_t state;
+
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+        state == ESP_OTA_IMG_PENDING_VERIFY) {
+        return ESP_ERR_OTA_ROLLBACK_INVALID_STATE;
+    }
+#endif
+    return ESP_OK;
+}
+
+/**
+ * @brief OTA init
+ *
+ * @param size Total firmware size
+ * @param offset Partition offset the write starts at, sector aligned. Non-zero when a session is resumed
+ * @param stage Receive the whole image into external RAM if it fits there, see co_ota_write_staged
+ * @return const char* Error message, returns NULL indicating that no error occurred
+ */
+static const char *co_ota_init(int32_t size, size_t offset, bool stage) {
+    const esp_partition_t *boot_ptn, *running_ptn, *update_ptn;
+    esp_err_t ret;
+
+    boot_ptn = esp_ota_get_boot_partition();
+    running_ptn = esp_ota_get_running_partition();
+    if (boot_ptn != running_ptn) {
+        //// TODO:  boot image become corrupted
+    }
+
+    update_ptn = esp_ota_get_next_update_partition(NULL);
+    if (update_ptn == NULL) {
+        global_cb->ota.status = CO_OTA_FATAL_ERROR;
+        global_cb->ota.error_code = CO_ERROR_INVALID_OTA_PTN;
+        return "Invalid OTA data partition";
+    }
+
+    if (size > update_ptn->size) {
+        return co_ota_error_to_msg(ESP_ERR_INVALID_SIZE);
+    }
+
+    ret = co_ota_check_rollback();
+    if (ret != ESP_OK) {
+        ESP_LOGE(CO_TAG, "the running app is pending verification, the update partition can not be written");
+        return co_ota_error_to_msg(ret);
+    }
+
+    // release the previous session, if any
+    co_ota_reset(CO_OTA_INIT);
+
+    global_cb->ota.update_ptn = update_ptn;
+    global_cb->ota.running_ptn = running_ptn;
+
+    // There is no upfront erase: sectors are erased progressively, ahead of the write cursor.
+    global_cb->ota.flash.ptn = update_ptn;
+    global_cb->ota.flash.erase_limit = (size + CO_FLASH_SECTOR_SIZE - 1) / CO_FLASH_SECTOR_SIZE * CO_FLASH_SECTOR_SIZE;
+    global_cb->ota.flash.erased = offset;
+    global_cb->ota.flash.compare = global_cb->skip_unchanged;
+    if (global_cb->idle_flash.ptn == update_ptn) {
+        // take over the sectors erased while idle, the partition is going to be written
+        if (global_cb->idle_erase_start == offset) {
+            global_cb->ota.flash.erased = global_cb->idle_flash.erased;
+        }
+        global_cb->idle_flash.erased = 0;
+        global_cb->idle_erase_start = 0;
+    }
+    global_cb->ota.write_offset = offset;
+
+    global_cb->ota.resumable = global_cb->checkpoint_size > 0;
+    global_cb->ota.hashing = global_cb->ota.resumable;
+    mbedtls_sha256_init(&global_cb->ota.sha256);
+    mbedtls_sha256_starts_ret(&global_cb->ota.sha256, 0);
+
+    if (stage) {
+        global_cb->ota.staging_buf = co_malloc_psram(global_cb->ota.flash.erase_limit, CONFIG_CO_STAGING_RESERVE_SIZE);
+        if (global_cb->ota.staging_buf == NULL) {
+            ESP_LOGI(CO_TAG, "not enough external RAM to stage %d bytes, the image is written during the upload", size);
+        }
+    }
+
+    if (global_cb->ota.staging_buf != NULL) {
+        // no flash writer, nothing is written before the image is complete
+    } else if (global_cb->flash_pipe != NULL) {
+        co_flash_pipe_attach(global_cb->flash_pipe, &global_cb->ota.flash);
+        global_cb->ota.pipe = global_cb->flash_pipe;
+    } else if (global_cb->flash_queue_depth > 0) {
+        // the blocks are taken from the heap, only a few of them while it is short
+        global_cb->ota.pipe = co_flash_pipe_create(global_cb, &global_cb->ota.flash,
+                                                   global_cb->low_memory ? CO_LOW_MEMORY_PIPE_DEPTH : global_cb->flash_queue_depth);
+        if (global_cb->ota.pipe == NULL) {
+            ESP_LOGW(CO_TAG, "no memory for the flash writer, the flash is written in the corsacOTA thread");
+        }
+    }
+
+    if (global_cb->ota.staging_buf != NULL) {
+        // the session is on flash only at the end, there is nothing to checkpoint
+        global_cb->ota.sector_buf = global_cb->ota.staging_buf;
+        global_cb->ota.resumable = false;
+        global_cb->ota.hashing = false;
+    } else if (global_cb->ota.pipe != NULL) {
+        global_cb->ota.pipe->submitted = offset;
+        global_cb->ota.pipe->committed = offset;
+        global_cb->ota.block = co_flash_pipe_get_block(global_cb->ota.pipe);
+        global_cb->ota.sector_buf = global_cb->ota.block->buf;
+    } else {
+        global_cb->ota.sector_buf = co_pool_get(&global_cb->sector_pool, CO_FLASH_SECTOR_SIZE);
+        if (global_cb->ota.sector_buf == NULL) {
+            return co_ota_error_to_msg(ESP_ERR_NO_MEM);
+        }
+    }
+
+    return NULL;
+}
+
+// Get the flash state of the current session
+static inline co_flash_t *co_ota_flash(co_cb_t *cb) {
+    return cb->ota.pipe != NULL ? &cb->ota.pipe->flash : &cb->ota.flash;
+}
+
+// Get the hash of the data so far, the context keeps going.
+static void co_sha256_peek(const mbedtls_sha256_context *ctx, uint8_t hash[32]) {
+    mbedtls_sha256_context tmp;
+
+    mbedtls_sha256_init(&tmp);
+    mbedtls_sha256_clone(&tmp, ctx);
+    mbedtls_sha256_finish_ret(&tmp, hash);
+    mbedtls_sha256_free(&tmp);
+}
+
+// Snapshot the hash of [0, write_offset), it is saved by co_ota_poll once the data is on flash.
+static void co_ota_take_checkpoint() {
+    co_ota_cb_t *ota = &global_cb->ota;
+
+    co_sha256_peek(&ota->sha256, ota->checkpoint.sha256);
+
+    ota->checkpoint.magic = CO_SESSION_MAGIC;
+    ota->checkpoint.ptn_address = ota->update_ptn->address;
+    ota->checkpoint.total_size = ota->total_size;
+    ota->checkpoint.offset = ota->write_offset;
+    ota->checkpoint_pending = true;
+}
+
+// Get the offset that has been written to flash
+static inline int32_t co_ota_committed(co_cb_t *cb) {
+    if (cb->ota.pipe != NULL) {
+        return __atomic_load_n(&cb->ota.pipe->committed, __ATOMIC_ACQUIRE);
+    }
+    return cb->ota.write_offset;
+}
+
+/**
+ * @brief Write the staged data to flash, or hand it to the flash writer.
+ *
+ * For encrypted partitions, only 16-byte aligned data is written, the rest stays staged.
+ */
+static const char *co_ota_flush() {
+    co_ota_cb_t *ota = &global_cb->ota;
+    uint8_t *prev_buf;
+    size_t len, remain_len;
+    esp_err_t ret;
+
+    len = ota->sector_len;
+    if (ota->update_ptn->encrypted) {
+        len &= ~(size_t)(CO_FLASH_ENCRYPTED_ALIGN - 1);
+    }
+    if (len == 0) {
+        return NULL;
+    }
+    remain_len = ota->sector_len - len;
+
+    // like esp_ota_write, refuse a file that is not an app image at its first sector, not after the upload
+    if (ota->write_offset == 0 && ota->sector_buf[0] != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(CO_TAG, "invalid image magic 0x%02x", ota->sector_buf[0]);
+        return co_ota_error_to_msg(ESP_ERR_OTA_VALIDATE_FAILED);
+    }
+
+    if (ota->staging_buf != NULL) {
+        // the data stays in RAM until co_ota_write_staged, the rest is already at the start of the next sector
+        ota->sector_buf += len;
+        ret = ESP_OK;
+    } else if (ota->pipe != NULL) {
+        ret = __atomic_load_n(&ota->pipe->err, __ATOMIC_ACQUIRE);
+        if (ret != ESP_OK) {
+            return co_ota_error_to_msg(ret);
+        }
+
+        ota->block->len = len;
+        ota->block->offset = ota->write_offset;
+        ota->pipe->submitted += len;
+        co_spsc_push(&ota->pipe->full_queue, ota->block); // never full: there are only `depth` blocks
+        xTaskNotifyGive(ota->pipe->writer);
+
+        prev_buf = ota->sector_buf;
+        ota->block = co_flash_pipe_get_block(ota->pipe);
+        ota->sector_buf = ota->block->buf;
+        // the block being written is not touched by the writer beyond `len`
+        memcpy(ota->sector_buf, prev_buf + len, remain_len);
+        ret = ESP_OK;
+    } else {
+        ret = co_flash_program(&ota->flash, ota->write_offset, ota->sector_buf, len);
+        memmove(ota->sector_buf, ota->sector_buf + len, remain_len);
+    }
+
+    ota->write_offset += len;
+    ota->sector_len = remain_len;
+
+    // The hash covers the staged data as well, so a checkpoint is only taken when nothing is staged.
+    if (ota->resumable && ret == ESP_OK && !ota->checkpoint_pending && remain_len == 0 &&
+        (int32_t)ota->write_offset - ota->durable_offset >= global_cb->checkpoint_size) {
+        co_ota_take_checkpoint();
+    }
+
+    return co_ota_error_to_msg(ret);
+}
+
+// The n bytes after the staged data have been filled in: stage them, the sector is written once it is full.
+static const char *co_ota_stage(size_t n) {
+    co_ota_cb_t *ota = &global_cb->ota;
+
+    if (ota->hashing) {
+        mbedtls_sha256_update_ret(&ota->sha256, ota->sector_buf + ota->sector_len, n);
+    }
+
+    ota->sector_len += n;
+    if (ota->sector_len == CO_FLASH_SECTOR_SIZE) {
+        return co_ota_flush();
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Stage OTA data into whole flash sectors. The payload is unmasked while it is copied.
+ *
+ * @param data payload ptr
+ * @param len payload length
+ * @param mask websocket mask of the payload, 0 for unmasked data
+ * @return const char* Error message, returns NULL indicating that no error occurred
+ */
+static const char *co_ota_write(const uint8_t *data, size_t len, uint32_t mask) {
+    co_ota_cb_t *ota = &global_cb->ota;
+    const char *err_msg;
+    size_t n;
+
+    while (len > 0) {
+        n = min(len, CO_FLASH_SECTOR_SIZE - ota->sector_len);
+        co_websocket_mask_copy(ota->sector_buf + ota->sector_len, data, mask, n);
+        mask = co_websocket_get_new_mask(mask, n);
+        data += n;
+        len -= n;
+
+        err_msg = co_ota_stage(n);
+        if (err_msg != NULL) {
+            return err_msg;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Stage len bytes of the running firmware at the patch read position, adding delta to them.
+ * The running partition is read straight into the staging buffer.
+ *
+ * @param delta bytes added to the running firmware, NULL to copy it unchanged
+ */
+static const char *co_patch_stage_old(const uint8_t *delta, size_t len) {
+    co_ota_cb_t *ota = &global_cb->ota;
+    const char *err_msg;
+    uint8_t *dst;
+    esp_err_t ret;
+    size_t i, n;
+
+    while (len > 0) {
+        n = min(len, CO_FLASH_SECTOR_SIZE - ota->sector_len);
+        dst = ota->sector_buf + ota->sector_len;
+        ret = esp_partition_read(ota->running_ptn, ota->patch.old_pos, dst, n);
+        if (ret != ESP_OK) {
+            return co_ota_error_to_msg(ret);
+        }
+
+        if (delta != NULL) {
+            for (i = 0; i < n; i++) {
+                dst[i] += delta[i];
+            }
+            delta += n;
+        }
+
+        ota->patch.old_pos += n;
+        len -= n;
+
+        err_msg = co_ota_stage(n);
+        if (err_msg != NULL) {
+            return err_msg;
+        }
+    }
+
+    return NULL;
+}
+
+// Check the record argument and run it, the record data (if any) follows.
+static const char *co_patch_exec() {
+    co_patch_t *patch = &global_cb->ota.patch;
+    uint32_t arg = patch->arg;
+    int64_t pos;
+
+    patch->state = CO_PATCH_OP;
+
+    if (patch->op == CO_PATCH_OP_SEEK) {
+        pos = (int64_t)patch->old_pos + (int32_t)((arg >> 1) ^ -(arg & 1)); // zigzag
+        if (pos < 0 || pos > global_cb->ota.running_ptn->size) {
+            return "Invalid patch";
+        }
+        patch->old_pos = pos;
+        return NULL;
+    }
+
+    if (arg > patch->new_size - patch->out_len) {
+        return "Invalid patch";
+    }
+    if (patch->op != CO_PATCH_OP_INSERT && arg > global_cb->ota.running_ptn->size - patch->old_pos) {
+        return "Invalid patch";
+    }
+    patch->out_len += arg;
+
+    if (patch->op == CO_PATCH_OP_COPY) {
+        return co_patch_stage_old(NULL, arg);
+    }
+
+    patch->remain = arg;
+    if (arg > 0) {
+        patch->state = CO_PATCH_DATA;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Apply a delta patch: the new firmware is built from the running firmware and the patch.
+ *
+ * The patch is the magic "COD1" followed by records, each one is an op byte and a varint (LEB128) argument:
+ *  - COPY n   : copy n bytes of the running firmware
+ *  - ADD n    : n bytes follow, each one is added to the next byte of the running firmware (bsdiff style)
+ *  - INSERT n : n bytes follow, they are copied to the new firmware
+ *  - SEEK d   : move the read position of the running firmware by d (zigzag encoded)
+ *
+ * Only the decoder state is kept in RAM, the records may be split across any number of chunks.
+ *
+ * @param data unmasked patch data
+ * @param len length of data
+ * @return const char* Error message, returns NULL indicating that no error occurred
+ */
+static const char *co_patch_write(const uint8_t *data, size_t len) {
+    co_patch_t *patch = &global_cb->ota.patch;
+    const char *err_msg = NULL;
+    size_t n;
+
+    while (len > 0 && err_msg == NULL) {
+        switch (patch->state) {
+        case CO_PATCH_HEADER:
+            if (*data != CO_PATCH_MAGIC[patch->header_len]) {
+                return "Invalid patch";
+            }
+            if (++patch->header_len == CO_PATCH_MAGIC_LEN) {
+                patch->state = CO_PATCH_OP;
+            }
+            data++;
+            len--;
+            break;
+        case CO_PATCH_OP:
+            patch->op = *data;
+            if (patch->op < CO_PATCH_OP_COPY || patch->op > CO_PATCH_OP_SEEK) {
+                return "Invalid patch";
+            }
+            patch->arg = 0;
+            patch->arg_shift = 0;
+            patch->state = CO_PATCH_ARG;
+            data++;
+            len--;
+            break;
+        case CO_PATCH_ARG:
+            if (patch->arg_shift > 28) {
+                return "Invalid patch";
+            }
+            patch->arg |= (uint32_t)(*data & 0x7F) << patch->arg_shift;
+            patch->arg_shift += 7;
+            if ((*data & 0x80) == 0) {
+                err_msg = co_patch_exec();
+            }
+            data++;
+            len--;
+            break;
+        case CO_PATCH_DATA:
+            n = min(len, patch->remain);
+            if (patch->op == CO_PATCH_OP_ADD) {
+                err_msg = co_patch_stage_old(data, n);
+            } else {
+                err_msg = co_ota_write(data, n, 0);
+            }
+            patch->remain -= n;
+            if (patch->remain == 0) {
+                patch->state = CO_PATCH_OP;
+            }
+            data += n;
+            len -= n;
+            break;
+        }
+    }
+
+    return err_msg;
+}
+
+static const char *co_ota_end() {
+    co_ota_cb_t *ota = &global_cb->ota;
+    uint8_t hash[32];
+    const char *err_msg;
+    co_flash_t *flash;
+    size_t pad_len;
+    esp_err_t ret;
+
+    if (ota->patch_mode && (ota->patch.state != CO_PATCH_OP || ota->patch.out_len != ota->patch.new_size)) {
+        return "Invalid patch";
+    }
+
+    // everything has been received, there is nothing left to resume
+    if (ota->resumable) {
+        co_session_erase();
+        ota->durable_offset = 0;
+    }
+
+    // the hash is complete with the last chunk, a corrupted upload is rejected without reading the firmware back
+    if (ota->verify) {
+        if (ota->staging_buf != NULL) {
+            // a staged image is hashed at once, not while it is received
+            mbedtls_sha256_update_ret(&ota->sha256, ota->staging_buf, ota->write_offset + ota->sector_len);
+        }
+        mbedtls_sha256_finish_ret(&ota->sha256, hash);
+        ota->hashing = false;
+        if (memcmp(hash, ota->expected_sha256, sizeof(hash)) != 0) {
+            return "Firmware hash mismatch";
+        }
+    }
+
+    // pad the last encrypted block with erased bytes
+    if (ota->update_ptn->encrypted) {
+        pad_len = (-ota->sector_len) & (CO_FLASH_ENCRYPTED_ALIGN - 1);
+        memset(ota->sector_buf + ota->sector_len, 0xFF, pad_len);
+        ota->sector_len += pad_len;
+    }
+
+    err_msg = co_ota_flush();
+    if (err_msg != NULL) {
+        return err_msg;
+    }
+
+    // a staged image is written once the client has its reply, see co_ota_write_staged
+    if (ota->staging_buf != NULL) {
+        return NULL;
+    }
+
+    if (ota->pipe != NULL) {
+        ret = co_flash_pipe_drain(ota->pipe);
+        if (ret != ESP_OK) {
+            return co_ota_error_to_msg(ret);
+        }
+    }
+
+    flash = co_ota_flash(global_cb);
+    ESP_LOGI(CO_TAG, "image written with %d flash program calls, %d sector erases, %d unchanged sectors skipped",
+             flash->write_num, flash->erase_num, flash->skip_num);
+
+    // esp_ota_set_boot_partition still reads the whole image back to verify it before it switches the boot
+    // partition, there is no public API without that pass.
+    ret = esp_ota_set_boot_partition(ota->update_ptn);
+    return co_ota_error_to_msg(ret);
+}
+
+/**
+ * @brief Write the image staged in external RAM to the update partition, a flash block at a time, then select it
+ * for boot. The image has already been verified by co_ota_end.
+ *
+ * @return const char* Error message, returns NULL indicating that no error occurred
+ */
+static const char *co_ota_write_staged() {
+    co_ota_cb_t *ota = &global_cb->ota;
+    co_flash_t *flash = &ota->flash;
+    int64_t start = esp_timer_get_time();
+    size_t offset, len, burst;
+    esp_err_t ret = ESP_OK;
+
+    // a sector compared with the partition is only skipped on its own
+    burst = flash->compare ? CO_FLASH_SECTOR_SIZE : CONFIG_CO_STAGING_BURST_SIZE;
+    for (offset = 0; offset < ota->write_offset && ret == ESP_OK; offset += len) {
+        len = min(ota->write_offset - offset, burst - offset % burst);
+        while (!flash->compare && flash->erased < offset + len && ret == ESP_OK) {
+            ret = co_flash_erase_block(flash);
+        }
+        if (ret == ESP_OK) {
+            ret = co_flash_program(flash, offset, ota->staging_buf + offset, len);
+        }
+        vTaskDelay(1); // the corsacOTA thread is busy for seconds, let the idle task run
+    }
+    if (ret != ESP_OK) {
+        return co_ota_error_to_msg(ret);
+    }
+
+    ESP_LOGI(CO_TAG, "staged image written in %lld ms with %d flash program calls, %d sector erases, %d unchanged sectors skipped",
+             (long long)((esp_timer_get_time() - start) / 1000), flash->write_num, flash->erase_num, flash->skip_num);
+
+    ret = esp_ota_set_boot_partition(ota->update_ptn);
+    return co_ota_error_to_msg(ret);
+}
+
+/**
+ * @brief Get the window that can be granted to the client. The free buffer (staging buffer, free flash blocks
+ * and socket buffer) can be filled at once, and the data of a round trip is needed to keep the link busy.
+ *
+ */
+static int32_t co_ota_get_window(co_cb_t *cb) {
+    co_ota_cb_t *ota = &cb->ota;
+    int64_t window;
+
+    if (cb->low_memory) {
+        // the data in flight waits in the pbufs of lwIP, only grant what the next recv() can drain
+        window = CO_FLASH_SECTOR_SIZE - ota->sector_len + cb->recv_size;
+    } else if (ota->staging_buf != NULL) {
+        window = ota->total_size - ota->offset; // there is room for the whole image
+    } else {
+        window = CO_FLASH_SECTOR_SIZE - ota->sector_len + cb->recv_size;
+        if (ota->pipe != NULL) {
+            window += (int64_t)co_spsc_count(&ota->pipe->free_queue) * CO_FLASH_SECTOR_SIZE;
+        }
+        window += (int64_t)ota->rate * ota->rtt / 1000000;
+    }
+
+    window = min(window, cb->window_max_size);
+    window = min(window, ota->total_size - ota->offset);
+    return (int32_t)window;
+}
+
+/**
+ * @brief Grant a new window to the client: "state=ready&offset=<received>&window=<bytes>"
+ *
+ */
+static void co_ota_send_window(co_cb_t *cb) {
+    co_ota_cb_t *ota = &cb->ota;
+    co_ack_t ack;
+    int64_t now = esp_timer_get_time();
+    uint32_t rate;
+
+    if (ota->window_time > 0 && now > ota->window_time) {
+        rate = (uint64_t)(ota->offset - ota->window_offset) * 1000000 / (now - ota->window_time);
+        ota->rate = ota->rate == 0 ? rate : (ota->rate / 8) * 7 + rate / 8;
+    }
+
+    ota->window = co_ota_get_window(cb);
+    ota->window_offset = ota->offset;
+    ota->window_time = now;
+
+    co_ack_begin(&ack, CO_ACK_READY);
+    co_ack_int(&ack, ota->offset);
+    co_ack_str(&ack, "&window=");
+    co_ack_int(&ack, ota->window);
+    // without the grant the client stops, a new one is sent once lwIP has memory again
+    ota->window_pending = co_ack_send(&ack) == CO_ERROR_NO_MEM;
+}
+
+// Send a ping carrying the current time, the pong tells the round trip time.
+static void co_ota_send_ping(co_cb_t *cb) {
+    int64_t now = esp_timer_get_time();
+
+    cb->ota.ping_time = now;
+    co_websocket_send_frame(&now, 8, WS_OPCODE_PING);
+}
+
+static inline int co_hex_to_int(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static co_err_t co_hex_decode(uint8_t *dst, size_t dst_len, const char *src, size_t src_len) {
+    size_t i;
+    int hi, lo;
+
+    if (src_len != dst_len * 2) {
+        return CO_FAIL;
+    }
+
+    for (i = 0; i < dst_len; i++) {
+        hi = co_hex_to_int(src[2 * i]);
+        lo = co_hex_to_int(src[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return CO_FAIL;
+        }
+        dst[i] = (hi << 4) | lo;
+    }
+
+    return CO_OK;
+}
+
+/**
+ * @brief Get the expected firmware hash of the start/resume request:
+ * "op=start&data=12345&sha256=<hex>&sig=<base64>"
+ *
+ * The signature is made over the SHA-256 of the firmware. It is required when a public key is configured,
+ * so a firmware that is not signed is rejected before it is uploaded.
+ *
+ * @return const char* Error message, returns NULL indicating that no error occurred
+ */
+static const char *co_ota_set_expected_hash(co_request_t *req) {
+    co_ota_cb_t *ota = &global_cb->ota;
+    uint8_t sig[CO_SIGNATURE_MAX_SIZE];
+    const char *hex, *sig_b64;
+    size_t hex_len, sig_b64_len, sig_len;
+
+    hex = co_request_get_arg(req, "sha256", &hex_len);
+    if (hex == NULL) {
+        return global_cb->sign_key != NULL ? "Signature required" : NULL;
+    }
+
+    if (co_hex_decode(ota->expected_sha256, sizeof(ota->expected_sha256), hex, hex_len) != CO_OK) {
+        return "Invalid sha256";
+    }
+
+    if (global_cb->sign_key != NULL) {
+        sig_b64 = co_request_get_arg(req, "sig", &sig_b64_len);
+        if (sig_b64 == NULL) {
+            return "Signature required";
+        }
+        if (mbedtls_base64_decode(sig, sizeof(sig), &sig_len, (const unsigned char *)sig_b64, sig_b64_len) != 0 ||
+            mbedtls_pk_verify(global_cb->sign_key, MBEDTLS_MD_SHA256, ota->expected_sha256, sizeof(ota->expected_sha256), sig, sig_len) != 0) {
+            return "Invalid signature";
+        }
+    }
+
+    ota->verify = true;
+    ota->hashing = ota->staging_buf == NULL; // a staged image is hashed by co_ota_end
+    return NULL;
+}
+
+/**
+ * @brief Reply to the start/resume request
+ *
+ * "op=start&data=12345&window=1": the client keeps a window of data in flight, see co_ota_send_window
+ */
+static void co_ota_send_ready(co_request_t *req, const char *res_msg) {
+    char res[192];
+    const char *arg;
+    size_t arg_len;
+
+    arg = co_request_get_arg(req, "window", &arg_len);
+    if (arg != NULL && arg_len == 1 && arg[0] == '1') {
+        global_cb->ota.window_mode = true;
+        global_cb->ota.window = co_ota_get_window(global_cb);
+        global_cb->ota.window_offset = global_cb->ota.offset;
+
+        snprintf(res, sizeof(res), "%s&window=%d", res_msg, global_cb->ota.window);
+        co_websocket_send_msg_with_code(CO_RES_SUCCESS, res);
+
+        global_cb->ota.window_time = esp_timer_get_time();
+        co_ota_send_ping(global_cb);
+        return;
+    }
+
+    co_websocket_send_msg_with_code(CO_RES_SUCCESS, res_msg);
+}
+
+// Save the checkpoint taken by co_ota_take_checkpoint
+static void co_ota_save_checkpoint(co_cb_t *cb) {
+    esp_err_t ret;
+
+    cb->ota.checkpoint_pending = false;
+    ret = co_session_save(&cb->ota.checkpoint);
+    if (ret == ESP_OK) {
+        cb->ota.durable_offset = cb->ota.checkpoint.offset;
+    } else {
+        ESP_LOGW(CO_TAG, "can not save the checkpoint (%d)", ret);
+    }
+}
+
+/**
+ * @brief Verify the firmware written by a saved session, then continue the session from its checkpoint.
+ *
+ * The partition is read back to rebuild the hash. The partial sector at the end of the session is staged again,
+ * because it is erased before it is written.
+ *
+ * @return const char* Error message, returns NULL indicating that no error occurred
+ */
+static const char *co_ota_resume_init(const co_ota_session_t *session) {
+    const esp_partition_t *update_ptn = esp_ota_get_next_update_partition(NULL);
+    mbedtls_sha256_context ctx;
+    uint8_t hash[32], *buf;
+    size_t start, offset, len;
+    const char *err_msg = NULL;
+    esp_err_t ret;
+
+    if (update_ptn == NULL || update_ptn->address != session->ptn_address || session->offset > session->total_size) {
+        return "Invalid session";
+    }
+
+    buf = co_pool_get(&global_cb->sector_pool, CO_FLASH_SECTOR_SIZE);
+    if (buf == NULL) {
+        return co_ota_error_to_msg(ESP_ERR_NO_MEM);
+    }
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts_ret(&ctx, 0);
+    for (offset = 0; offset < session->offset; offset += len) {
+        len = min(session->offset - offset, CO_FLASH_SECTOR_SIZE);
+        ret = esp_partition_read(update_ptn, offset, buf, len);
+        if (ret != ESP_OK) {
+            err_msg = co_ota_error_to_msg(ret);
+            goto cleanup;
+        }
+        mbedtls_sha256_update_ret(&ctx, buf, len);
+
+        if ((offset + len) % CONFIG_CO_RESUME_YIELD_SIZE == 0) {
+            vTaskDelay(1);
+        }
+    }
+
+    co_sha256_peek(&ctx, hash);
+    if (memcmp(hash, session->sha256, sizeof(hash)) != 0) {
+        err_msg = "Session verification failed";
+        goto cleanup;
+    }
+
+    start = session->offset / CO_FLASH_SECTOR_SIZE * CO_FLASH_SECTOR_SIZE;
+    err_msg = co_ota_init(session->total_size, start, false);
+    if (err_msg != NULL) {
+        goto cleanup;
+    }
+
+    mbedtls_sha256_clone(&global_cb->ota.sha256, &ctx);
+    // the last read is the partial sector, if any
+    global_cb->ota.sector_len = session->offset - start;
+    memcpy(global_cb->ota.sector_buf, buf, global_cb->ota.sector_len);
+
+    global_cb->ota.checkpoint = *session;
+    global_cb->ota.durable_offset = session->offset;
+
+cleanup:
+    mbedtls_sha256_free(&ctx);
+    co_pool_put(&global_cb->sector_pool, buf);
+    return err_msg;
+}
+
+/**
+ * @brief Process OTA resume request: continue the session saved in NVS
+ *
+ * The reply carries the offset to continue from and the SHA-256 of the firmware before it,
+ * the client should check it against its own firmware and start over if it does not match.
+ *
+ * @param req The data field indicates the size of the firmware
+ */
+static void co_ota_resume(co_request_t *req) {
+    char res[160]; // deviceType=esp32s3&state=ready&offset=2147483647&sha256=<64>
+    co_ota_session_t session;
+    const char *err_msg;
+    int size, len, i;
+
+    if (global_cb->checkpoint_size == 0) {
+        co_websocket_send_msg_with_code(CO_RES_INVALID_STATUS, "Resume is disabled");
+        return;
+    }
+
+    size = atoi(req->data);
+    if (size < 1) {
+        co_websocket_send_msg_with_code(CO_RES_INVALID_SIZE, "Invalid size");
+        return;
+    }
+
+    co_alloc_session_start();
+
+    // The connection was lost without a reboot. The session continues from its checkpoint as well
+    if (global_cb->ota.status == CO_OTA_LOAD) {
+        co_ota_flush();
+        if (global_cb->ota.pipe != NULL) {
+            co_flash_pipe_drain(global_cb->ota.pipe);
+        }
+        if (global_cb->ota.checkpoint_pending) {
+            co_ota_save_checkpoint(global_cb);
+        }
+        co_ota_reset(CO_OTA_STOP);
+    }
+
+    if (co_session_load(&session) != ESP_OK || session.total_size != size) {
+        co_websocket_send_msg_with_code(CO_RES_INVALID_STATUS, "No session to resume");
+        return;
+    }
+
+    err_msg = co_ota_resume_init(&session);
+    if (err_msg != NULL) {
+        co_session_erase();
+        co_ota_reset(CO_OTA_STOP);
+        co_websocket_send_msg_with_code(CO_RES_SYSTEM_ERROR, err_msg);
+        return;
+    }
+
+    global_cb->ota.status = CO_OTA_LOAD;
+    global_cb->ota.total_size = size;
+    global_cb->ota.chunk_size = min(size / 10, global_cb->ack_chunk_size);
+    if (global_cb->ota.chunk_size == 0) {
+        global_cb->ota.chunk_size = 1;
+    }
+    global_cb->ota.offset = session.offset;
+    global_cb->ota.last_index_offset = session.offset;
+
+    len = snprintf(res, sizeof(res), "deviceType=" CO_DEVICE_TYPE_NAME "&state=ready&offset=%d&sha256=", session.offset);
+    for (i = 0; i < sizeof(session.sha256); i++) {
+        len += snprintf(res + len, sizeof(res) - len, "%02x", session.sha256[i]);
+    }
+
+    err_msg = co_ota_set_expected_hash(req);
+    if (err_msg != NULL) {
+        co_ota_reset(CO_OTA_STOP);
+        co_websocket_send_msg_with_code(CO_RES_INVALID_ARG, err_msg);
+        return;
+    }
+
+    ESP_LOGI(CO_TAG, "resume the session at %d/%d", session.offset, size);
+    co_ota_send_ready(req, res);
+}
+
+/**
+ * @brief Process OTA start request
+ *
+ * @param req The data field indicates the size of the firmware
+ */
+static void co_ota_start(co_request_t *req) { // TODO: return value -> status
+    const char *res_msg = "deviceType=" CO_DEVICE_TYPE_NAME "&state=ready&offset=0";
+    const char *err_msg, *arg;
+    size_t arg_len;
+    int size, image_size;
+
+    // may be we should ignore status...
+    // if (global_cb->ota.status != CO_OTA_INIT && global_cb->ota.status != CO_OTA_STOP) {
+    //     co_websocket_send_msg_with_code(CO_RES_INVALID_STATUS, "OTA has not started");
+    //     return;
+    // }
+
+    size = atoi(req->data);
+    if (size < 1) {
+        co_websocket_send_msg_with_code(CO_RES_INVALID_SIZE, "Invalid size");
+        return;
+    }
+
+    // "op=start&data=<patch size>&patch=<firmware size>": the data is a delta patch, see co_patch_write
+    image_size = size;
+    arg = co_request_get_arg(req, "patch", &arg_len);
+    if (arg != NULL) {
+        image_size = atoi(arg);
+        if (image_size < 1) {
+            co_websocket_send_msg_with_code(CO_RES_INVALID_SIZE, "Invalid size");
+            return;
+        }
+    }
+
+    co_alloc_session_start();
+    err_msg = co_ota_init(image_size, 0, global_cb->staging);
+    if (err_msg != NULL) {
+        co_websocket_send_msg_with_code(CO_RES_SYSTEM_ERROR, err_msg);
         return;
     }
 
-    err_msg = co_ota_init(size);
+    if (arg != NULL) {
+        // the offset of a checkpoint is not a position in the patch, a patch is not resumable
+        global_cb->ota.patch_mode = true;
+        global_cb->ota.patch.new_size = image_size;
+        global_cb->ota.resumable = false;
+        global_cb->ota.hashing = false;
+    }
+
+    // a new firmware, the previous session can not be resumed
+    if (global_cb->checkpoint_size > 0) {
+        co_session_erase();
+    }
+
+    err_msg = co_ota_set_expected_hash(req);
     if (err_msg != NULL) {
-        co_websocket_send_msg_with_code(CO_RES_SYSTEM_ERROR, err_msg);
+        co_ota_reset(CO_OTA_STOP);
+        co_websocket_send_msg_with_code(CO_RES_INVALID_ARG, err_msg);
         return;
     }
 
     global_cb->ota.status = CO_OTA_LOAD;
     global_cb->ota.total_size = size;
 
-    size = min(global_cb->ota.total_size / 10, 1024 * 10); // 10KB default
+    size = min(global_cb->ota.total_size / 10, global_cb->ack_chunk_size);
     if (size == 0) {
         size = 1; // Firmware too small...
     }
@@ -759,22 +3164,32 @@ static void co_ota_start(void *data) { // TODO: return value -> status
     global_cb->ota.offset = 0;
     global_cb->ota.last_index_offset = 0;
 
-    co_websocket_send_msg_with_code(CO_RES_SUCCESS, res_msg);
+    co_ota_send_ready(req, res_msg);
 }
 
-static void co_ota_stop(void *data) {
+static void co_ota_stop(co_request_t *req) {
     if (global_cb->ota.status != CO_OTA_FATAL_ERROR) {
-        memset(&global_cb->ota, 0, sizeof(global_cb->ota));
-        global_cb->ota.status = CO_OTA_STOP;
+        if (global_cb->ota.status == CO_OTA_LOAD) {
+            co_ota_flush(); // keep the flash consistent with the received data
+            if (global_cb->ota.pipe != NULL) {
+                co_flash_pipe_drain(global_cb->ota.pipe);
+            }
+        }
+        // the upload is cancelled by the client
+        if (global_cb->ota.resumable) {
+            co_session_erase();
+            global_cb->ota.durable_offset = 0;
+        }
+        co_ota_reset(CO_OTA_STOP);
         co_websocket_send_msg_with_code(CO_RES_SUCCESS, "");
     } else {
         co_websocket_send_msg_with_code(CO_RES_SYSTEM_ERROR, "Fatal error");
     }
 }
 
-static void co_websocket_process_binary(uint8_t *data, size_t len) {
-    char res[32]; // state=ready&offset=2147483647
+static void co_websocket_process_binary(uint8_t *data, size_t len, uint32_t mask) {
     const char *err_msg;
+    co_ack_t ack;
     bool is_done;
 
     if (global_cb->ota.status == CO_OTA_LOAD) {
@@ -785,14 +3200,27 @@ static void co_websocket_process_binary(uint8_t *data, size_t len) {
             global_cb->ota.status = CO_OTA_INIT;
         }
 
-        err_msg = co_ota_write(data, len);
+        if (global_cb->ota.patch_mode) {
+            co_websocket_fast_mask(data, mask, len); // the patch is decoded in place
+            err_msg = co_patch_write(data, len);
+        } else {
+            err_msg = co_ota_write(data, len, mask);
+        }
         if (err_msg != NULL) {
-            memset(&global_cb->ota, 0, sizeof(global_cb->ota));
-            global_cb->ota.status = CO_OTA_STOP;
+            co_ota_reset(CO_OTA_STOP);
             co_websocket_send_msg_with_code(CO_RES_SYSTEM_ERROR, err_msg);
             return;
         }
 
+        // Window mode: grant a new window once half of the last one has been used.
+        // The offset of a window grant is the number of bytes received, not committed.
+        if (global_cb->ota.window_mode && !is_done) {
+            if (global_cb->ota.offset - global_cb->ota.window_offset >= global_cb->ota.window / 2) {
+                co_ota_send_window(global_cb);
+            }
+            return;
+        }
+
         // response
         if (!is_done && global_cb->ota.offset - global_cb->ota.last_index_offset < global_cb->ota.chunk_size) {
             return;
@@ -800,168 +3228,343 @@ static void co_websocket_process_binary(uint8_t *data, size_t len) {
 
         global_cb->ota.last_index_offset = global_cb->ota.offset;
 
-        snprintf(res, 32, "state=%s&offset=%d", is_done ? "done" : "ready", global_cb->ota.offset);
+        // With the flash writer, the offset is acknowledged once the whole sectors before it have been committed,
+        // see co_ota_poll. A partial sector stays in the sector buffer, so the blocks stay aligned to the sectors.
+        // The ack still carries the bytes received, the client sends the next chunk from it (see README).
+        if (!is_done && global_cb->ota.pipe != NULL) {
+            global_cb->ota.pending_ack = global_cb->ota.offset;
+            global_cb->ota.ack_commit = global_cb->ota.write_offset;
+            return;
+        }
 
         if (is_done) {
             err_msg = co_ota_end();
             if (err_msg != NULL) {
+                co_ota_reset(CO_OTA_STOP);
                 co_websocket_send_msg_with_code(CO_RES_SYSTEM_ERROR, err_msg);
                 return;
             }
 
-            co_websocket_send_msg_with_code(CO_RES_SUCCESS, res);
+            // A staged image is complete and verified, the client is done with it before it is written
+            co_ack_begin(&ack, CO_ACK_DONE);
+            co_ack_int(&ack, global_cb->ota.offset);
+            if (global_cb->ota.staging_buf != NULL) {
+                co_ack_str(&ack, "&staged=1");
+            } else if (global_cb->skip_unchanged) {
+                co_ack_str(&ack, "&skipped=");
+                co_ack_int(&ack, co_ota_flash(global_cb)->skip_num);
+            }
+            co_ack_send(&ack);
+
+            if (global_cb->ota.staging_buf != NULL) {
+                err_msg = co_ota_write_staged();
+                if (err_msg != NULL) {
+                    ESP_LOGE(CO_TAG, "the staged image can not be written: %s", err_msg);
+                    co_ota_reset(CO_OTA_STOP);
+                    co_websocket_send_msg_with_code(CO_RES_SYSTEM_ERROR, err_msg);
+                    return;
+                }
+            }
 
+            ESP_LOGI(CO_TAG, "%u heap allocations and releases during the session",
+                     co_alloc.stats.alloc_num + co_alloc.stats.free_num - co_alloc.session_mark);
             ESP_LOGD(CO_TAG, "prepare to restart");
-            vTaskDelay(pdMS_TO_TICKS(5000));
+            vTaskDelay(pdMS_TO_TICKS(CONFIG_CO_RESTART_DELAY_MS));
             co_hardware_restart();
         }
 
-        co_websocket_send_msg_with_code(CO_RES_SUCCESS, res);
+        co_ack_begin(&ack, CO_ACK_READY);
+        co_ack_int(&ack, global_cb->ota.offset);
+        if (co_ack_send(&ack) == CO_ERROR_NO_MEM) {
+            // the client waits for it, co_ota_poll sends it once lwIP has memory again
+            global_cb->ota.pending_ack = global_cb->ota.offset;
+            global_cb->ota.ack_commit = 0;
+        }
     } else if (global_cb->ota.status != CO_OTA_STOP) {
         // skip the rest of the frame when a stop command is received
         co_websocket_send_msg_with_code(CO_RES_INVALID_STATUS, "OTA has not started");
     }
 }
 
-static void co_websocket_process_text(uint8_t *data, size_t len) {
-    char op_field[10 + 1], data_field[10 + 1];
-    char *text;
-    co_process_fn_t fn;
+/**
+ * @brief Check the progress of the flash: send the pending acknowledgement and the erase progress, report errors.
+ *
+ */
+static void co_ota_poll(co_cb_t *cb) {
+    co_flash_pipe_t *pipe = cb->ota.pipe;
+    co_flash_t *flash;
+    size_t erased;
+    esp_err_t ret;
+    co_ack_t ack;
 
-    // Note that the text may not have a terminator
-    // TODO: add terminator
-    text = strndup((char *)data, len);
-    if (text == NULL) {
-        // TODO: memory leak
-        goto clean;
+    if (cb->ota.status != CO_OTA_LOAD || cb->websocket == NULL) {
+        return;
     }
 
-    if (co_parse_request_text(text, op_field, data_field) != CO_OK) {
-        co_websocket_send_msg_with_code(CO_RES_INVALID_ARG, "parse error");
-        goto clean;
+    if (cb->ota.window_mode && esp_timer_get_time() - cb->ota.ping_time >= CONFIG_CO_WINDOW_PING_INTERVAL_MS * 1000) {
+        co_ota_send_ping(cb);
     }
 
-    if ((fn = co_get_process_entry(op_field)) == NULL) {
-        co_websocket_send_msg_with_code(CO_RES_INVALID_ARG, "invalid op");
-        goto clean;
+    if (pipe != NULL) {
+        ret = __atomic_load_n(&pipe->err, __ATOMIC_ACQUIRE);
+        if (ret != ESP_OK) {
+            co_flash_pipe_drain(pipe);
+            co_ota_reset(CO_OTA_STOP);
+            co_websocket_send_msg_with_code(CO_RES_SYSTEM_ERROR, co_ota_error_to_msg(ret));
+            return;
+        }
     }
 
-    // start process!
-    fn(data_field);
+    // the acknowledgement waits for the flash writer, or for the memory of lwIP
+    if (cb->ota.pending_ack > 0 && co_ota_committed(cb) >= cb->ota.ack_commit) {
+        co_ack_begin(&ack, CO_ACK_READY);
+        co_ack_int(&ack, cb->ota.pending_ack);
+        if (co_ack_send(&ack) != CO_ERROR_NO_MEM) {
+            cb->ota.pending_ack = 0;
+        }
+    }
 
-clean:
-    free(text);
+    if (cb->ota.window_pending) {
+        co_ota_send_window(cb);
+    }
+
+    if (cb->ota.checkpoint_pending && co_ota_committed(cb) >= cb->ota.checkpoint.offset) {
+        co_ota_save_checkpoint(cb);
+    }
+
+    // Only the erase that runs ahead of the write cursor is reported.
+    flash = co_ota_flash(cb);
+    erased = __atomic_load_n(&flash->erased, __ATOMIC_ACQUIRE);
+    if (erased > cb->ota.write_offset + CO_FLASH_SECTOR_SIZE &&
+        (erased - cb->ota.erase_report >= CONFIG_CO_ERASE_REPORT_SIZE || (erased == flash->erase_limit && cb->ota.erase_report != erased))) {
+        cb->ota.erase_report = erased;
+        co_ack_begin(&ack, CO_ACK_ERASE);
+        co_ack_int(&ack, (int)erased);
+        co_ack_str(&ack, "&total=");
+        co_ack_int(&ack, (int)flash->erase_limit);
+        co_ack_send(&ack);
+    }
 }
 
-// send pong response
-// TODO: too long ping frame
-static void co_websocket_process_ping(co_cb_t *cb, co_socket_cb_t *scb) {
-    int len;
+/**
+ * @brief Watch the free heap. Below low_memory_threshold, the websocket reads one segment at a time into a smaller
+ * buffer, the window only covers what is drained by the next recv() and a new session gets fewer flash blocks.
+ * All of it grows back once the free heap is a quarter above the threshold.
+ *
+ */
+static void co_memory_check(co_cb_t *cb) {
+    int64_t now = co_time_ms();
+    size_t free_size;
+    bool low;
 
-    // control frame max payload length: 125 -> 0 byte extended length
-    len = 2 + scb->wcb.payload_len + (scb->wcb.MASK ? 4 : 0);
+    if (cb->low_memory_threshold == 0 || now - cb->memory_check_ms < CONFIG_CO_MEMORY_CHECK_INTERVAL_MS) {
+        return;
+    }
+    cb->memory_check_ms = now;
+
+    free_size = heap_caps_get_free_size(CO_HEAP_CAPS_INTERNAL);
+    if (cb->low_memory) {
+        low = free_size < cb->low_memory_threshold + cb->low_memory_threshold / 4;
+    } else {
+        low = free_size < cb->low_memory_threshold;
+    }
+    if (low == cb->low_memory) {
+        return;
+    }
 
-    scb->buf[0] = WS_FIN | WS_OPCODE_PONG;
+    cb->low_memory = low;
+    if (low) {
+        cb->recv_size = min(cb->socket_buffer_size, CONFIG_CO_LOW_MEMORY_BUFFER_SIZE);
+        ESP_LOGW(CO_TAG, "free heap %u is below %u, the buffers and the window shrink", (unsigned)free_size,
+                 (unsigned)cb->low_memory_threshold);
+    } else {
+        cb->recv_size = cb->socket_buffer_size;
+        ESP_LOGI(CO_TAG, "free heap %u, the buffers and the window grow back", (unsigned)free_size);
+    }
 
-    send(scb->fd, scb->buf, len, 0);
+    // the client gets the new credit now, not after half of the last window
+    if (cb->ota.status == CO_OTA_LOAD && cb->ota.window_mode && cb->websocket != NULL) {
+        co_ota_send_window(cb);
+    }
 }
 
-// close handshake
-// TODO: array
-static void co_websocket_process_close(co_cb_t *cb, co_socket_cb_t *scb) {
-    uint8_t buf[4];
-    uint8_t *p = buf;
+/**
+ * @brief Whether pre-erase may erase the inactive OTA partition, see co_ota_check_rollback. Once confirmed, the
+ * running app stays confirmed until the next boot.
+ *
+ */
+static bool co_ota_app_is_confirmed(co_cb_t *cb) {
+    int64_t now_ms;
 
-    *p++ = WS_FIN | WS_OPCODE_CLOSE;
-    *p++ = 0x02; // 2 byte status code
-    // normal closure
-    *p++ = 0x03;
-    *p = 0xe8;
+    if (cb->app_confirmed) {
+        return true;
+    }
 
-    send(scb->fd, buf, 4, 0);
+    now_ms = co_time_ms();
+    if (now_ms < cb->app_check_ms) {
+        return false;
+    }
+    cb->app_check_ms = now_ms + CONFIG_CO_ROLLBACK_CHECK_INTERVAL_MS;
+    cb->app_confirmed = co_ota_check_rollback() == ESP_OK;
+    return cb->app_confirmed;
 }
 
-static inline CO_INLINE uint32_t co_rotr32(uint32_t n, unsigned int c) {
-    const unsigned int mask = (CHAR_BIT * sizeof(n) - 1);
-    c &= mask;
-    return (n >> c) | (n << ((-c) & mask));
+/**
+ * @brief Get the flash that the corsacOTA thread can erase while it is idle:
+ * the update partition of the current session (without flash writer), or the inactive OTA partition.
+ *
+ * @return co_flash_t* NULL for nothing to erase
+ */
+static co_flash_t *co_ota_idle_flash(co_cb_t *cb) {
+    if (cb->ota.status == CO_OTA_LOAD) {
+        if (cb->ota.pipe == NULL && cb->ota.staging_buf == NULL && co_flash_can_erase_ahead(&cb->ota.flash)) {
+            return &cb->ota.flash;
+        }
+        return NULL; // the flash writer erases ahead by itself, a staged image is received without erase
+    }
+
+    if (co_flash_can_erase_ahead(&cb->idle_flash) && co_ota_app_is_confirmed(cb)) {
+        return &cb->idle_flash;
+    }
+
+    return NULL;
+}
+
+// Erase one sector while the corsacOTA thread is idle.
+static void co_ota_idle_erase(co_cb_t *cb, co_flash_t *flash) {
+    esp_err_t ret;
+
+    ret = co_flash_erase_next(flash);
+    if (ret == ESP_OK) {
+        co_ota_poll(cb);
+        return;
+    }
+
+    ESP_LOGE(CO_TAG, "erase failed (%d)", ret);
+    if (flash == &cb->idle_flash) {
+        cb->idle_flash.ptn = NULL; // give up pre-erasing
+        return;
+    }
+
+    co_ota_reset(CO_OTA_STOP);
+    if (cb->websocket != NULL) {
+        co_websocket_send_msg_with_code(CO_RES_SYSTEM_ERROR, co_ota_error_to_msg(ret));
+    }
 }
 
 /**
- * @brief Quick calculation WebSocket. The process of calculating the mask is one of the performance bottlenecks
- * of the entire websocket. The performance between the optimized version and the version without mask is not significant.
+ * @brief Whether an acknowledgement waits for the flash writer or for the memory of lwIP
  *
- * We assume: the natural machine word length is 4byte (32bits) and the endianness is little-endian
- * For xtensa: single fetch: 4 byte(32bit)
+ */
+static inline bool co_ota_is_busy(co_cb_t *cb) {
+    return cb->ota.status == CO_OTA_LOAD && (cb->ota.pending_ack > 0 || cb->ota.window_pending);
+}
+
+/**
+ * @brief Whether the websocket should not be read, because there is no free flash block left.
  *
- * @param data data buffer ptr
- * @param mask websocket mask. Little-endian 32bis mask.
- * @param len data length
  */
-void co_websocket_fast_mask(uint8_t *data, uint32_t mask, size_t len) {
-    uint32_t new_mask;
-    int align_len;
-    size_t i;
+static inline bool co_ota_is_paused(co_cb_t *cb) {
+    return cb->ota.pipe != NULL && co_spsc_is_empty(&cb->ota.pipe->free_queue);
+}
 
-    const uint8_t *p_mask = (uint8_t *)&mask;
+/**
+ * @brief Get the most bytes a recv() of the websocket may take, so that the sectors they fill find a free flash
+ * block and the parser does not wait for the flash writer. The rest stays in the TCP window of the client.
+ * A patch can expand beyond its own size, then co_flash_pipe_get_block still waits.
+ *
+ * @return the limit, INT_MAX without the flash writer
+ */
+static int co_ota_recv_limit(co_cb_t *cb) {
+    co_ota_cb_t *ota = &cb->ota;
 
-    unsigned long int dst = (long int)data;
+    if (ota->pipe == NULL || ota->status != CO_OTA_LOAD) {
+        return INT_MAX;
+    }
 
-    if (len >= 8) {
-        // copy just a few bytes to make dst aligned.
-        align_len = (-dst) % 4;
-        len -= align_len;
+    // a sector is flushed as soon as it is full, and takes the next block then
+    return (int)co_spsc_count(&ota->pipe->free_queue) * CO_FLASH_SECTOR_SIZE + CO_FLASH_SECTOR_SIZE -
+           (int)ota->sector_len - 1;
+}
 
-        for (i = 0; i < align_len; i++) {
-            data[i] ^= p_mask[i];
-        }
+/**
+ * @brief Process a request, the text is terminated in place
+ *
+ * @param data text of the request, there is room for the terminator at data[len]
+ * @param len text length
+ */
+static void co_websocket_process_text(uint8_t *data, size_t len) {
+    co_request_t req;
+    co_process_fn_t fn;
+    uint8_t next;
 
-        // use the new mask on the aligned address
-        switch (align_len) {
-        case 1:
-            new_mask = co_rotr32(mask, 8U);
-            break;
-        case 2:
-            new_mask = co_rotr32(mask, 16U);
-            break;
-        case 3:
-            new_mask = co_rotr32(mask, 24U);
-            break;
-        default: // 0
-            new_mask = mask;
-            break;
-        }
+    // data[len] may be the first byte of the next frame
+    next = data[len];
+    data[len] = '\0';
+
+    if (co_parse_request_text((char *)data, &req) != CO_OK) {
+        co_websocket_send_msg_with_code(CO_RES_INVALID_ARG, "parse error");
+        goto clean;
+    }
+
+    if ((fn = co_get_process_entry(req.op)) == NULL) {
+        co_websocket_send_msg_with_code(CO_RES_INVALID_ARG, "invalid op");
+        goto clean;
+    }
 
-        p_mask = (uint8_t *)&new_mask;
+    // start process!
+    fn(&req);
 
-        dst += align_len;
+clean:
+    data[len] = next;
+}
 
-        for (i = 0; i < len / 4; i++) {
-            *((uint32_t *)dst) ^= new_mask;
-            dst += 4;
-        }
+// send pong response
+// TODO: too long ping frame
+static void co_websocket_process_ping(co_cb_t *cb, co_socket_cb_t *scb) {
+    int len;
+    uint8_t *frame;
+
+    // control frame max payload length: 125 -> 0 byte extended length
+    len = scb->read_len + scb->wcb.payload_len;
+    frame = (uint8_t *)scb->buf + scb->read_offset;
+
+    frame[0] = WS_FIN | WS_OPCODE_PONG;
+
+    co_socket_send_all(scb->fd, frame, len);
+}
+
+// The pong of the ping sent by co_ota_send_ping carries the time it was sent.
+static void co_websocket_process_pong(co_cb_t *cb, co_socket_cb_t *scb, const uint8_t *data, size_t len) {
+    int64_t sent_time, sample;
 
-        len %= 4;
+    // The payload must arrive in one piece.
+    if (!cb->ota.window_mode || len != 8 || scb->wcb.payload_len != 8) {
+        return;
     }
 
-    // There are just a few bytes to process
-    for (i = 0; i < len; i++) {
-        *((uint8_t *)dst) ^= p_mask[i % 4];
-        dst += 1;
+    memcpy(&sent_time, data, 8);
+    sample = esp_timer_get_time() - sent_time;
+    if (sample <= 0 || sample > 10 * 1000 * 1000) {
+        return; // not our ping
     }
+
+    cb->ota.rtt = cb->ota.rtt == 0 ? sample : (cb->ota.rtt / 8) * 7 + sample / 8;
 }
 
-static inline uint32_t co_websocket_get_new_mask(uint32_t mask, size_t len) {
-    switch (len & 0b11) {
-    case 1:
-        return co_rotr32(mask, 8U);
-    case 2:
-        return co_rotr32(mask, 16U);
-    case 3:
-        return co_rotr32(mask, 24U);
-    default:
-        return mask;
-    }
+// close handshake
+// TODO: array
+static void co_websocket_process_close(co_cb_t *cb, co_socket_cb_t *scb) {
+    uint8_t buf[4];
+    uint8_t *p = buf;
+
+    *p++ = WS_FIN | WS_OPCODE_CLOSE;
+    *p++ = 0x02; // 2 byte status code
+    // normal closure
+    *p++ = 0x03;
+    *p = 0xe8;
+
+    co_socket_send_all(scb->fd, buf, 4);
 }
 
 /**
@@ -978,19 +3581,29 @@ static co_err_t co_websocket_process_payload(co_cb_t *cb, co_socket_cb_t *scb) {
     uint8_t *data;
     uint32_t mask;
 
-    data = (uint8_t *)scb->buf + scb->read_len;
+    data = (uint8_t *)scb->buf + scb->read_offset + scb->read_len;
+    mask = scb->wcb.MASK == 1 ? scb->wcb.mask.val : 0;
     // May be possible to read the complete frame and maybe a new frame rate afterwards
-    len = min(scb->remaining_len - scb->read_len, scb->wcb.payload_len);
+    len = min(scb->remaining_len - scb->read_offset - scb->read_len, scb->wcb.payload_len);
+
+    // The pong is sent back from the original frame, so wait for the whole ping frame.
+    if (scb->wcb.OPCODE == WS_OPCODE_PING && len < scb->wcb.payload_len) {
+        return CO_OK;
+    }
+
+    cb->stats.payload_bytes += len;
 
     // For ping frames, we will directly change their opcode and send.
+    // Binary payload is unmasked while it is copied to the flash staging buffer.
     if (scb->wcb.MASK == 1 && scb->wcb.OPCODE != WS_OPCODE_PING) {
-        mask = scb->wcb.mask.val;
-        co_websocket_fast_mask(data, mask, len);
+        if (scb->wcb.OPCODE != WS_OPCODE_BINARY || CO_TEST_MODE == 1) {
+            co_websocket_fast_mask(data, mask, len);
+        }
 
         scb->wcb.mask.val = co_websocket_get_new_mask(mask, len);
     }
 
-    // In the previous processing, we can ensure that each new frame can begin in a place where the Buffer offset is 0.
+    // Each frame is processed in place, starting at the read cursor.
     switch (scb->wcb.OPCODE) {
     case WS_OPCODE_TEXT:
 #if (CO_TEST_MODE == 1)
@@ -1012,7 +3625,7 @@ static co_err_t co_websocket_process_payload(co_cb_t *cb, co_socket_cb_t *scb) {
         }
 
         // case 2: Part of the payload has been received before
-        if (len > CONFIG_CO_WS_TEXT_BUFFER_SIZE - cb->recv_data_offset) { // overflow
+        if (len > cb->text_buffer_size - cb->recv_data_offset) { // overflow
             if (len < scb->wcb.payload_len) {                             // This frame has not yet been received
                 scb->wcb.skip_frame = true;
             }
@@ -1026,7 +3639,7 @@ static co_err_t co_websocket_process_payload(co_cb_t *cb, co_socket_cb_t *scb) {
         cb->recv_data_offset += len;
 
         if (len == scb->wcb.payload_len) {
-            co_websocket_process_text(cb->recv_data, len);
+            co_websocket_process_text(cb->recv_data, cb->recv_data_offset);
             cb->recv_data_offset = 0;
         }
         break;
@@ -1036,12 +3649,13 @@ static co_err_t co_websocket_process_payload(co_cb_t *cb, co_socket_cb_t *scb) {
         break;
 #endif
         //// TODO: check return val
-        co_websocket_process_binary(data, len);
+        co_websocket_process_binary(data, len, mask);
         break;
     case WS_OPCODE_PING:
         co_websocket_process_ping(cb, scb);
         break;
     case WS_OPCODE_PONG:
+        co_websocket_process_pong(cb, scb, data, len);
         break;
     case WS_OPCODE_CLOSE:
         co_websocket_process_close(cb, scb);
@@ -1051,14 +3665,12 @@ static co_err_t co_websocket_process_payload(co_cb_t *cb, co_socket_cb_t *scb) {
         break;
     }
 
-    new_len = scb->remaining_len - scb->read_len - len;
+    new_len = scb->remaining_len - scb->read_offset - scb->read_len - len;
     // case 0: New frames still exist
     if (new_len > 0) {
-        // For simplicity, we make sure that the websocket header is always at the beginning of the buf.
-        memcpy(scb->buf, data + len, new_len);
-
+        // The next header is parsed where it is, just move the read cursor.
+        scb->read_offset += scb->read_len + len;
         scb->read_len = 0;
-        scb->remaining_len = new_len;
 
         scb->status = CO_SOCKET_WEBSOCKET_HEADER;
         scb->wcb.payload_len = 0;
@@ -1070,6 +3682,7 @@ static co_err_t co_websocket_process_payload(co_cb_t *cb, co_socket_cb_t *scb) {
         scb->wcb.payload_len -= len;
 
         scb->read_len = 0;
+        scb->read_offset = 0;
         scb->remaining_len = 0;
 
         return CO_OK;
@@ -1077,6 +3690,7 @@ static co_err_t co_websocket_process_payload(co_cb_t *cb, co_socket_cb_t *scb) {
     // case 2: Exactly one complete frame is read and there is no remaining available data in buf.
     else {
         scb->read_len = 0;
+        scb->read_offset = 0;
         scb->remaining_len = 0;
 
         scb->status = CO_SOCKET_WEBSOCKET_HEADER;
@@ -1086,109 +3700,322 @@ static co_err_t co_websocket_process_payload(co_cb_t *cb, co_socket_cb_t *scb) {
     }
 }
 
+/**
+ * @brief recv() on a connection, the result is passed to the capture callback
+ *
+ */
+static int co_socket_recv(co_cb_t *cb, int fd, void *buf, size_t len) {
+    int ret = recv(fd, buf, len, 0);
+    int err;
+
+    if (cb->capture != NULL) {
+        err = errno;
+        cb->capture(cb->capture_arg, fd, CO_CAPTURE_RECV, buf, ret);
+        errno = err; // the caller checks errno
+    }
+    return ret;
+}
+
+/**
+ * @brief Parse the frames in buf, from the read cursor to remaining_len
+ *
+ * @param cb corsacOTA control block
+ * @param scb corsacOTA socket control block
+ * @return co_err_t
+ * - CO_OK: every received byte has been processed or is waiting for more data
+ * - CO_FAIL: the connection must be closed
+ */
+static co_err_t co_websocket_parse(co_cb_t *cb, co_socket_cb_t *scb) {
+    co_err_t ret;
+
+    do {
+        // Headers and payloads are parsed in place. The read cursor always points to the
+        // beginning of the frame currently being processed.
+        if (scb->status != CO_SOCKET_WEBSOCKET_PAYLOAD) {
+            ret = co_websocket_process_header(cb, scb);
+            if (ret != CO_OK) {
+                return CO_FAIL;
+            }
+        }
+
+        // Perhaps we have already read the header section, and if there are extra bytes left over,
+        // we continue reading the payload section.
+        if (scb->status == CO_SOCKET_WEBSOCKET_PAYLOAD) {
+            ret = co_websocket_process_payload(cb, scb);
+            if (ret == CO_FAIL) {
+                return CO_FAIL;
+            }
+        }
+    } while (ret == CO_ERROR_IO_PENDING);
+
+    return CO_OK;
+}
+
+/**
+ * @brief Give a websocket its buffer, on its first read
+ *
+ * @param cb corsacOTA control block
+ * @param scb Socket control block included in cb
+ * @return esp_err_t
+ */
+static esp_err_t co_socket_buf_alloc(co_cb_t *cb, co_socket_cb_t *scb) {
+    // a pool buffer has the full size, a heap buffer follows the memory pressure, see co_socket_buf_resize
+    scb->buf_size = cb->socket_pool.mem != NULL ? cb->socket_buffer_size : cb->recv_size;
+    scb->buf = co_pool_get(&cb->socket_pool, scb->buf_size + 1);
+    if (scb->buf == NULL && cb->socket_pool.mem == NULL && scb->buf_size > CO_SOCKET_BUFFER_MIN_SIZE) {
+        // the heap is short, a small buffer still moves the upload forward
+        scb->buf_size = CO_SOCKET_BUFFER_MIN_SIZE;
+        scb->buf = co_pool_get(&cb->socket_pool, scb->buf_size + 1);
+    }
+    scb->remaining_len = 0;
+    scb->read_offset = 0;
+    scb->read_len = 0;
+    if (scb->buf == NULL) {
+        ESP_LOGE(CO_TAG, LOG_FMT("no memory for the socket buffer (fd %d)"), scb->fd);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief free the buffer of the specified socket control block
+ *
+ * @param cb corsacOTA control block
+ * @param scb Socket control block included in cb
+ */
+static void co_socket_buf_free(co_cb_t *cb, co_socket_cb_t *scb) {
+    co_pool_put(&cb->socket_pool, scb->buf);
+    scb->buf = NULL;
+    scb->buf_size = 0;
+    scb->remaining_len = 0;
+    scb->read_offset = 0;
+    scb->read_len = 0;
+}
+
+/**
+ * @brief Move the bytes behind the read cursor to the head of buf. Only a partial header or an incomplete control
+ * frame can be left there, so the next recv has the whole buffer.
+ *
+ */
+static void co_socket_buf_compact(co_cb_t *cb, co_socket_cb_t *scb) {
+    size_t len;
+
+    if (scb->read_offset > 0) {
+        len = scb->remaining_len - scb->read_offset;
+        memmove(scb->buf, scb->buf + scb->read_offset, len);
+        cb->stats.copy_bytes += len;
+
+        scb->read_offset = 0;
+        scb->remaining_len = len;
+    }
+}
+
+/**
+ * @brief Resize the heap buffer of a compacted websocket to recv_size. When the heap can not grow it, the
+ * buffer is kept and the resize is tried again on the next read.
+ *
+ */
+static void co_socket_buf_resize(co_cb_t *cb, co_socket_cb_t *scb) {
+    char *buf;
+
+    if (scb->remaining_len > cb->recv_size) {
+        return;
+    }
+
+    buf = co_realloc(scb->buf, cb->recv_size + 1);
+    if (buf != NULL) {
+        scb->buf = buf;
+        scb->buf_size = cb->recv_size;
+    }
+}
+
 static esp_err_t co_websocket_process(co_cb_t *cb, co_socket_cb_t *scb) {
     if (cb->websocket != scb) {
         return ESP_FAIL;
     }
-    int fd, ret, offset;
+    int fd, ret, offset, len;
+
+    if (scb->buf == NULL && co_socket_buf_alloc(cb, scb) != ESP_OK) {
+        return ESP_FAIL;
+    }
 
     fd = scb->fd;
+
+    co_socket_buf_compact(cb, scb);
+    if (scb->buf_size != cb->recv_size && cb->socket_pool.mem == NULL) {
+        co_socket_buf_resize(cb, scb);
+    }
+
     offset = scb->remaining_len;
 
-    ret = recv(fd, scb->buf + offset, CONFIG_CO_SOCKET_BUFFER_SIZE - offset, 0);
+    len = (int)min(scb->buf_size, cb->recv_size) - offset;
+    if (len <= 0) {
+        // a frame started before recv_size shrank completes in the rest of the buffer
+        len = (int)scb->buf_size - offset;
+        if (len <= 0) {
+            return ESP_FAIL; // a frame the buffer can not hold
+        }
+    }
+
+    // backpressure: what the free flash blocks can not take is left in the socket
+    len = min(len, co_ota_recv_limit(cb));
+    if (len <= 0) {
+        return ESP_OK;
+    }
+
+    ret = co_socket_recv(cb, fd, scb->buf + offset, len);
     if (ret <= 0) {
         return ESP_FAIL;
     }
     scb->remaining_len += ret;
+    cb->stats.recv_bytes += ret;
 
-    do {
-        // After we process a partial or complete payload,
-        // we always receive a new payload or header starting from the head of the buf.
-        if (scb->status != CO_SOCKET_WEBSOCKET_PAYLOAD) {
-            ret = co_websocket_process_header(cb, scb);
-            if (ret != CO_OK) {
-                return CO_FAIL;
-            }
-        }
-
-        // Perhaps we have already read the header section, and if there are extra bytes left over,
-        // we continue reading the payload section.
-        if (scb->status == CO_SOCKET_WEBSOCKET_PAYLOAD) {
-            ret = co_websocket_process_payload(cb, scb);
-            if (ret == CO_FAIL) {
-                return CO_FAIL;
-            }
-        }
-    } while (ret == CO_ERROR_IO_PENDING);
-
-    return ESP_OK;
+    return co_websocket_parse(cb, scb) == CO_FAIL ? ESP_FAIL : ESP_OK;
 }
 
 /**
- * @brief parse HTTP header lines of format:
- *        \r\nfield_name: value1, value2, ... \r\n
+ * @brief Fields of the upgrade request: lower case name and the token the value must contain
  *
- * @param header_start
- * @param header_end
- * @param field_name
- * @param value Optional value
- * @return const char* The specific value starts, or the beginning of value in field.
  */
-static const char *co_http_header_find_field_value(const char *header_start, const char *header_end, const char *field_name, const char *value) {
-    const char *field_start, *field_end, *next_crlf, *value_start;
-    int field_name_len;
+static const struct {
+    const char *name;
+    uint8_t name_len;
+    const char *token; // NULL: the value is kept (Sec-WebSocket-Key)
+    uint8_t token_len;
+} co_http_fields[CO_HTTP_FIELD_NUM] = {
+    [CO_HTTP_UPGRADE] = {"upgrade", 7, "websocket", 9},
+    [CO_HTTP_CONNECTION] = {"connection", 10, "upgrade", 7}, // "Connection: keep-alive, Upgrade" for Firefox
+    [CO_HTTP_WS_KEY] = {"sec-websocket-key", 17, NULL, 0},
+};
 
-    field_name_len = (int)strlen(field_name);
+static void co_http_parser_init(co_http_parser_t *p) {
+    memset(p, 0, sizeof(co_http_parser_t));
+    p->state = CO_HTTP_REQUEST_LINE;
+    p->field = CO_HTTP_NO_FIELD;
+}
 
-    field_start = header_start;
-    do {
-        field_start = strcasestr(field_start + 1, field_name);
-        field_end = field_start + field_name_len - 1;
+static inline void co_http_token_end(co_http_parser_t *p) {
+    if (p->token_match && p->token_len == co_http_fields[p->field].token_len) {
+        p->found |= 1 << p->field;
+    }
+    p->token_len = 0;
+    p->token_match = true;
+}
 
-        if (field_start != NULL && field_start - header_start >= 2 && field_start[-2] == '\r' && field_start[-1] == '\n') { // is start with "\r\n" ?
-            if (header_end - field_end >= 1 && field_end[1] == ':') {                                                       // is end with ':' ?
+/**
+ * @brief Parse the bytes of the upgrade request as they arrive: each byte is looked at once at most, and nothing
+ *        is kept but the Sec-WebSocket-Key. The lines of other fields are skipped with memchr. Field names and the
+ *        tokens of the values are case-insensitive.
+ *
+ * @param p parser state
+ * @param data received bytes
+ * @param len number of received bytes
+ * @return int The number of bytes of the header, less than len if the header ends before.
+ */
+static int co_http_parse(co_http_parser_t *p, const char *data, int len) {
+    const char *lf;
+    int i, f;
+    char c;
+
+    for (i = 0; i < len && p->state != CO_HTTP_DONE; i++) {
+        if (p->state == CO_HTTP_REQUEST_LINE || (p->state == CO_HTTP_FIELD_VALUE && p->field == CO_HTTP_NO_FIELD) ||
+            (p->state == CO_HTTP_FIELD_NAME && p->name_len > 0 && p->field == CO_HTTP_NO_FIELD)) {
+            // nothing to look at before the end of this line
+            lf = memchr(data + i, '\n', len - i);
+            if (lf == NULL) {
+                i = len;
                 break;
             }
+            i = lf - data;
         }
-    } while (field_start != NULL);
-
-    if (field_start == NULL) {
-        return NULL;
-    }
 
-    // find the field terminator
-    next_crlf = strcasestr(field_start, "\r\n");
-    if (next_crlf == NULL) {
-        return NULL; // Malformed HTTP header!
-    }
+        c = data[i];
+        if (c == '\r') {
+            continue; // every line ends with "\r\n", only '\n' is looked at
+        }
 
-    // If not looking for a value, then return a pointer to the start of values string
-    if (value == NULL) {
-        return field_end + 2; // 2 for ':'  ' '(blank)
-    }
+        switch (p->state) {
+        case CO_HTTP_REQUEST_LINE:
+            if (c == '\n') {
+                p->state = CO_HTTP_FIELD_NAME;
+                p->name_len = 0;
+            }
+            break;
+        case CO_HTTP_FIELD_NAME:
+            if (c == '\n') {
+                if (p->name_len == 0) {
+                    p->state = CO_HTTP_DONE; // empty line
+                }
+                p->name_len = 0; // a line without ':' is ignored
+                break;
+            }
 
-    value_start = strcasestr(field_start, value);
-    if (value_start == NULL) {
-        return NULL;
-    }
+            if (c == ':') {
+                if (p->name_len == 0 || p->name_len != co_http_fields[p->field].name_len) {
+                    p->field = CO_HTTP_NO_FIELD; // a longer name, the value is skipped
+                }
+                p->token_len = 0;
+                p->token_match = true;
+                p->state = CO_HTTP_FIELD_VALUE;
+                break;
+            }
 
-    if (value_start > next_crlf) {
-        return NULL; // encounter with unanticipated CRLF
-    }
+            c = tolower((unsigned char)c);
+            if (p->name_len == 0) {
+                p->field = CO_HTTP_NO_FIELD;
+                for (f = 0; f < CO_HTTP_FIELD_NUM; f++) {
+                    if (co_http_fields[f].name[0] == c) {
+                        p->field = f;
+                    }
+                }
+            } else if (p->name_len >= co_http_fields[p->field].name_len || co_http_fields[p->field].name[p->name_len] != c) {
+                p->field = CO_HTTP_NO_FIELD; // the rest of the line is skipped
+            }
+            p->name_len++;
+            break;
+        case CO_HTTP_FIELD_VALUE:
+            if (p->field == CO_HTTP_NO_FIELD) {
+                // skipped
+            } else if (co_http_fields[p->field].token == NULL) {
+                if (c == '\n') {
+                    if (p->key_len == CO_WS_KEY_LEN) {
+                        p->found |= 1 << p->field;
+                    }
+                } else if (c != ' ' && c != '\t') {
+                    if (p->key_len < CO_WS_KEY_LEN) {
+                        p->key[p->key_len] = c;
+                    }
+                    p->key_len += p->key_len < 255;
+                }
+            } else if (c == ',' || c == ' ' || c == '\t' || c == '\n') {
+                if (p->token_len > 0) {
+                    co_http_token_end(p);
+                }
+            } else {
+                if (p->token_len >= co_http_fields[p->field].token_len ||
+                    co_http_fields[p->field].token[p->token_len] != tolower((unsigned char)c)) {
+                    p->token_match = false;
+                }
+                p->token_len += p->token_len < 255;
+            }
 
-    // The value we found should be properly delineated from the other tokens
-    if (isalnum((unsigned char)value_start[-1]) || isalnum((unsigned char)value_start[strlen(value)])) {
-        // "field_name: value1, value2,"
-        // Consecutive tokens will be considered as errors.
-        return NULL;
+            if (c == '\n') {
+                p->state = CO_HTTP_FIELD_NAME;
+                p->name_len = 0;
+            }
+            break;
+        default:
+            break;
+        }
     }
 
-    return value_start;
+    p->size += i;
+    return i;
 }
 
 static void co_http_error_400_response(co_cb_t *cb, co_socket_cb_t *scb) {
-    const char *error = "HTTP/1.1 400 Bad Request\r\n\r\n";
-    send(scb->fd, error, strlen(error), 0);
+    static const char error[] = "HTTP/1.1 400 Bad Request\r\n\r\n";
+    co_socket_send_all(scb->fd, error, sizeof(error) - 1);
 }
 
 #define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
@@ -1222,122 +4049,485 @@ static esp_err_t co_websocket_create_accept_key(char *dst, size_t dst_len, const
     return ESP_OK;
 }
 
+// the Sec-WebSocket-Accept value is encoded in place, at the end of this
+static const char co_websocket_response_101[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                                "Server: corsacOTA server\r\n"
+                                                "Upgrade: websocket\r\n"
+                                                "Connection: Upgrade\r\n"
+                                                "Sec-WebSocket-Accept: ";
+
 static esp_err_t co_websocket_handshake_send_key(int fd, const char *client_key) {
-    char res_header[256], accept_key[29];
-    int res_header_length;
+    // 28 base64 characters of the SHA-1, the terminator written by the encoder is replaced with "\r\n\r\n"
+    char res_header[sizeof(co_websocket_response_101) - 1 + 28 + 4];
+    const int prefix_len = sizeof(co_websocket_response_101) - 1;
 
-    if (co_websocket_create_accept_key(accept_key, sizeof(accept_key), client_key) != ESP_OK) {
+    memcpy(res_header, co_websocket_response_101, prefix_len);
+    if (co_websocket_create_accept_key(res_header + prefix_len, 28 + 1, client_key) != ESP_OK) {
         ESP_LOGE(CO_TAG, LOG_FMT("fail to create accept key"));
         return ESP_FAIL;
     }
+    memcpy(res_header + prefix_len + 28, "\r\n\r\n", 4);
 
-    snprintf(res_header, sizeof(res_header),
-             "HTTP/1.1 101 Switching Protocols\r\n"
-             "Server: corsacOTA server\r\n"
-             "Upgrade: websocket\r\n"
-             "Connection: Upgrade\r\n"
-             "Sec-WebSocket-Accept: %s\r\n"
-             "\r\n",
-             accept_key);
-
-    res_header_length = strlen(res_header);
-    send(fd, res_header, res_header_length, 0);
-
-    return ESP_OK;
+    return co_socket_send_all(fd, res_header, sizeof(res_header)) == CO_OK ? ESP_OK : ESP_FAIL;
 }
 
-static esp_err_t co_websocket_handshake_process(co_cb_t *cb, co_socket_cb_t *scb) {
-    if (scb->remaining_len == 0) {
-        memset(scb->buf, 0, CONFIG_CO_SOCKET_BUFFER_SIZE);
-    }
+static void co_socket_close(co_cb_t *cb, co_socket_cb_t *scb);
 
-    int offset = scb->remaining_len;
+static esp_err_t co_websocket_handshake_process(co_cb_t *cb, co_socket_cb_t *scb) {
+    co_http_parser_t *p = &scb->http;
     int fd = scb->fd;
 
-    int ret = recv(fd, scb->buf + offset, CONFIG_CO_SOCKET_BUFFER_SIZE - offset, 0);
+    // the parsed bytes are not kept, the handshakes share the arena
+    int ret = co_socket_recv(cb, fd, cb->http_arena, CONFIG_CO_HTTP_ARENA_SIZE);
     if (ret <= 0) {
         co_http_error_400_response(cb, scb);
         return ESP_FAIL;
     }
 
-    scb->remaining_len += ret;
-
-    // Already received the entire http header?
-    if (scb->remaining_len < 4 || memcmp(scb->buf + scb->remaining_len - 4, "\r\n\r\n", 4) != 0) {
+    int header_len = co_http_parse(p, cb->http_arena, ret);
+    if (p->state != CO_HTTP_DONE) {
+        if (p->size > CONFIG_CO_HTTP_HEADER_MAX_SIZE) {
+            co_http_error_400_response(cb, scb);
+            return ESP_FAIL;
+        }
         return ESP_OK; // Not yet received
     }
 
-    const char *header_start = scb->buf, *header_end = scb->buf + scb->remaining_len - 1;
-    const char *ws_key_start, *ws_key_end;
+    const uint8_t required = (1 << CO_HTTP_UPGRADE) | (1 << CO_HTTP_CONNECTION) | (1 << CO_HTTP_WS_KEY);
+    if ((p->found & required) != required) {
+        co_http_error_400_response(cb, scb);
+        return ESP_FAIL;
+    }
 
-    if (co_http_header_find_field_value(header_start, header_end, "Upgrade", "websocket") == NULL ||
-        co_http_header_find_field_value(header_start, header_end, "Connection", "Upgrade") == NULL ||
-        (ws_key_start = co_http_header_find_field_value(header_start, header_end, "Sec-WebSocket-Key", NULL)) == NULL) {
+    if (co_websocket_handshake_send_key(scb->fd, p->key) != ESP_OK) {
         co_http_error_400_response(cb, scb);
         return ESP_FAIL;
     }
 
-    /* example:
-     Sec-WebSocket-Key: c2REMVVpRXJRQWJ0Q1dKeQ==\r\n
-                       |
-                    ws_key_start
-    */
+    ESP_LOGD(CO_TAG, "websocket handshake success");
 
-    // skip the extra blank
-    for (; *ws_key_start == ' '; ws_key_start++) {
-        ;
+    // the previous websocket is closed now: paused by the flash writer, it would never be read again
+    if (cb->websocket != NULL) {
+        co_socket_close(cb, cb->websocket);
+    }
+    cb->websocket = scb;
+    scb->status = CO_SOCKET_WEBSOCKET_HEADER;
+    if (cb->idle_timeout_ms > 0) {
+        co_timer_add(&cb->timers, &scb->timer, cb->idle_timeout_ms);
+    } else {
+        co_timer_del(&cb->timers, &scb->timer);
     }
+    memset(&scb->wcb, 0, sizeof(co_websocket_cb_t));
 
-    // find the end of ws key
-    for (ws_key_end = ws_key_start; *ws_key_end != '\r' && *ws_key_end != ' '; ws_key_end++) {
-        ;
+    if (header_len == ret) {
+        return ESP_OK; // the buffer is allocated when the first frame arrives
     }
 
-    /* example:
-     Sec-WebSocket-Key: c2REMVVpRXJRQWJ0Q1dKeQ==\r\n
-                        |                       ||
-                    ws_key_start            ws_key_end
-    */
-    if (ws_key_end - ws_key_start != 24) {
-        co_http_error_400_response(cb, scb);
+    // the first frames may have been sent right behind the request, a small buffer takes them in pieces
+    if (co_socket_buf_alloc(cb, scb) != ESP_OK) {
         return ESP_FAIL;
     }
+    int offset, len;
+    for (offset = header_len; offset < ret && cb->websocket == scb; offset += len) {
+        co_socket_buf_compact(cb, scb);
+        len = min(ret - offset, (int)(scb->buf_size - scb->remaining_len));
+        if (len <= 0) {
+            return ESP_FAIL; // an incomplete control frame can not fill the buffer
+        }
+        memcpy(scb->buf + scb->remaining_len, cb->http_arena + offset, len);
+        scb->remaining_len += len;
+        cb->stats.recv_bytes += len;
+        if (co_websocket_parse(cb, scb) == CO_FAIL) {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
 
-    if (co_websocket_handshake_send_key(scb->fd, ws_key_start) != ESP_OK) {
-        co_http_error_400_response(cb, scb);
+static esp_err_t co_socket_data_process(co_cb_t *cb, co_socket_cb_t *scb) {
+    if (cb == NULL || scb == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    switch (scb->status) {
+    case CO_SOCKET_ACCEPT:
+        ESP_LOGW(CO_TAG, LOG_FMT("This state should not occur"));
+        return ESP_FAIL; //// TODO: remove this?
+    case CO_SOCKET_HANDSHAKE:
+        return co_websocket_handshake_process(cb, scb);
+    case CO_SOCKET_WEBSOCKET_HEADER:
+    case CO_SOCKET_WEBSOCKET_EXTEND_LENGTH:
+    case CO_SOCKET_WEBSOCKET_MASK:
+    case CO_SOCKET_WEBSOCKET_PAYLOAD:
+        return co_websocket_process(cb, scb);
+    default:
+        ESP_LOGW(CO_TAG, LOG_FMT("This state should not occur"));
+        return ESP_OK;
+    }
+}
+
+static void co_socket_set_non_block(int fd) {
+    int flag;
+    if ((flag = fcntl(fd, F_GETFL, 0)) < 0) {
+        return;
+    }
+
+    flag |= O_NONBLOCK;
+    fcntl(fd, F_SETFL, flag);
+}
+
+#if (CO_EVENT_SELECT)
+// select() fails as a whole on a closed fd, it is found with this
+static int co_socket_fd_is_valid(int fd) {
+    return fcntl(fd, F_GETFD, 0) != -1 || errno != EBADF;
+}
+#endif
+
+/**
+ * @brief Find the socket control block of a connection
+ *
+ * @param cb corsacOTA control block
+ * @param fd socket file descriptor
+ * @return co_socket_cb_t* The socket control block, or `NULL` for not found.
+ */
+static co_socket_cb_t *co_socket_find(co_cb_t *cb, int fd) {
+    int index = fd - CO_FD_BASE;
+    if (index < 0 || index >= cb->fd_map_size) {
+        return NULL;
+    }
+    return cb->fd_map[index];
+}
+
+/**
+ * @brief Grow the fd map to hold index
+ *
+ */
+static esp_err_t co_socket_map_grow(co_cb_t *cb, int index) {
+    int size = cb->fd_map_size > 0 ? cb->fd_map_size : 16;
+    while (size <= index) {
+        size *= 2;
+    }
+    co_socket_cb_t **map = co_realloc(cb->fd_map, size * sizeof(co_socket_cb_t *));
+    if (map == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(map + cb->fd_map_size, 0, (size - cb->fd_map_size) * sizeof(co_socket_cb_t *));
+    cb->fd_map = map;
+    cb->fd_map_size = size;
+    return ESP_OK;
+}
+
+/**
+ * @brief Map a fd to its socket control block, the map grows to hold the fd
+ *
+ * @param cb corsacOTA control block
+ * @param fd socket file descriptor
+ * @param scb socket control block, `NULL` to remove the fd
+ * @return esp_err_t
+ */
+static esp_err_t co_socket_map_set(co_cb_t *cb, int fd, co_socket_cb_t *scb) {
+    int index = fd - CO_FD_BASE;
+    if (index < 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (index >= cb->fd_map_size) {
+        if (scb == NULL) {
+            return ESP_OK;
+        }
+        if (co_socket_map_grow(cb, index) != ESP_OK) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    cb->fd_map[index] = scb;
+    return ESP_OK;
+}
+
+/*
+ * The event loop waits for the listen socket and the connections to be readable: epoll on the host, poll() on
+ * lwIP and select() on the ESP8266, whose RTOS SDK has no poll(). co_event_wait fills cb->event.ready, so the
+ * main loop only looks at the fds that have something to read.
+ */
+
+static esp_err_t co_event_init(co_cb_t *cb) {
+    co_event_t *ev = &cb->event;
+
+    ev->wake_fd = -1;
+    ev->wake_send_fd = -1;
+    ev->capacity = cb->max_listen_num + 2;
+    ev->ready = co_calloc(ev->capacity, sizeof(co_event_ready_t));
+    if (ev->ready == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+#if (CO_EVENT_EPOLL)
+    ev->events = co_calloc(ev->capacity, sizeof(struct epoll_event));
+    ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev->events == NULL || ev->epfd < 0) {
+        ESP_LOGE(CO_TAG, LOG_FMT("error in epoll_create (%d)"), errno);
+        if (ev->epfd >= 0) {
+            close(ev->epfd);
+        }
+        co_free(ev->events);
+        co_free(ev->ready);
+        ev->ready = NULL;
         return ESP_FAIL;
     }
+#elif (CO_EVENT_POLL)
+    ev->fds = co_calloc(ev->capacity, sizeof(struct pollfd));
+    if (ev->fds == NULL) {
+        co_free(ev->ready);
+        ev->ready = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    ev->fd_num = 0;
+#else
+    FD_ZERO(&ev->read_set);
+    ev->maxfd = -1;
+#endif
+    return ESP_OK;
+}
+
+static void co_event_deinit(co_cb_t *cb) {
+    co_event_t *ev = &cb->event;
+
+    if (ev->ready == NULL) {
+        return;
+    }
 
-    ESP_LOGD(CO_TAG, "websocket handshake success");
+    if (ev->wake_fd != -1) {
+        close(ev->wake_fd);
+        close(ev->wake_send_fd);
+    }
 
-    cb->websocket = scb;
-    scb->status = CO_SOCKET_WEBSOCKET_HEADER;
-    scb->remaining_len = 0;
+#if (CO_EVENT_EPOLL)
+    close(ev->epfd);
+    co_free(ev->events);
+#elif (CO_EVENT_POLL)
+    co_free(ev->fds);
+#endif
+    co_free(ev->ready);
+    ev->ready = NULL;
+}
+
+/**
+ * @brief Wait for a fd to be readable
+ *
+ * @param cb corsacOTA control block
+ * @param fd socket file descriptor
+ * @param scb socket control block of the connection, `NULL` for the listen socket
+ * @return esp_err_t
+ */
+static esp_err_t co_event_add(co_cb_t *cb, int fd, co_socket_cb_t *scb) {
+    co_event_t *ev = &cb->event;
+
+    if (scb != NULL) {
+        scb->read_paused = false;
+    }
+
+#if (CO_EVENT_EPOLL)
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.fd = fd,
+    };
+    if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        ESP_LOGE(CO_TAG, LOG_FMT("error in epoll_ctl (%d)"), errno);
+        return ESP_FAIL;
+    }
+#elif (CO_EVENT_POLL)
+    if (ev->fd_num >= ev->capacity) {
+        return ESP_FAIL;
+    }
+    if (scb != NULL) {
+        scb->event_index = ev->fd_num;
+    }
+    ev->fds[ev->fd_num].fd = fd;
+    ev->fds[ev->fd_num].events = POLLIN;
+    ev->fds[ev->fd_num].revents = 0;
+    ev->fd_num++;
+#else
+    FD_SET(fd, &ev->read_set);
+    ev->maxfd = MAX(ev->maxfd, fd);
+#endif
+    return ESP_OK;
+}
+
+/**
+ * @brief Stop waiting for a connection, before its fd is closed
+ *
+ */
+static void co_event_del(co_cb_t *cb, co_socket_cb_t *scb) {
+    co_event_t *ev = &cb->event;
+
+#if (CO_EVENT_EPOLL)
+    epoll_ctl(ev->epfd, EPOLL_CTL_DEL, scb->fd, NULL);
+#elif (CO_EVENT_POLL)
+    // move the last one into the hole
+    int last = ev->fd_num - 1;
+    if (scb->event_index != last) {
+        ev->fds[scb->event_index] = ev->fds[last];
+        co_socket_cb_t *moved = co_socket_find(cb, ev->fds[last].fd); // NULL for the listen socket
+        if (moved != NULL) {
+            moved->event_index = scb->event_index;
+        }
+    }
+    ev->fd_num--;
+#else
+    FD_CLR(scb->fd, &ev->read_set);
+    if (scb->fd == ev->maxfd) {
+        while (ev->maxfd >= 0 && !FD_ISSET(ev->maxfd, &ev->read_set)) {
+            ev->maxfd--;
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Pause or resume reading a connection, for the backpressure of the flash writer
+ *
+ */
+static void co_event_set_read(co_cb_t *cb, co_socket_cb_t *scb, bool enable) {
+    co_event_t *ev = &cb->event;
 
-    memset(scb->buf, 0, CONFIG_CO_SOCKET_BUFFER_SIZE);
+    if (scb->read_paused == !enable) {
+        return;
+    }
+    scb->read_paused = !enable;
+
+#if (CO_EVENT_EPOLL)
+    struct epoll_event event = {
+        .events = enable ? EPOLLIN : 0,
+        .data.fd = scb->fd,
+    };
+    epoll_ctl(ev->epfd, EPOLL_CTL_MOD, scb->fd, &event);
+#elif (CO_EVENT_POLL)
+    ev->fds[scb->event_index].events = enable ? POLLIN : 0;
+#else
+    if (enable) {
+        FD_SET(scb->fd, &ev->read_set);
+    } else {
+        FD_CLR(scb->fd, &ev->read_set);
+    }
+#endif
+}
+
+/**
+ * @brief Wait until a fd is readable or the timeout expires
+ *
+ * @param cb corsacOTA control block
+ * @param timeout_ms -1 to wait forever
+ * @return int The number of entries in cb->event.ready, 0 on timeout, or -1 on error.
+ */
+static int co_event_wait(co_cb_t *cb, int timeout_ms) {
+    co_event_t *ev = &cb->event;
+    int i, ret;
+
+    ev->ready_num = 0;
+
+#if (CO_EVENT_EPOLL)
+    ret = epoll_wait(ev->epfd, ev->events, ev->capacity, timeout_ms);
+    if (ret < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (i = 0; i < ret; i++) {
+        ev->ready[ev->ready_num].fd = ev->events[i].data.fd;
+        ev->ready[ev->ready_num].invalid = false; // a closed fd leaves the epoll set by itself
+        ev->ready_num++;
+    }
+#elif (CO_EVENT_POLL)
+    ret = poll(ev->fds, ev->fd_num, timeout_ms);
+    if (ret < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (i = 0; i < ev->fd_num && ev->ready_num < ret; i++) {
+        if (ev->fds[i].revents != 0) {
+            ev->ready[ev->ready_num].fd = ev->fds[i].fd;
+            ev->ready[ev->ready_num].invalid = (ev->fds[i].revents & POLLNVAL) != 0;
+            ev->ready_num++;
+        }
+    }
+#else
+    fd_set read_set = ev->read_set;
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    ret = select(ev->maxfd + 1, &read_set, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+    if (ret < 0) {
+        if (errno != EBADF) {
+            return -1;
+        }
+        // report the fds that are not open any more
+        for (i = 0; i <= ev->maxfd && ev->ready_num < ev->capacity; i++) {
+            if (FD_ISSET(i, &ev->read_set) && !co_socket_fd_is_valid(i)) {
+                ev->ready[ev->ready_num].fd = i;
+                ev->ready[ev->ready_num].invalid = true;
+                ev->ready_num++;
+            }
+        }
+        return ev->ready_num > 0 ? ev->ready_num : -1;
+    }
+    for (i = 0; i <= ev->maxfd && ev->ready_num < ret; i++) {
+        if (FD_ISSET(i, &read_set)) {
+            ev->ready[ev->ready_num].fd = i;
+            ev->ready[ev->ready_num].invalid = false;
+            ev->ready_num++;
+        }
+    }
+#endif
 
-    return ESP_OK;
+    return ev->ready_num;
 }
 
-static esp_err_t co_socket_data_process(co_cb_t *cb, co_socket_cb_t *scb) {
-    if (cb == NULL || scb == NULL) {
-        return ESP_ERR_INVALID_ARG;
+/**
+ * @brief Create the loopback UDP socket the flash writer wakes the event loop with, a socket can be waited for on
+ * every backend. Without it, the event loop polls the flash writer every CONFIG_CO_FLASH_POLL_INTERVAL_MS.
+ *
+ */
+static void co_event_wake_init(co_cb_t *cb) {
+    co_event_t *ev = &cb->event;
+    struct sockaddr_in addr = {
+        .sin_family = PF_INET,
+        .sin_addr = {
+            .s_addr = htonl(INADDR_LOOPBACK)},
+        .sin_port = 0,
+    };
+    socklen_t addr_len = sizeof(addr);
+    int fd, send_fd;
+
+    fd = socket(PF_INET, SOCK_DGRAM, 0);
+    send_fd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || send_fd < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0 ||
+        connect(send_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        co_event_add(cb, fd, NULL) != ESP_OK) {
+        ESP_LOGW(CO_TAG, LOG_FMT("no wake socket (%d), the flash writer is polled"), errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (send_fd >= 0) {
+            close(send_fd);
+        }
+        return;
     }
 
-    switch (scb->status) {
-    case CO_SOCKET_ACCEPT:
-        ESP_LOGW(CO_TAG, LOG_FMT("This state should not occur"));
-        return ESP_FAIL; //// TODO: remove this?
-    case CO_SOCKET_HANDSHAKE:
-        return co_websocket_handshake_process(cb, scb);
-    case CO_SOCKET_WEBSOCKET_HEADER:
-    case CO_SOCKET_WEBSOCKET_EXTEND_LENGTH:
-    case CO_SOCKET_WEBSOCKET_MASK:
-    case CO_SOCKET_WEBSOCKET_PAYLOAD:
-        return co_websocket_process(cb, scb);
-    default:
-        ESP_LOGW(CO_TAG, LOG_FMT("This state should not occur"));
-        return ESP_OK;
+    co_socket_set_non_block(fd);
+    co_socket_set_non_block(send_fd);
+    ev->wake_fd = fd;
+    ev->wake_send_fd = send_fd;
+}
+
+// Read the wakeups of the flash writer, co_ota_poll then looks at the pipe
+static void co_event_wake_drain(co_cb_t *cb) {
+    char buf[16];
+
+    if (cb->ota.pipe != NULL) {
+        __atomic_store_n(&cb->ota.pipe->wake_pending, false, __ATOMIC_RELEASE);
+    }
+    while (recv(cb->event.wake_fd, buf, sizeof(buf), 0) > 0) {
+        ;
     }
 }
 
@@ -1347,103 +4537,110 @@ static esp_err_t co_socket_list_alloc(co_cb_t *cb) {
     }
 
     int i;
-    cb->socket_list = calloc(cb->max_listen_num, sizeof(co_socket_cb_t *)); // pointer list
-    if (cb->socket_list == NULL) {
-        return ESP_ERR_NO_MEM;
+    cb->socket_list = co_calloc(cb->max_listen_num, sizeof(co_socket_cb_t *)); // pointer list
+    cb->free_list = co_calloc(cb->max_listen_num, sizeof(co_socket_cb_t *));
+    if (cb->socket_list == NULL || cb->free_list == NULL) {
+        goto fail;
     }
 
     for (i = 0; i < cb->max_listen_num; i++) {
-        if ((cb->socket_list[i] = calloc(1, sizeof(struct co_socket_cb))) == NULL) {
+        if ((cb->socket_list[i] = co_calloc(1, sizeof(struct co_socket_cb))) == NULL) {
             goto fail;
         }
     }
+
+    if (co_event_init(cb) != ESP_OK) {
+        goto fail;
+    }
+    co_event_wake_init(cb);
     return ESP_OK;
 
 fail:
-    for (i = 0; i < cb->max_listen_num; i++) {
-        if (cb->socket_list[i] != NULL) {
-            free(cb->socket_list[i]);
+    if (cb->socket_list != NULL) {
+        for (i = 0; i < cb->max_listen_num; i++) {
+            co_free(cb->socket_list[i]);
         }
     }
-    free(cb->socket_list);
+    co_free(cb->socket_list);
+    co_free(cb->free_list);
     cb->socket_list = NULL;
+    cb->free_list = NULL;
     return ESP_ERR_NO_MEM;
 }
 
 /**
- * @brief add a new fd to socket list
+ * @brief Invalidate all sockets in the list in the accept stage
  *
- * @param cb corsacOTA control block
- * @param fd socket file descriptor
- * @return err_t
+ * @param cb corsacOTA cotrol block pointer
  */
-static err_t co_socket_list_insert(co_cb_t *cb, int fd) {
+static void co_socket_list_init(co_cb_t *cb) {
     int i;
     for (i = 0; i < cb->max_listen_num; i++) {
-        if (cb->socket_list[i]->fd == -1) {
-            cb->socket_list[i]->fd = fd;
-            return ESP_OK;
-        }
+        cb->socket_list[i]->fd = -1;
+        cb->socket_list[i]->status = CO_SOCKET_ACCEPT;
+        cb->socket_list[i]->timer.owner = cb->socket_list[i];
+        // the first block of the list is taken first
+        cb->free_list[i] = cb->socket_list[cb->max_listen_num - 1 - i];
     }
-
-    return ESP_FAIL;
+    cb->free_num = cb->max_listen_num;
 }
 
+static void co_free_all(co_cb_t *cb);
+
 /**
- * @brief Iterate to get each socket control blck in socket list
+ * @brief Allocate the buffers of every session at init (static buffers)
  *
- * @param cb corsacOTA control block
- * @param begin The fd obtained in the previous iteration. Should be `NULL` for the initial iteration.
- * @param ignore_closing If true, all fd's that are closing will be ignored.
- * @return int The current socket control block obtained by the iterator, or `NULL` for not found.
+ * The websocket gets its socket buffer from a pool of one. A session takes the sector buffers of the flash writer, which
+ * waits parked between two sessions, or a sector buffer from a pool. A resumed session reads the partition back
+ * into another sector buffer of the pool.
  */
-static co_socket_cb_t *co_socket_list_iterate(co_cb_t *cb, co_socket_cb_t *begin, bool ignore_closing) {
-    int start_index = 0;
-    int i;
+static esp_err_t co_static_buffers_alloc(co_cb_t *cb) {
+    int sector_num = 0;
 
-    if (begin != NULL) {
-        for (i = 0; i < cb->max_listen_num; i++) {
-            if (cb->socket_list[i] == begin) {
-                start_index = i + 1;
-                break;
-            }
-        }
+    // only the websocket being served has a buffer
+    if (co_pool_init(&cb->socket_pool, cb->socket_buffer_size + 1, 1) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
     }
 
-    for (i = start_index; i < cb->max_listen_num; i++) {
-        if (cb->socket_list[i]->fd != -1) {
-            if (ignore_closing && cb->socket_list[i]->status == CO_SOCKET_CLOSING) {
-                continue;
-            }
-            return cb->socket_list[i];
+    if (cb->flash_queue_depth > 0) {
+        cb->flash_pipe = co_flash_pipe_create(cb, NULL, cb->flash_queue_depth);
+        if (cb->flash_pipe == NULL) {
+            return ESP_ERR_NO_MEM;
         }
+    } else {
+        sector_num++;
     }
-
-    return NULL;
-}
-
-/**
- * @brief Invalidate all sockets in the list in the accept stage
- *
- * @param cb corsacOTA cotrol block pointer
- */
-static void co_socket_list_init(co_cb_t *cb) {
-    int i;
-    for (i = 0; i < cb->max_listen_num; i++) {
-        cb->socket_list[i]->fd = -1;
-        cb->socket_list[i]->status = CO_SOCKET_ACCEPT;
+    if (cb->checkpoint_size > 0) {
+        sector_num++;
+    }
+    if (co_pool_init(&cb->sector_pool, CO_FLASH_SECTOR_SIZE, sector_num) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
     }
+
+    return co_socket_map_grow(cb, CONFIG_CO_FD_MAP_SIZE - 1);
 }
 
 static co_cb_t *co_control_block_create(co_config_t *config) {
-    co_cb_t *cb = calloc(1, sizeof(co_cb_t));
+    co_ota_session_t session;
+    co_cb_t *cb = co_calloc(1, sizeof(co_cb_t));
     if (cb == NULL) {
         return NULL;
     }
 
-    cb->recv_data = malloc(CONFIG_CO_WS_TEXT_BUFFER_SIZE + 1);
-    if (cb->recv_data == NULL) {
-        free(cb);
+    // sizes, 0 for the default
+    cb->socket_buffer_size = config->socket_buffer_size > 0 ? config->socket_buffer_size : CONFIG_CO_SOCKET_BUFFER_SIZE;
+    cb->text_buffer_size = config->text_buffer_size > 0 ? config->text_buffer_size : CONFIG_CO_WS_TEXT_BUFFER_SIZE;
+    cb->ack_chunk_size = config->ack_chunk_size > 0 ? config->ack_chunk_size : CONFIG_CO_ACK_CHUNK_SIZE;
+    cb->window_max_size = config->window_max_size > 0 ? config->window_max_size : CONFIG_CO_WINDOW_MAX_SIZE;
+    cb->recv_size = cb->socket_buffer_size;
+    cb->low_memory_threshold = config->low_memory_threshold;
+
+    cb->recv_data = co_malloc(cb->text_buffer_size + 1);
+    cb->http_arena = co_malloc(CONFIG_CO_HTTP_ARENA_SIZE);
+    if (cb->recv_data == NULL || cb->http_arena == NULL) {
+        co_free(cb->http_arena);
+        co_free(cb->recv_data);
+        co_free(cb);
         return NULL;
     }
 
@@ -1451,6 +4648,64 @@ static co_cb_t *co_control_block_create(co_config_t *config) {
     cb->max_listen_num = config->max_listen_num;
     cb->wait_timeout_sec = config->wait_timeout_sec;
     cb->wait_timeout_usec = config->wait_timeout_usec;
+    cb->idle_timeout_ms = cb->wait_timeout_sec * 1000 + cb->wait_timeout_usec / 1000;
+    cb->timers.tick = (uint32_t)(co_time_ms() / CONFIG_CO_TIMER_TICK_MS);
+
+    cb->staging = config->staging;
+    if (cb->staging && !CO_STAGING_SUPPORTED) {
+        ESP_LOGW(CO_TAG, "no external RAM, the image is never staged");
+    }
+
+    cb->flash_queue_depth = config->flash_queue_depth;
+    cb->flash_writer_prio = config->flash_writer_prio;
+    cb->flash_writer_core = config->flash_writer_core;
+    if (cb->flash_queue_depth == 1) {
+        cb->flash_queue_depth = 2; // at least one block is filled while another one is written
+    }
+
+    if (config->sign_public_key != NULL) {
+        cb->sign_key = co_malloc(sizeof(mbedtls_pk_context));
+        if (cb->sign_key == NULL) {
+            co_free(cb->http_arena);
+            co_free(cb->recv_data);
+            co_free(cb);
+            return NULL;
+        }
+        mbedtls_pk_init(cb->sign_key);
+        if (mbedtls_pk_parse_public_key(cb->sign_key, (const unsigned char *)config->sign_public_key,
+                                        strlen(config->sign_public_key) + 1) != 0) {
+            ESP_LOGE(CO_TAG, "invalid public key");
+            mbedtls_pk_free(cb->sign_key);
+            co_free(cb->sign_key);
+            co_free(cb->http_arena);
+            co_free(cb->recv_data);
+            co_free(cb);
+            return NULL;
+        }
+    }
+
+    if (config->resume_checkpoint_size > 0) {
+        cb->checkpoint_size = (config->resume_checkpoint_size + CO_FLASH_SECTOR_SIZE - 1) / CO_FLASH_SECTOR_SIZE * CO_FLASH_SECTOR_SIZE;
+    }
+
+    cb->capture = config->capture;
+    cb->capture_arg = config->capture_arg;
+
+    // the partition must not be erased before it is compared
+    cb->skip_unchanged = config->skip_unchanged;
+    if (config->pre_erase && !cb->skip_unchanged) {
+        cb->idle_flash.ptn = esp_ota_get_next_update_partition(NULL);
+        if (cb->idle_flash.ptn != NULL) {
+            cb->idle_flash.erase_limit = cb->idle_flash.ptn->size;
+        }
+
+        // do not erase the firmware of a session that can be resumed
+        if (cb->idle_flash.ptn != NULL && cb->checkpoint_size > 0 && co_session_load(&session) == ESP_OK &&
+            session.ptn_address == cb->idle_flash.ptn->address) {
+            cb->idle_erase_start = (session.offset + CO_FLASH_SECTOR_SIZE - 1) / CO_FLASH_SECTOR_SIZE * CO_FLASH_SECTOR_SIZE;
+            cb->idle_flash.erased = cb->idle_erase_start;
+        }
+    }
 
     cb->listen_fd = -1;
     cb->websocket_fd = -1;
@@ -1458,7 +4713,14 @@ static co_cb_t *co_control_block_create(co_config_t *config) {
     cb->recv_data_offset = 0;
 
     if (co_socket_list_alloc(cb) != ESP_OK) {
-        free(cb);
+        co_free_all(cb);
+        return NULL;
+    }
+
+    cb->static_buffers = config->static_buffers;
+    if (cb->static_buffers && co_static_buffers_alloc(cb) != ESP_OK) {
+        ESP_LOGE(CO_TAG, "can not allocate the static buffers");
+        co_free_all(cb);
         return NULL;
     }
     return cb;
@@ -1476,33 +4738,41 @@ static void co_free_all(co_cb_t *cb) {
                 if (cb->socket_list[i]->fd != -1) {
                     close(cb->socket_list[i]->fd);
                 }
-                free(cb->socket_list[i]->buf);
+                co_pool_put(&cb->socket_pool, cb->socket_list[i]->buf);
             }
-            free(cb->socket_list[i]);
+            co_free(cb->socket_list[i]);
         }
-        free(cb->socket_list);
+        co_free(cb->socket_list);
     }
+    co_free(cb->free_list);
+    co_free(cb->fd_map);
 
     if (cb->listen_fd != -1) {
         close(cb->listen_fd);
     }
+    co_event_deinit(cb);
 
-    free(cb->recv_data);
+    if (cb->flash_pipe != NULL) {
+        co_flash_pipe_destroy(cb->flash_pipe); // also the pipe of the current session
+    } else if (cb->ota.pipe != NULL) {
+        co_flash_pipe_destroy(cb->ota.pipe);
+    } else {
+        co_pool_put(&cb->sector_pool, cb->ota.sector_buf);
+    }
+    mbedtls_sha256_free(&cb->ota.sha256);
+    co_pool_deinit(&cb->socket_pool);
+    co_pool_deinit(&cb->sector_pool);
 
-    free(cb);
-    global_cb = NULL;
-}
+    if (cb->sign_key != NULL) {
+        mbedtls_pk_free(cb->sign_key);
+        co_free(cb->sign_key);
+    }
 
-/**
- * @brief free the specified socket control block
- *
- * @param scb Socket control block included in cb
- */
-static void co_socket_buf_free(co_socket_cb_t *scb) {
-    free(scb->buf);
-    scb->buf = NULL;
-    scb->remaining_len = 0;
-    scb->read_len = 0;
+    co_free(cb->recv_data);
+    co_free(cb->http_arena);
+
+    co_free(cb);
+    global_cb = NULL;
 }
 
 static int co_socket_init(co_cb_t *cb, co_config_t *config) {
@@ -1516,6 +4786,12 @@ static int co_socket_init(co_cb_t *cb, co_config_t *config) {
         return ESP_FAIL;
     }
 
+#if (CO_TARGET_LINUX)
+    // the restarted process binds the port again while the old connections are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif // CO_TARGET_LINUX
+
 #if (defined CONFIG_LWIP_IPV6) && (CONFIG_LWIP_IPV6 == 1)
     struct in6_addr inaddr_any = IN6ADDR_ANY_INIT;
     struct sockaddr_in6 serv_addr = {
@@ -1545,74 +4821,125 @@ static int co_socket_init(co_cb_t *cb, co_config_t *config) {
         return ESP_FAIL;
     }
 
+    // accept until the backlog is empty
+    co_socket_set_non_block(fd);
+
     cb->listen_fd = fd;
-    return ESP_OK;
+    return co_event_add(cb, fd, NULL);
 }
 
 /**
- * @brief Accept a new connection, set the timeout, insert it into socket list,
- *        allocate the memory needed for the connection
+ * @brief Set the timeout of a new connection, insert it into socket list
  * @param cb corsacOTA control block
+ * @param new_fd the accepted socket, closed on failure
  * @return esp_err_t
- * - ESP_OK accept successfully
+ * - ESP_OK success
  */
-static esp_err_t co_socket_accept(co_cb_t *cb) {
-    struct sockaddr_in addr_from;
-    socklen_t addr_from_len = sizeof(addr_from);
-    int new_fd = accept(cb->listen_fd, (struct sockaddr *)&addr_from, &addr_from_len);
-    if (new_fd < 0) {
-        ESP_LOGW(CO_TAG, LOG_FMT("error in accept (%d)"), errno);
-        return ESP_FAIL;
-    }
-
+static esp_err_t co_socket_open(co_cb_t *cb, int new_fd) {
     struct timeval tv;
     // set recv timrout
-    tv.tv_sec = cb->wait_timeout_usec;
+    tv.tv_sec = cb->wait_timeout_sec;
     tv.tv_usec = cb->wait_timeout_usec;
     setsockopt(new_fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof(tv));
 
     // set send timeout
-    tv.tv_sec = cb->wait_timeout_usec;
+    tv.tv_sec = cb->wait_timeout_sec;
     tv.tv_usec = cb->wait_timeout_usec;
     setsockopt(new_fd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof(tv));
 
-    // try to add to the socket list
-    if (co_socket_list_insert(cb, new_fd) != ESP_OK) {
+    // the acks are small writes, Nagle would hold one back until the previous one is acknowledged
+    int nodelay = 1;
+    setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (cb->free_num == 0) {
         ESP_LOGW(CO_TAG, LOG_FMT("Unable to add to socket list"));
         close(new_fd);
         return ESP_FAIL;
     }
+    co_socket_cb_t *scb = cb->free_list[cb->free_num - 1];
 
-    // create new buffer
-    int i;
-    co_socket_cb_t *scb = NULL;
-    for (i = 0; i < cb->max_listen_num; i++) { // find the corresponding SCB
-        if (cb->socket_list[i]->fd == new_fd) {
-            scb = cb->socket_list[i];
-            break;
-        }
-    }
-    assert(scb != NULL);
-    scb->buf = malloc(CONFIG_CO_SOCKET_BUFFER_SIZE + 1);
+    // the buffer is allocated on the first read of the websocket
+    scb->buf = NULL;
     scb->remaining_len = 0;
-    if (scb->buf == NULL) {
+    scb->read_offset = 0;
+    scb->read_len = 0;
+
+    scb->fd = new_fd;
+    if (co_socket_map_set(cb, new_fd, scb) != ESP_OK || co_event_add(cb, new_fd, scb) != ESP_OK) {
+        co_socket_map_set(cb, new_fd, NULL);
+        co_socket_buf_free(cb, scb);
+        scb->fd = -1;
         close(new_fd);
-        return ESP_ERR_NO_MEM;
+        return ESP_FAIL;
     }
+    cb->free_num--;
 
     scb->status = CO_SOCKET_HANDSHAKE;
+    co_http_parser_init(&scb->http);
+    scb->active_ms = co_time_ms();
+    co_timer_add(&cb->timers, &scb->timer, CONFIG_CO_HANDSHAKE_TIMEOUT_MS);
 
     return ESP_OK;
 }
 
-static void co_socket_set_non_block(int fd) {
-    int flag;
-    if ((flag = fcntl(fd, F_GETFL, 0)) < 0) {
-        return;
+/**
+ * @brief Accept all the pending connections
+ *
+ * @param cb corsacOTA control block
+ * @return esp_err_t
+ * - ESP_OK the backlog is empty
+ */
+static esp_err_t co_socket_accept(co_cb_t *cb) {
+    struct sockaddr_in addr_from;
+    socklen_t addr_from_len;
+    esp_err_t err = ESP_OK;
+    int new_fd;
+
+    while (1) {
+        addr_from_len = sizeof(addr_from);
+        new_fd = accept(cb->listen_fd, (struct sockaddr *)&addr_from, &addr_from_len);
+        if (new_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return err;
+            }
+            ESP_LOGW(CO_TAG, LOG_FMT("error in accept (%d)"), errno);
+            return ESP_FAIL;
+        }
+
+        if (cb->capture != NULL) {
+            cb->capture(cb->capture_arg, new_fd, CO_CAPTURE_ACCEPT, NULL, 0);
+        }
+
+        // the connections after a failed one may still fit
+        if (co_socket_open(cb, new_fd) != ESP_OK) {
+            err = ESP_FAIL;
+        }
     }
+}
 
-    flag |= O_NONBLOCK;
-    fcntl(fd, F_SETFL, flag);
+/**
+ * @brief Remove a connection from the event loop, close it and put its control block back to the free list
+ *
+ * @param cb corsacOTA control block
+ * @param scb corsacOTA socket control block
+ */
+static void co_socket_release(co_cb_t *cb, co_socket_cb_t *scb) {
+    co_timer_del(&cb->timers, &scb->timer);
+    co_event_del(cb, scb);
+    co_socket_map_set(cb, scb->fd, NULL);
+    close(scb->fd);
+    co_socket_buf_free(cb, scb);
+
+    if (scb->status == CO_SOCKET_CLOSING) {
+        cb->closing_num--;
+    }
+    if (cb->websocket == scb) {
+        cb->websocket = NULL;
+    }
+
+    scb->status = CO_SOCKET_ACCEPT;
+    scb->fd = -1;
+    cb->free_list[cb->free_num++] = scb;
 }
 
 /**
@@ -1630,114 +4957,196 @@ static void co_socket_close(co_cb_t *cb, co_socket_cb_t *scb) {
     }
 
     co_socket_set_non_block(scb->fd);
-    shutdown(scb->fd, SHUT_WR); // wait client to close socket
-}
+    co_event_set_read(cb, scb, true); // the close of the client is read by co_socket_close_cleanup
+    shutdown(scb->fd, SHUT_WR);       // wait client to close socket
+    co_socket_buf_free(cb, scb);      // what is still received is discarded
 
-static void co_socket_close_cleanup(co_cb_t *cb) {
-    int ret;
-    co_socket_cb_t *iter;
-
-    iter = NULL;
-
-    while ((iter = co_socket_list_iterate(cb, iter, false)) != NULL) {
-        if (iter->status != CO_SOCKET_CLOSING) {
-            continue;
-        }
+    // a client that never closes its side is dropped
+    co_timer_add(&cb->timers, &scb->timer, CONFIG_CO_CLOSE_LINGER_MS);
+}
 
-        ret = recv(iter->fd, iter->buf, CONFIG_CO_SOCKET_BUFFER_SIZE, 0);
-        if (ret == 0 || errno == ENOTCONN) { // client gracefully closed connection
-            close(iter->fd);
-            co_socket_buf_free(iter);
+/**
+ * @brief Read a closing socket, it is released when the client has closed its side
+ *
+ * @param cb corsacOTA control block
+ * @param scb corsacOTA socket control block, in the closing state
+ */
+static void co_socket_close_cleanup(co_cb_t *cb, co_socket_cb_t *scb) {
+    int ret = co_socket_recv(cb, scb->fd, cb->http_arena, CONFIG_CO_HTTP_ARENA_SIZE);
+    if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) { // client closed connection
+        co_socket_release(cb, scb);
+    }
+}
 
-            iter->status = CO_SOCKET_ACCEPT;
-            iter->fd = -1;
+/**
+ * @brief A connection reached its deadline
+ *
+ * @param cb corsacOTA control block
+ * @param scb corsacOTA socket control block
+ */
+static void co_socket_timeout(co_cb_t *cb, co_socket_cb_t *scb) {
+    int64_t idle_ms;
 
-            cb->closing_num--;
+    switch (scb->status) {
+    case CO_SOCKET_HANDSHAKE:
+        ESP_LOGW(CO_TAG, LOG_FMT("handshake timeout (fd %d)"), scb->fd);
+        co_socket_close(cb, scb);
+        break;
+    case CO_SOCKET_CLOSING:
+        // the client did not close its side in time
+        co_socket_release(cb, scb);
+        break;
+    case CO_SOCKET_WEBSOCKET_HEADER:
+    case CO_SOCKET_WEBSOCKET_EXTEND_LENGTH:
+    case CO_SOCKET_WEBSOCKET_MASK:
+    case CO_SOCKET_WEBSOCKET_PAYLOAD:
+        // the timer is not moved on each read, the last read time is checked when it expires
+        idle_ms = co_time_ms() - scb->active_ms;
+        if (scb->read_paused) {
+            // not read because of the flash writer, the client is not idle
+            co_timer_add(&cb->timers, &scb->timer, cb->idle_timeout_ms);
+        } else if (idle_ms < cb->idle_timeout_ms) {
+            co_timer_add(&cb->timers, &scb->timer, cb->idle_timeout_ms - (int)idle_ms);
+        } else {
+            ESP_LOGW(CO_TAG, LOG_FMT("idle timeout (fd %d)"), scb->fd);
+            co_socket_close(cb, scb);
         }
+        break;
+    default:
+        break;
     }
 }
 
 /**
- * @brief Set and find the largest fd in socket list only
+ * @brief Run the timers that have expired, each slot since the last run is visited once
  *
+ * @param cb corsacOTA control block
  */
-static int co_select_update_maxfd(co_cb_t *cb, fd_set *fdset) {
-    int i;
-    int maxfd = -1;
-    for (i = 0; i < cb->max_listen_num; i++) {
-        if (cb->socket_list[i] != NULL && cb->socket_list[i]->fd != -1) {
-            FD_SET(cb->socket_list[i]->fd, fdset);
-            maxfd = MAX(maxfd, cb->socket_list[i]->fd);
-        }
+static void co_timer_run(co_cb_t *cb) {
+    co_timer_wheel_t *wheel = &cb->timers;
+    co_timer_t *timer, *next;
+    uint32_t now, n, i;
+
+    now = (uint32_t)(co_time_ms() / CONFIG_CO_TIMER_TICK_MS);
+    if ((int32_t)(now - wheel->tick) < 0) {
+        return;
     }
-    return maxfd;
-}
 
-static int co_select_fd_is_valid(int fd) {
-    return fcntl(fd, F_GETFD, 0) != -1 || errno != EBADF;
-}
+    // after a long stall one turn visits every slot
+    n = now - wheel->tick + 1;
+    if (wheel->num == 0) {
+        n = 0;
+    } else if (n > CO_TIMER_WHEEL_SIZE) {
+        n = CO_TIMER_WHEEL_SIZE;
+    }
 
-static void co_select_clean_invalid(co_cb_t *cb) {
-    int i;
-    for (i = 0; i < cb->max_listen_num; i++) {
-        if (cb->socket_list[i] != NULL && cb->socket_list[i]->fd != -1 &&
-            !co_select_fd_is_valid(cb->socket_list[i]->fd)) {
-            co_socket_buf_free(cb->socket_list[i]);
+    for (i = 0; i < n; i++) {
+        // a timer rearmed by co_socket_timeout goes to the head of a slot and is not visited again
+        for (timer = wheel->slots[(wheel->tick + i) & (CO_TIMER_WHEEL_SIZE - 1)]; timer != NULL; timer = next) {
+            next = timer->next;
+            if ((int32_t)(timer->expire_tick - now) <= 0) {
+                co_timer_del(wheel, timer);
+                co_socket_timeout(cb, timer->owner);
+            }
         }
     }
+    wheel->tick = now + 1;
 }
 
 /**
- * @brief The select function will be processed here.
+ * @brief The event loop will be processed here.
  *
  * @param cb corsacOTA control block
  * @return esp_err_t
  * - ESP_OK success
  * - others: need to close server.
  */
-static esp_err_t co_select_process(co_cb_t *cb) {
-    fd_set read_set;
-    FD_ZERO(&read_set);
-    FD_SET(cb->listen_fd, &read_set);
+static esp_err_t co_event_process(co_cb_t *cb) {
+    co_memory_check(cb);
 
-    int maxfd = co_select_update_maxfd(cb, &read_set);
-    maxfd = MAX(maxfd, cb->listen_fd);
+    // backpressure: stop reading the websocket until the flash writer frees a block
+    bool is_paused = cb->websocket != NULL && co_ota_is_paused(cb);
+    if (cb->websocket != NULL) {
+        co_event_set_read(cb, cb->websocket, !is_paused);
+    }
 
-    struct timeval tv;
-    // Set recv timeout of this fd as per config
-    tv.tv_sec = cb->wait_timeout_sec;
-    tv.tv_usec = cb->wait_timeout_usec;
+    // the next deadline of a connection, or forever
+    int timeout_ms = co_timer_next_ms(&cb->timers);
+    bool is_busy = is_paused || co_ota_is_busy(cb);
+    co_flash_t *idle_flash = co_ota_idle_flash(cb);
+    if (idle_flash != NULL) {
+        // just check the sockets, the idle time is used to erase flash
+        timeout_ms = CONFIG_CO_IDLE_ERASE_INTERVAL_MS;
+    } else if (is_busy && (timeout_ms < 0 || timeout_ms > CONFIG_CO_FLASH_POLL_INTERVAL_MS)) {
+        // come back soon to check the flash writer
+        timeout_ms = CONFIG_CO_FLASH_POLL_INTERVAL_MS;
+    } else if (cb->low_memory_threshold > 0 && cb->ota.status == CO_OTA_LOAD &&
+               (timeout_ms < 0 || timeout_ms > CONFIG_CO_MEMORY_CHECK_INTERVAL_MS)) {
+        // the heap is watched during the upload, also while the client waits for a window
+        timeout_ms = CONFIG_CO_MEMORY_CHECK_INTERVAL_MS;
+    } else if (cb->ota.status != CO_OTA_LOAD && !cb->app_confirmed && co_flash_can_erase_ahead(&cb->idle_flash) &&
+               (timeout_ms < 0 || timeout_ms > CONFIG_CO_ROLLBACK_CHECK_INTERVAL_MS)) {
+        // pre-erase waits for the running app to be confirmed
+        timeout_ms = CONFIG_CO_ROLLBACK_CHECK_INTERVAL_MS;
+    }
 
-    int ret = select(maxfd + 1, &read_set, NULL, NULL, &tv);
+    int ret = co_event_wait(cb, timeout_ms);
     if (ret < 0) {
-        ESP_LOGE(CO_TAG, LOG_FMT("error in select (%d)"), errno);
-        co_select_clean_invalid(cb);
+        ESP_LOGE(CO_TAG, LOG_FMT("error in event wait (%d)"), errno);
         return ESP_OK;
     } else if (ret == 0) {
-        return ESP_ERR_TIMEOUT;
+        if (idle_flash != NULL) {
+            co_ota_idle_erase(cb, idle_flash);
+        } else if (is_busy) {
+            co_ota_poll(cb);
+        }
+        co_timer_run(cb);
+        return ESP_OK;
     }
 
-    // 1. Find out if there is any data available on the socket list
-    co_socket_cb_t *iter = NULL;
-    while ((iter = co_socket_list_iterate(cb, iter, true)) != NULL) {
-        if (FD_ISSET(iter->fd, &read_set)) {
-            if (co_socket_data_process(cb, iter) != ESP_OK) {
-                co_socket_close(cb, iter);
+    // 1. Process the connections that have data available
+    int64_t now_ms = co_time_ms();
+    bool accept_ready = false;
+    int i;
+    for (i = 0; i < cb->event.ready_num; i++) {
+        co_event_ready_t *ready = &cb->event.ready[i];
+        if (ready->fd == cb->listen_fd) {
+            accept_ready = true;
+            continue;
+        }
+        if (ready->fd == cb->event.wake_fd) {
+            co_event_wake_drain(cb); // co_ota_poll below
+            continue;
+        }
+
+        co_socket_cb_t *scb = co_socket_find(cb, ready->fd);
+        if (scb == NULL) {
+            continue;
+        }
+        if (ready->invalid) {
+            co_socket_release(cb, scb);
+        } else if (scb->status == CO_SOCKET_CLOSING) {
+            co_socket_close_cleanup(cb, scb);
+        } else {
+            scb->active_ms = now_ms;
+            if (co_socket_data_process(cb, scb) != ESP_OK) {
+                co_socket_close(cb, scb);
             }
         }
     }
 
     // 2. There are new connections waiting to be accepted
-    if (FD_ISSET(cb->listen_fd, &read_set)) {
+    if (accept_ready) {
         if (co_socket_accept(cb) != ESP_OK) {
             ESP_LOGW(CO_TAG, LOG_FMT("can not accept a new connnection"));
         }
     }
 
-    // 3. clean up
-    if (cb->closing_num > 0) {
-        co_socket_close_cleanup(cb);
-    }
+    // 3. deadlines of the connections
+    co_timer_run(cb);
+
+    // 4. flash writer progress
+    co_ota_poll(cb);
 
     // TODO: control port?
 
@@ -1750,7 +5159,7 @@ static void co_main_thread(void *pvParameter) {
 
     do {
         ;
-    } while (co_select_process(global_cb) == ESP_OK);
+    } while (co_event_process(global_cb) == ESP_OK);
 
     co_free_all(global_cb);
     vTaskDelete(NULL);
@@ -1766,11 +5175,55 @@ static inline int co_thread_create(co_config_t *config) {
     return ESP_FAIL;
 }
 
+/**
+ * @brief Check the sizes of the configuration, 0 selects the default of the target
+ *
+ */
+static esp_err_t co_config_check(const co_config_t *config) {
+    if (config->socket_buffer_size != 0 &&
+        (config->socket_buffer_size < CO_SOCKET_BUFFER_MIN_SIZE || config->socket_buffer_size > CO_SOCKET_BUFFER_MAX_SIZE)) {
+        ESP_LOGE(CO_TAG, "socket_buffer_size must be 0 or between %d and %d", CO_SOCKET_BUFFER_MIN_SIZE, CO_SOCKET_BUFFER_MAX_SIZE);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (config->text_buffer_size != 0 &&
+        (config->text_buffer_size < CO_WS_TEXT_BUFFER_MIN_SIZE || config->text_buffer_size > CO_WS_TEXT_BUFFER_MAX_SIZE)) {
+        ESP_LOGE(CO_TAG, "text_buffer_size must be 0 or between %d and %d", CO_WS_TEXT_BUFFER_MIN_SIZE, CO_WS_TEXT_BUFFER_MAX_SIZE);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (config->ack_chunk_size < 0) {
+        ESP_LOGE(CO_TAG, "ack_chunk_size must not be negative");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (config->window_max_size != 0 && config->window_max_size < CO_WINDOW_MIN_SIZE) {
+        ESP_LOGE(CO_TAG, "window_max_size must be 0 or at least %d", CO_WINDOW_MIN_SIZE);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (config->low_memory_threshold < 0) {
+        ESP_LOGE(CO_TAG, "low_memory_threshold must not be negative");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (config->staging && config->static_buffers) {
+        ESP_LOGE(CO_TAG, "staging allocates the image of each session, it can not be used with static_buffers");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return ESP_OK;
+}
+
 int corsacOTA_init(co_handle_t *handle, co_config_t *config) {
     if (handle == NULL || config == NULL) {
         return ESP_ERR_INVALID_ARG;
     }
 
+    if (co_config_check(config) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
     if (global_cb != NULL) {
         ESP_LOGE(CO_TAG, "already init");
         return ESP_FAIL;
@@ -1798,3 +5251,8 @@ int corsacOTA_init(co_handle_t *handle, co_config_t *config) {
     *handle = (co_handle_t *)cb;
     return ESP_OK;
 }
+
+void corsacOTA_get_alloc_stats(co_alloc_stats_t *stats) {
+    *stats = co_alloc.stats;
+    stats->session_alloc_num = co_alloc.session ? co_alloc.stats.alloc_num + co_alloc.stats.free_num - co_alloc.session_mark : 0;
+}
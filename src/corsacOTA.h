@@ -48,6 +48,17 @@ typedef signed int co_err_t;
  */
 typedef void *co_handle_t;
 
+typedef enum co_capture_event {
+    CO_CAPTURE_ACCEPT, // a connection is accepted on fd
+    CO_CAPTURE_RECV,   // recv() on fd returned len, data holds the bytes received when len > 0
+} co_capture_event_t;
+
+/**
+ * @brief Capture callback, called in the corsacOTA thread right after the socket call (errno is still valid).
+ *
+ */
+typedef void (*co_capture_cb_t)(void *arg, int fd, co_capture_event_t event, const void *data, int len);
+
 typedef struct co_config {
     char *thread_name; // corsacOTA thread name
     int stack_size;    // corsacOTA thread stack size
@@ -56,22 +67,68 @@ typedef struct co_config {
     int listen_port;    // corsacOTA server listen port
     int max_listen_num; // Maximum number of connections. In fact, after the handshake is complete, there is only one connection to provide services.
 
-    int wait_timeout_sec; // Timeout (in seconds)
-    int wait_timeout_usec; // Timeout (in microseconds)
+    int wait_timeout_sec; // Idle timeout (in seconds): the websocket is closed after this time without data, it is also the socket send/recv timeout. 0 with wait_timeout_usec 0: never
+    int wait_timeout_usec; // Idle timeout (in microseconds)
+
+    int flash_queue_depth; // Number of flash sector buffers handed to a dedicated flash writer thread. 0: write flash in the corsacOTA thread
+    int flash_writer_prio; // Flash writer thread priority
+    int flash_writer_core; // Core the flash writer thread is pinned to (dual core esp32 only). Negative value: no affinity
+
+    int pre_erase; // Erase the inactive OTA partition while the server is idle, once the running app is confirmed (app rollback)
+
+    int resume_checkpoint_size; // Bytes written between two checkpoints of the session saved in NVS, rounded up to the flash sector size. 0: resume disabled
+
+    const char *sign_public_key; // PEM public key verifying the signature ("sig") of the firmware hash given at start. NULL: no signature required
+
+    int skip_unchanged; // Compare each flash sector with the update partition, unchanged sectors are neither erased nor written. Disables pre_erase
+
+    co_capture_cb_t capture; // Record every accept and recv() result of a session, e.g. for the replay tool of port/linux. NULL: no capture
+    void *capture_arg;       // Argument of capture
+
+    int socket_buffer_size; // Receive buffer of the websocket, one recv() drains up to this size. 256 to 65536, 0: target default (1460 on esp8266, 16384 with PSRAM, else 5744)
+    int text_buffer_size;   // Longest text request. 128 to 4096, 0: 512
+    int ack_chunk_size;     // Largest number of bytes between two acknowledgements (without window mode). 0: 10KB
+    int window_max_size;    // Largest window granted to the client (window mode). At least 1024, 0: 64KB
+
+    int static_buffers; // Allocate every buffer at init: one socket buffer for the websocket being served (the handshakes share a small receive buffer), the flash sector buffers and the flash writer thread are kept across sessions. An OTA session then makes no heap allocation
+
+    int staging; // Receive the whole image into external RAM (PSRAM) when it has room for it, at network speed and without waiting for the flash. The image is verified, the client gets the "done" reply, then the image is written to flash in 64KB bursts. Not with static_buffers
+    int low_memory_threshold; // Free internal heap (bytes) below which the receive buffer, the window credit and the flash blocks of a new session shrink. They grow back when the free heap is 25% above it. 0: the heap is not watched
 
 } co_config_t;
 
+/**
+ * @brief Heap usage of corsacOTA, see corsacOTA_get_alloc_stats
+ *
+ */
+typedef struct co_alloc_stats {
+    unsigned int alloc_num;         // heap allocations (malloc, calloc and realloc) made by corsacOTA
+    unsigned int free_num;          // heap buffers released by corsacOTA
+    unsigned int pool_num;          // buffers taken from the static buffer pools
+    unsigned int pool_empty_num;    // a pool had no buffer left
+    unsigned int session_alloc_num; // heap allocations and releases since the last OTA session started, its own buffers included
+} co_alloc_stats_t;
+
 /**
  * @brief Start the corsacOTA server
  *
  * @param config Configuration for new instance of the server
  * @return
  *  - ESP_OK                   : Server Init successfully
- *  - ESP_ERR_INVALID_ARG      : Null argument
+ *  - ESP_ERR_INVALID_ARG      : Null argument or invalid size
  *  - ESP_ERR_NO_MEM           : Failed to allocate memory for instance
  */
 int corsacOTA_init(co_handle_t *handle, co_config_t *config);
 
+/**
+ * @brief Get the heap usage counters of corsacOTA. With static_buffers, session_alloc_num stays 0 during a session.
+ *
+ * The allocations made inside mbedtls and FreeRTOS are not counted.
+ *
+ * @param stats filled with the counters
+ */
+void corsacOTA_get_alloc_stats(co_alloc_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+"""
+Create a corsacOTA delta patch.
+
+The device rebuilds the new firmware from the firmware it is running and the patch,
+so only the changed bytes are uploaded:
+
+    python co_patch.py running.bin new.bin new.patch
+
+Then start the upload with "op=start&data=<patch size>&patch=<new.bin size>" and send new.patch.
+
+Patch format: the magic "COD1" followed by records, each one is an op byte and a LEB128 argument.
+  COPY n   (1): copy n bytes of the running firmware
+  ADD n    (2): n bytes follow, each one is added to the next byte of the running firmware
+  INSERT n (3): n bytes follow, they are copied to the new firmware
+  SEEK d   (4): move the read position of the running firmware by d (zigzag encoded)
+"""
+
+import sys
+
+MAGIC = b"COD1"
+OP_COPY, OP_ADD, OP_INSERT, OP_SEEK = 1, 2, 3, 4
+
+BLOCK = 16      # minimum length of a match
+STEP = 4        # the running firmware is indexed every STEP bytes
+MIN_ZERO_RUN = 4  # an unchanged run shorter than this is sent as part of an ADD
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        b = n & 0x7F
+        n >>= 7
+        if n:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def zigzag(n):
+    return n << 1 if n >= 0 else ((-n) << 1) - 1
+
+
+class PatchWriter:
+    def __init__(self):
+        self.out = bytearray(MAGIC)
+        self.old_pos = 0
+
+    def record(self, op, arg, data=b""):
+        self.out.append(op)
+        self.out += varint(arg)
+        self.out += data
+
+    def seek(self, pos):
+        if pos != self.old_pos:
+            self.record(OP_SEEK, zigzag(pos - self.old_pos))
+            self.old_pos = pos
+
+    def insert(self, data):
+        if data:
+            self.record(OP_INSERT, len(data), data)
+
+    def diff(self, old, new):
+        """new is built from the running firmware at old_pos: unchanged runs are copied, the rest is added."""
+        delta = bytes((n - o) & 0xFF for o, n in zip(old, new))
+        i = 0
+        while i < len(delta):
+            j = i
+            while j < len(delta) and delta[j] == 0:
+                j += 1
+            if j - i >= MIN_ZERO_RUN or j == len(delta):
+                if j > i:
+                    self.record(OP_COPY, j - i)
+                i = j
+                continue
+
+            # find the end of the changed run: the next long enough unchanged run
+            k = i
+            while k < len(delta):
+                if delta[k] != 0:
+                    k += 1
+                    continue
+                z = k
+                while z < len(delta) and delta[z] == 0:
+                    z += 1
+                if z - k >= MIN_ZERO_RUN or z == len(delta):
+                    break
+                k = z
+            self.record(OP_ADD, k - i, delta[i:k])
+            i = k
+        self.old_pos += len(old)
+
+
+def similar(a, b):
+    if not a:
+        return False
+    same = sum(1 for x, y in zip(a, b) if x == y)
+    return same * 2 >= len(a)
+
+
+def create_patch(old, new):
+    index = {}
+    for i in range(0, len(old) - BLOCK + 1, STEP):
+        index.setdefault(old[i:i + BLOCK], i)
+
+    w = PatchWriter()
+    gap_start = 0  # new[gap_start:j] has no match yet
+    j = 0
+    while j + BLOCK <= len(new):
+        # prefer to continue where the running firmware is read
+        pos = w.old_pos + (j - gap_start)
+        if old[pos:pos + BLOCK] != new[j:j + BLOCK]:
+            pos = index.get(new[j:j + BLOCK])
+            if pos is None:
+                j += 1
+                continue
+
+        # extend the match in both directions
+        start = j
+        while start > gap_start and pos > 0 and old[pos - 1] == new[start - 1]:
+            start -= 1
+            pos -= 1
+        end = j + BLOCK
+        while end < len(new) and pos + end - start < len(old) and old[pos + end - start] == new[end]:
+            end += 1
+
+        emit_gap(w, old, new[gap_start:start])
+        w.seek(pos)
+        w.record(OP_COPY, end - start)
+        w.old_pos += end - start
+
+        gap_start = j = end
+
+    emit_gap(w, old, new[gap_start:])
+    return bytes(w.out)
+
+
+def emit_gap(w, old, gap):
+    # A gap between two matches is usually the same code with a few changed bytes (e.g. shifted addresses)
+    base = old[w.old_pos:w.old_pos + len(gap)]
+    if len(base) == len(gap) and similar(base, gap):
+        w.diff(base, gap)
+    else:
+        w.insert(gap)
+
+
+def apply_patch(old, patch):
+    """Reference decoder, the same as co_patch_write"""
+    assert patch[:4] == MAGIC
+    out = bytearray()
+    pos, i = 0, 4
+    while i < len(patch):
+        op = patch[i]
+        i += 1
+        arg, shift = 0, 0
+        while True:
+            b = patch[i]
+            i += 1
+            arg |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                break
+        if op == OP_COPY:
+            out += old[pos:pos + arg]
+            pos += arg
+        elif op == OP_ADD:
+            out += bytes((o + d) & 0xFF for o, d in zip(old[pos:pos + arg], patch[i:i + arg]))
+            pos += arg
+            i += arg
+        elif op == OP_INSERT:
+            out += patch[i:i + arg]
+            i += arg
+        elif op == OP_SEEK:
+            pos += (arg >> 1) ^ -(arg & 1)
+        else:
+            raise ValueError("invalid op %d" % op)
+    return bytes(out)
+
+
+def main():
+    if len(sys.argv) != 4:
+        print(__doc__)
+        sys.exit(1)
+
+    with open(sys.argv[1], "rb") as f:
+        old = f.read()
+    with open(sys.argv[2], "rb") as f:
+        new = f.read()
+
+    patch = create_patch(old, new)
+    if apply_patch(old, patch) != new:
+        raise RuntimeError("patch verification failed")
+
+    with open(sys.argv[3], "wb") as f:
+        f.write(patch)
+
+    print("firmware %d bytes, patch %d bytes (%.1f%%)" % (len(new), len(patch), 100.0 * len(patch) / len(new)))
+    print("op=start&data=%d&patch=%d" % (len(patch), len(new)))
+
+
+if __name__ == "__main__":
+    main()